@@ -0,0 +1,38 @@
+#pragma once
+
+//
+//  Heap allocation counter (debug build)
+//  - counts operator new calls of each thread, to check that PLAY / REC run without allocations
+//    once started (the tape, play render and tape writer threads)
+//  - operator new is replaced in em8RL1.cpp for _DEBUG only, the counts stay 0 in release builds
+//
+
+#include <stdint.h>
+
+class AllocationCounter {
+public:
+	static constexpr bool is_enabled(void) {
+#ifdef _DEBUG
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	// from operator new
+	static void add(void) {
+		m_thread_count++;
+	}
+
+	// allocations by the calling thread since reset_thread_count()
+	static uint64_t get_thread_count(void) {
+		return m_thread_count;
+	}
+
+	static void reset_thread_count(void) {
+		m_thread_count = 0;
+	}
+
+private:
+	static inline thread_local uint64_t m_thread_count = 0;
+};
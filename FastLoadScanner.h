@@ -0,0 +1,125 @@
+#pragma once
+
+//
+//  Fast load: parts of a tape image that PLAY can skip
+//  - blank (no level change) longer than BLANK_KEEP_SEC: the rest after BLANK_KEEP_SEC
+//  - leader longer than LEADER_MIN_SEC: all but the last LEADER_KEEP_SEC
+//    A leader is a run of bit 0 periods (X1 standard: 125usec high + 125usec low).
+//    X1 data has a start bit 1 in every 9 bits, so a data block is never taken for a leader.
+//  - ranges start and end on a level change (leader) or inside one level (blank),
+//    so the signal around a skip is the same as the tape
+//
+//  The scan goes through the tape data once, in blocks (runs of one level skip whole bytes, see RunExtractor).
+//
+
+#include <stdint.h>
+#include <vector>
+#include "RunExtractor.h"
+
+class FastLoadScanner {
+public:
+	struct skip_t {
+		uint64_t from;   // tape bit position
+		uint64_t to;     // PLAY continues here
+	};
+
+	static constexpr double BLANK_KEEP_SEC = 1.0;
+	static constexpr double LEADER_MIN_SEC = 2.0;
+	static constexpr double LEADER_KEEP_SEC = 1.0;
+	static constexpr double LEADER_MIN_PERIOD_USEC = 150;   // bit 0: 250usec
+	static constexpr double LEADER_MAX_PERIOD_USEC = 375;   // bit 1: 500usec
+
+	FastLoadScanner(int tape_hz) {
+		m_blank_keep_bits = (uint64_t)(BLANK_KEEP_SEC * tape_hz);
+		m_leader_min_bits = (uint64_t)(LEADER_MIN_SEC * tape_hz);
+		m_leader_keep_bits = (uint64_t)(LEADER_KEEP_SEC * tape_hz);
+		m_leader_keep_periods = (int)(LEADER_KEEP_SEC * 1000000 / LEADER_MIN_PERIOD_USEC) + 1;
+		m_min_period_bits = (uint64_t)(LEADER_MIN_PERIOD_USEC * tape_hz / 1000000);
+		m_max_period_bits = (uint64_t)(LEADER_MAX_PERIOD_USEC * tape_hz / 1000000);
+		m_period_starts.resize(m_leader_keep_periods);
+
+		m_high_start = 0;
+		m_high_bits = 0;
+		m_leader_periods = 0;
+		m_leader_start = 0;
+	}
+
+	// tape data (1 bit per sample, MSB first, high = 1), in order
+	void add_data(const uint8_t* data, size_t length, std::vector<skip_t>& skips) {
+		m_runs.add_bits(data, length, false, [this, &skips](int level, uint64_t start, uint64_t length) {
+			add_run(level, start, length, skips);
+		});
+	}
+
+	// end of the tape
+	void finish(std::vector<skip_t>& skips) {
+		m_runs.finish([this, &skips](int level, uint64_t start, uint64_t length) {
+			add_run(level, start, length, skips);
+		});
+		end_leader(m_runs.get_pos(), skips);
+	}
+
+private:
+	void add_run(int level, uint64_t start, uint64_t length, std::vector<skip_t>& skips) {
+		if (length > m_blank_keep_bits) {
+			end_leader(start, skips);
+			skips.push_back({ start + m_blank_keep_bits, start + length });
+			m_high_bits = 0;
+			return;
+		}
+		if (level == 1) {
+			m_high_start = start;
+			m_high_bits = length;
+			return;
+		}
+		if (m_high_bits == 0) {
+			return;
+		}
+
+		// a period (high + low)
+		uint64_t period = m_high_bits + length;
+		if (period >= m_min_period_bits && period <= m_max_period_bits) {
+			if (m_leader_periods == 0) {
+				m_leader_start = m_high_start;
+			}
+			m_period_starts[m_leader_periods % m_leader_keep_periods] = m_high_start;
+			m_leader_periods++;
+		}
+		else {
+			end_leader(m_high_start, skips);
+		}
+		m_high_bits = 0;
+	}
+
+	// end: the first bit after the leader
+	void end_leader(uint64_t end, std::vector<skip_t>& skips) {
+		if (m_leader_periods > 0 && end - m_leader_start > m_leader_min_bits) {
+			// up to the latest period that leaves LEADER_KEEP_SEC
+			int64_t count = (m_leader_periods < m_leader_keep_periods) ? m_leader_periods : m_leader_keep_periods;
+			for (int64_t index = m_leader_periods - 1; index >= m_leader_periods - count; index--) {
+				uint64_t keep_start = m_period_starts[index % m_leader_keep_periods];
+				if (end - keep_start >= m_leader_keep_bits) {
+					if (keep_start > m_leader_start) {
+						skips.push_back({ m_leader_start, keep_start });
+					}
+					break;
+				}
+			}
+		}
+		m_leader_periods = 0;
+	}
+
+	uint64_t m_blank_keep_bits;
+	uint64_t m_leader_min_bits;
+	uint64_t m_leader_keep_bits;
+	int m_leader_keep_periods;      // most periods in LEADER_KEEP_SEC
+	uint64_t m_min_period_bits;
+	uint64_t m_max_period_bits;
+
+	RunExtractor m_runs;
+	uint64_t m_high_start;
+	uint64_t m_high_bits;           // 0: no high waiting for its low
+	int64_t m_leader_periods;
+	uint64_t m_leader_start;
+	std::vector<uint64_t> m_period_starts;  // of the last m_leader_keep_periods periods
+};
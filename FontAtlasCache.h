@@ -0,0 +1,346 @@
+#pragma once
+
+//
+//  ImGui font atlas with only the glyphs the UI shows
+//  - the UI text is ASCII, Japanese comes only from tape / file names:
+//    the atlas has the default ranges plus the characters given to add_text()
+//  - a new character makes the atlas dirty, rebuild() bakes it again (between frames)
+//  - the baked atlas is cached in a file keyed by the font file size and write time, so a
+//    start with known characters neither reads nor rasterizes the font (the cache only grows).
+//    The font is hashed only when these differ (e.g. a font file copied back unchanged)
+//
+//  Cache file (little endian)
+//    header_t, codepoints (32bit x codepoint_count), ImFontGlyph x glyph_count,
+//    texture (8bit alpha, width x height)
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <system_error>
+#include "imgui.h"
+#include "imgui_internal.h"
+
+class FontAtlasCache {
+public:
+	FontAtlasCache(void) {
+		m_size = 0;
+		m_font_bytes = 0;
+		m_font_write_time = 0;
+		m_font_hash = 0;
+		m_is_font_found = false;
+		m_is_dirty = false;
+		m_codepoints.resize(IM_UNICODE_CODEPOINT_MAX + 1, false);
+	}
+
+	// after ImGui::CreateContext(), font_path: UTF-8
+	// false if the font file can't be read (the ImGui default font is used)
+	bool open(const char* font_path, const wchar_t* cache_path, float size) {
+		m_font_path = font_path;
+		m_cache_path = cache_path;
+		m_size = size;
+		for (const ImWchar* range = ImGui::GetIO().Fonts->GetGlyphRangesDefault(); range[0] != 0; range += 2) {
+			for (unsigned int codepoint = range[0]; codepoint <= range[1]; codepoint++) {
+				m_codepoints[codepoint] = true;
+			}
+		}
+		// only a stat here, this is on the UI thread before the first frame
+		std::error_code error;
+		std::filesystem::path path = std::filesystem::u8path(font_path);
+		m_font_bytes = (uint64_t)std::filesystem::file_size(path, error);
+		if (error) {
+			return false;
+		}
+		m_font_write_time = (uint64_t)std::filesystem::last_write_time(path, error).time_since_epoch().count();
+		if (error) {
+			return false;
+		}
+		m_is_font_found = true;
+		m_is_dirty = true;
+		return true;
+	}
+
+	// characters to show (UTF-8), the atlas is dirty if some are new
+	void add_text(const char* text) {
+		while (*text != 0) {
+			unsigned int codepoint;
+			text += ImTextCharFromUtf8(&codepoint, text, NULL);
+			if (codepoint <= IM_UNICODE_CODEPOINT_MAX && m_codepoints[codepoint] == false) {
+				m_codepoints[codepoint] = true;
+				m_is_dirty = m_is_font_found;
+			}
+		}
+	}
+
+	bool is_dirty(void) {
+		return m_is_dirty;
+	}
+
+	// io.Fonts from the cache file, or from the font file (and saved to the cache).
+	// Not between NewFrame() and Render(), the renderer font texture has to be made again.
+	void rebuild(void) {
+		ImFontAtlas* atlas = ImGui::GetIO().Fonts;
+
+		m_is_dirty = false;
+		if (load_cache(atlas) == true) {
+			return;
+		}
+
+		ImFontGlyphRangesBuilder builder;
+		for (unsigned int codepoint = 1; codepoint < m_codepoints.size(); codepoint++) {
+			if (m_codepoints[codepoint] == true) {
+				builder.AddChar((ImWchar)codepoint);
+			}
+		}
+		m_ranges.clear();
+		builder.BuildRanges(&m_ranges);
+
+		atlas->Clear();
+		if (atlas->AddFontFromFileTTF(m_font_path.c_str(), m_size, NULL, m_ranges.Data) == NULL || atlas->Build() == false) {
+			atlas->Clear();
+			atlas->AddFontDefault();
+			return;
+		}
+		save_cache(atlas);
+	}
+
+private:
+	struct header_t {
+		char magic[4];
+		uint32_t imgui_version;   // ImFont / ImFontGlyph layout
+		uint64_t font_bytes;
+		uint64_t font_write_time;
+		uint64_t font_hash;
+		float size;
+		float ascent;
+		float descent;
+		uint32_t fallback_char;
+		uint32_t ellipsis_char;
+		uint32_t dot_char;
+		uint32_t codepoint_count;
+		uint32_t glyph_count;
+		uint32_t width;
+		uint32_t height;
+		float uv_white_pixel[2];
+		float uv_lines[IM_DRAWLIST_TEX_LINES_WIDTH_MAX + 1][4];
+	};
+
+	static constexpr char MAGIC[4] = { 'E', '8', 'F', 'B' };   // B: keyed by the font file size and write time
+
+	// FNV-1a 64bit of the whole file (opened as ImGui opens it), 0 if it can't be read
+	uint64_t get_font_hash(void) {
+		if (m_font_hash == 0 && hash_file(m_font_path.c_str(), &m_font_hash) == false) {
+			m_font_hash = 0;
+		}
+		return m_font_hash;
+	}
+
+	static bool hash_file(const char* file_path, uint64_t* hash) {
+		std::vector<uint8_t> block(READ_BLOCK_BYTES);
+		uint64_t length;
+
+		ImFileHandle file = ImFileOpen(file_path, "rb");
+		if (file == NULL) {
+			return false;
+		}
+		*hash = 0xcbf29ce484222325ULL;
+		while ((length = ImFileRead(block.data(), 1, block.size(), file)) > 0) {
+			for (uint64_t index = 0; index < length; index++) {
+				*hash = (*hash ^ block[index]) * 0x100000001b3ULL;
+			}
+		}
+		ImFileClose(file);
+		return true;
+	}
+
+	// true if the cache has all the characters
+	bool load_cache(ImFontAtlas* atlas) {
+		FILE* fp;
+		header_t header;
+		bool is_loaded = false;
+
+		if (_wfopen_s(&fp, m_cache_path.c_str(), L"rb") != 0 || fp == NULL) {
+			return false;
+		}
+		if (fread(&header, sizeof(header), 1, fp) == 1 && memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0
+			&& header.imgui_version == IMGUI_VERSION_NUM && header.size == m_size
+			&& header.codepoint_count <= m_codepoints.size() && header.glyph_count <= m_codepoints.size()
+			&& header.width <= MAX_TEXTURE_SIZE && header.height <= MAX_TEXTURE_SIZE
+			&& is_same_font(header) == true) {
+			std::vector<uint32_t> codepoints(header.codepoint_count);
+			std::vector<ImFontGlyph> glyphs(header.glyph_count);
+			unsigned char* pixels = (unsigned char*)IM_ALLOC((size_t)header.width * header.height);
+
+			if (fread(codepoints.data(), sizeof(uint32_t), codepoints.size(), fp) == codepoints.size()
+				&& fread(glyphs.data(), sizeof(ImFontGlyph), glyphs.size(), fp) == glyphs.size()
+				&& fread(pixels, 1, (size_t)header.width * header.height, fp) == (size_t)header.width * header.height) {
+				is_loaded = has_all_codepoints(codepoints);
+				if (is_loaded == false) {
+					// rebuilt with the cached characters too
+					for (auto codepoint : codepoints) {
+						if (codepoint < m_codepoints.size()) {
+							m_codepoints[codepoint] = true;
+						}
+					}
+				}
+			}
+			if (is_loaded == true) {
+				set_atlas(atlas, header, glyphs, pixels);
+			}
+			else {
+				IM_FREE(pixels);
+			}
+		}
+		fclose(fp);
+		if (is_loaded == true && (header.font_bytes != m_font_bytes || header.font_write_time != m_font_write_time)) {
+			// the same font by the hash: no hashing at the next start
+			update_cache_header(header);
+		}
+		return is_loaded;
+	}
+
+	bool is_same_font(const header_t& header) {
+		if (header.font_bytes == m_font_bytes && header.font_write_time == m_font_write_time) {
+			return true;
+		}
+		return (header.font_bytes == m_font_bytes && header.font_hash != 0 && header.font_hash == get_font_hash());
+	}
+
+	// not fatal: the font is hashed again at the next start
+	void update_cache_header(header_t header) {
+		FILE* fp;
+
+		header.font_write_time = m_font_write_time;
+		if (_wfopen_s(&fp, m_cache_path.c_str(), L"r+b") != 0 || fp == NULL) {
+			return;
+		}
+		fwrite(&header, sizeof(header), 1, fp);
+		fclose(fp);
+	}
+
+	bool has_all_codepoints(const std::vector<uint32_t>& codepoints) {
+		std::vector<bool> cached(m_codepoints.size(), false);
+
+		for (auto codepoint : codepoints) {
+			if (codepoint < cached.size()) {
+				cached[codepoint] = true;
+			}
+		}
+		for (size_t codepoint = 1; codepoint < m_codepoints.size(); codepoint++) {
+			if (m_codepoints[codepoint] == true && cached[codepoint] == false) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// the font and texture as ImFontAtlas::Build() leaves them (pixels: owned by the atlas)
+	void set_atlas(ImFontAtlas* atlas, const header_t& header, const std::vector<ImFontGlyph>& glyphs, unsigned char* pixels) {
+		ImFontConfig config;
+
+		atlas->Clear();
+		config.SizePixels = m_size;
+		config.FontDataOwnedByAtlas = false;
+		snprintf(config.Name, sizeof(config.Name), "font cache, %dpx", (int)m_size);
+		atlas->ConfigData.push_back(config);
+
+		atlas->TexPixelsAlpha8 = pixels;
+		atlas->TexWidth = (int)header.width;
+		atlas->TexHeight = (int)header.height;
+		atlas->TexUvScale = ImVec2(1.0f / atlas->TexWidth, 1.0f / atlas->TexHeight);
+		atlas->TexUvWhitePixel = ImVec2(header.uv_white_pixel[0], header.uv_white_pixel[1]);
+		for (int index = 0; index <= IM_DRAWLIST_TEX_LINES_WIDTH_MAX; index++) {
+			atlas->TexUvLines[index] = ImVec4(header.uv_lines[index][0], header.uv_lines[index][1], header.uv_lines[index][2], header.uv_lines[index][3]);
+		}
+
+		ImFont* font = IM_NEW(ImFont);
+		atlas->Fonts.push_back(font);
+		font->ContainerAtlas = atlas;
+		font->ConfigData = &atlas->ConfigData.back();
+		font->ConfigDataCount = 1;
+		font->FontSize = m_size;
+		font->Ascent = header.ascent;
+		font->Descent = header.descent;
+		for (auto& glyph : glyphs) {
+			font->AddGlyph(NULL, (ImWchar)glyph.Codepoint, glyph.X0, glyph.Y0, glyph.X1, glyph.Y1,
+				glyph.U0, glyph.V0, glyph.U1, glyph.V1, glyph.AdvanceX);
+		}
+		font->FallbackChar = (ImWchar)header.fallback_char;
+		font->EllipsisChar = (ImWchar)header.ellipsis_char;
+		font->DotChar = (ImWchar)header.dot_char;
+		font->BuildLookupTable();
+		atlas->ConfigData.back().DstFont = font;
+		atlas->TexReady = true;
+	}
+
+	// not fatal: built from the font file again at the next start
+	void save_cache(ImFontAtlas* atlas) {
+		FILE* fp;
+		header_t header;
+		ImFont* font = atlas->Fonts[0];
+		unsigned char* pixels;
+		int width;
+		int height;
+		std::vector<uint32_t> codepoints;
+
+		atlas->GetTexDataAsAlpha8(&pixels, &width, &height);
+		for (uint32_t codepoint = 1; codepoint < m_codepoints.size(); codepoint++) {
+			if (m_codepoints[codepoint] == true) {
+				codepoints.push_back(codepoint);
+			}
+		}
+
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, MAGIC, sizeof(MAGIC));
+		header.imgui_version = IMGUI_VERSION_NUM;
+		header.font_bytes = m_font_bytes;
+		header.font_write_time = m_font_write_time;
+		header.font_hash = get_font_hash();
+		header.size = m_size;
+		header.ascent = font->Ascent;
+		header.descent = font->Descent;
+		header.fallback_char = font->FallbackChar;
+		header.ellipsis_char = font->EllipsisChar;
+		header.dot_char = font->DotChar;
+		header.codepoint_count = (uint32_t)codepoints.size();
+		header.glyph_count = (uint32_t)font->Glyphs.Size;
+		header.width = width;
+		header.height = height;
+		header.uv_white_pixel[0] = atlas->TexUvWhitePixel.x;
+		header.uv_white_pixel[1] = atlas->TexUvWhitePixel.y;
+		for (int index = 0; index <= IM_DRAWLIST_TEX_LINES_WIDTH_MAX; index++) {
+			header.uv_lines[index][0] = atlas->TexUvLines[index].x;
+			header.uv_lines[index][1] = atlas->TexUvLines[index].y;
+			header.uv_lines[index][2] = atlas->TexUvLines[index].z;
+			header.uv_lines[index][3] = atlas->TexUvLines[index].w;
+		}
+
+		if (_wfopen_s(&fp, m_cache_path.c_str(), L"wb") != 0 || fp == NULL) {
+			return;
+		}
+		bool is_written = (fwrite(&header, sizeof(header), 1, fp) == 1
+			&& fwrite(codepoints.data(), sizeof(uint32_t), codepoints.size(), fp) == codepoints.size()
+			&& fwrite(font->Glyphs.Data, sizeof(ImFontGlyph), font->Glyphs.Size, fp) == (size_t)font->Glyphs.Size
+			&& fwrite(pixels, 1, (size_t)width * height, fp) == (size_t)width * height);
+		if (fclose(fp) != 0 || is_written == false) {
+			_wremove(m_cache_path.c_str());
+		}
+	}
+
+	static constexpr size_t READ_BLOCK_BYTES = 1024 * 1024;
+	static constexpr uint32_t MAX_TEXTURE_SIZE = 16384;   // a broken cache file is not loaded
+
+	std::string m_font_path;
+	std::wstring m_cache_path;
+	float m_size;
+	uint64_t m_font_bytes;          // the cache key
+	uint64_t m_font_write_time;
+	uint64_t m_font_hash;           // 0: not hashed yet, only when the key has changed or the cache is saved
+	bool m_is_font_found;
+	bool m_is_dirty;
+	std::vector<bool> m_codepoints; // to be in the atlas
+	ImVector<ImWchar> m_ranges;     // for the atlas being built
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+//
+//  REC bit decoder with a software PLL
+//  - X1 writes a bit as a high and a low of the same width: 125usec each for 0, 250usec for 1
+//  - the loop tracks the unit width (the half period of bit 0) from every measured period,
+//    so loaders that run faster or slower than the standard, or drift, are still decoded
+//  - a bit is 1 if its period (high + low) is over 3 units, i.e. decided on the whole period,
+//    not on the high width alone (duty cycle errors don't matter)
+//  - works on whole buffers: USB / tape bitstreams or edge capture records
+//
+
+#include <stdint.h>
+#include <vector>
+#include "RunExtractor.h"
+
+class PllDecoder {
+public:
+	struct symbol_t {
+		uint8_t bit;
+		uint64_t blank_usec;  // > 0: blank (no signal) of this length instead of a bit
+	};
+
+	static constexpr double STANDARD_UNIT_USEC = 125;
+	static constexpr double MIN_UNIT_USEC = 50;
+	static constexpr double MAX_UNIT_USEC = 300;
+	static constexpr double BLANK_USEC = 500000;     // low longer than this is written as blank
+
+	PllDecoder(void) {
+		reset();
+	}
+
+	void reset(void) {
+		m_unit_usec = STANDARD_UNIT_USEC;
+		m_drift_usec = 0;
+		m_unit_time = 0;
+		m_runs.reset();
+		m_high_usec = -1;
+		m_bit_count = 0;
+		m_ambiguous_count = 0;
+		m_unlock_count = 0;
+	}
+
+	// bitstream, 1 bit per sample (MSB first)
+	//  is_inverted: true for the USB data (EZ-USB input is inverted), false for a tape image
+	void add_bits(const uint8_t* data, size_t length, int sample_rate, bool is_inverted, std::vector<symbol_t>& symbols) {
+		m_unit_time = 1000000.0 / sample_rate;
+		m_runs.add_bits(data, length, is_inverted, [this, &symbols](int level, uint64_t start, uint64_t units) {
+			add_run(level, units * m_unit_time, symbols);
+		});
+	}
+
+	// Edge capture data: 1 byte per run  bit7: level (inverted), bit6:0: duration in tick_hz ticks
+	void add_capture_data(const uint8_t* data, size_t length, int tick_hz, std::vector<symbol_t>& symbols) {
+		m_unit_time = 1000000.0 / tick_hz;
+		m_runs.add_capture_data(data, length, [this, &symbols](int level, uint64_t start, uint64_t units) {
+			add_run(level, units * m_unit_time, symbols);
+		});
+	}
+
+	// end of the data: the last low becomes blank
+	void finish(std::vector<symbol_t>& symbols) {
+		if (m_runs.get_level() == 0 && m_runs.get_run_length() > 0) {
+			add_last_bit(symbols);
+			symbols.push_back({ 0, (uint64_t)(m_runs.get_run_length() * m_unit_time) });
+		}
+		m_runs.reset();
+		m_high_usec = -1;
+	}
+
+	// tracked width of the bit 0 high (125usec as standard)
+	double get_unit_usec(void) {
+		return m_unit_usec;
+	}
+
+	uint64_t get_bit_count(void) {
+		return m_bit_count;
+	}
+
+	// periods close to the 0 / 1 boundary
+	uint64_t get_ambiguous_count(void) {
+		return m_ambiguous_count;
+	}
+
+	// periods out of the tracking range (ignored)
+	uint64_t get_unlock_count(void) {
+		return m_unlock_count;
+	}
+
+private:
+	void add_run(int level, double width_usec, std::vector<symbol_t>& symbols) {
+		if (level == 1) {
+			m_high_usec = width_usec;
+			return;
+		}
+		if (width_usec > BLANK_USEC) {
+			add_last_bit(symbols);
+			symbols.push_back({ 0, (uint64_t)width_usec });
+			return;
+		}
+		if (m_high_usec < 0) {
+			return;
+		}
+
+		double period = m_high_usec + width_usec;
+		m_high_usec = -1;
+		// the loop holds its clock over noise and gaps
+		if (period < m_unit_usec * 1.25 || period > m_unit_usec * 6) {
+			m_unlock_count++;
+			return;
+		}
+
+		uint8_t bit = (period > m_unit_usec * 3) ? 1 : 0;
+		if (period > m_unit_usec * 2.75 && period < m_unit_usec * 3.25) {
+			m_ambiguous_count++;
+		}
+		symbols.push_back({ bit, 0 });
+		m_bit_count++;
+
+		// 2nd order loop: follows a drifting clock without a steady error
+		double error = period / ((bit == 1) ? 4 : 2) - m_unit_usec;
+		m_drift_usec += error * LOOP_GAIN_I;
+		if (m_drift_usec > MAX_DRIFT_USEC || m_drift_usec < -MAX_DRIFT_USEC) {
+			m_drift_usec = (m_drift_usec > 0) ? MAX_DRIFT_USEC : -MAX_DRIFT_USEC;
+		}
+		m_unit_usec += error * LOOP_GAIN_P + m_drift_usec;
+		if (m_unit_usec < MIN_UNIT_USEC) {
+			m_unit_usec = MIN_UNIT_USEC;
+			m_drift_usec = 0;
+		}
+		else if (m_unit_usec > MAX_UNIT_USEC) {
+			m_unit_usec = MAX_UNIT_USEC;
+			m_drift_usec = 0;
+		}
+	}
+
+	// the low of the bit before a blank can't be measured: decided on the high alone
+	void add_last_bit(std::vector<symbol_t>& symbols) {
+		if (m_high_usec > m_unit_usec * 0.5 && m_high_usec < m_unit_usec * 3) {
+			symbols.push_back({ (uint8_t)((m_high_usec > m_unit_usec * 1.5) ? 1 : 0), 0 });
+			m_bit_count++;
+		}
+		m_high_usec = -1;
+	}
+
+	static constexpr double LOOP_GAIN_P = 1.0 / 8;
+	static constexpr double LOOP_GAIN_I = 1.0 / 256;
+	static constexpr double MAX_DRIFT_USEC = 1.0;
+
+	double m_unit_usec;
+	double m_drift_usec;     // per bit
+	double m_unit_time;      // usec per input unit (sample / tick)
+	RunExtractor m_runs;
+	double m_high_usec;      // high waiting for its low, -1 if none
+	uint64_t m_bit_count;
+	uint64_t m_ambiguous_count;
+	uint64_t m_unlock_count;
+};
@@ -0,0 +1,187 @@
+#pragma once
+
+//
+//  REC signal analyzer
+//  - pulse width histograms of the X1 output while saving (high and low separately)
+//  - width / jitter of the short (bit 0: 125usec) and long (bit 1: 250usec) pulses,
+//    duty cycle and its drift, and how close the pulses came to the bit decision point
+//  - fed by the tape writer thread with each USB buffer (a few usec per 10msec of data),
+//    the UI reads a copy published once per buffer
+//
+//  Levels are as X1 outputs (the USB data is inverted, as the tape writer does).
+//
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <mutex>
+#include "RunExtractor.h"
+
+class PulseAnalyzer {
+public:
+	static constexpr int HISTOGRAM_BINS = 64;
+	static constexpr int HISTOGRAM_BIN_USEC = 10;          // 0 - 640usec
+	static constexpr double MAX_PULSE_USEC = 1000;         // longer runs are blank, not pulses
+	static constexpr double SHORT_PULSE_USEC = 125;        // X1 standard: bit 0
+	static constexpr double LONG_PULSE_USEC = 250;         // X1 standard: bit 1
+	static constexpr double STANDARD_JUDGE_USEC = 187.5;
+	static constexpr double MARGINAL_USEC = 31.25;         // within this from the decision point
+
+	struct width_t {
+		uint64_t count;
+		double sum;
+		double sum_squares;
+
+		void add(double width_usec) {
+			count++;
+			sum += width_usec;
+			sum_squares += width_usec * width_usec;
+		}
+
+		double get_mean(void) const {
+			return (count > 0) ? sum / count : 0;
+		}
+
+		// standard deviation
+		double get_jitter(void) const {
+			if (count < 2) {
+				return 0;
+			}
+			double mean = get_mean();
+			double variance = sum_squares / count - mean * mean;
+			return (variance > 0) ? sqrt(variance) : 0;
+		}
+	};
+
+	struct stats_t {
+		uint32_t high_histogram[HISTOGRAM_BINS];
+		uint32_t low_histogram[HISTOGRAM_BINS];  // the last bin includes longer ones up to MAX_PULSE_USEC
+		uint64_t pulse_count;        // high pulses
+		uint64_t blank_count;        // runs over MAX_PULSE_USEC
+		width_t short_high;
+		width_t long_high;
+		width_t short_low;           // low after a short high
+		width_t long_low;
+		double judge_usec;           // bit decision point of the tape writer
+		double short_margin_usec;    // judge - the widest short high (how close a 0 came to be read as 1)
+		double long_margin_usec;     // the narrowest long high - judge
+		uint64_t marginal_count;     // highs within MARGINAL_USEC of judge
+		uint64_t period_count;       // high + low pairs
+		double duty_sum;             // high / (high + low), 0.5 is standard
+		double duty_recent;          // same, averaged over the last DUTY_RECENT_PERIODS or so
+
+		double get_duty(void) const {
+			return (period_count > 0) ? duty_sum / period_count : 0;
+		}
+	};
+
+	PulseAnalyzer(void) {
+		reset(STANDARD_JUDGE_USEC);
+	}
+
+	// start of REC
+	void reset(double judge_usec) {
+		memset(&m_stats, 0, sizeof(m_stats));
+		m_stats.judge_usec = judge_usec;
+		m_stats.short_margin_usec = judge_usec;
+		m_stats.long_margin_usec = MAX_PULSE_USEC;
+		m_runs.reset();
+		m_prev_high_usec = -1;
+		publish();
+	}
+
+	// REC bitstream (1 bit per sample, MSB first)
+	void add_usb_data(const uint8_t* data, size_t length, int sample_rate) {
+		m_unit_usec = 1000000.0 / sample_rate;
+		m_runs.add_bits(data, length, true, [this](int level, uint64_t start, uint64_t units) {
+			add_run(level, units * m_unit_usec);
+		});
+		publish();
+	}
+
+	// Edge capture data: 1 byte per run  bit7: level, bit6:0: duration in tick_hz ticks
+	// (long runs come as several records of the same level)
+	void add_capture_data(const uint8_t* data, size_t length, int tick_hz) {
+		m_unit_usec = 1000000.0 / tick_hz;
+		m_runs.add_capture_data(data, length, [this](int level, uint64_t start, uint64_t units) {
+			add_run(level, units * m_unit_usec);
+		});
+		publish();
+	}
+
+	// copy of the stats as of the last buffer
+	stats_t get_stats(void) {
+		std::lock_guard<std::mutex> lock(m_lock);
+		return m_snapshot;
+	}
+
+private:
+	void add_run(int level, double width_usec) {
+		if (width_usec > MAX_PULSE_USEC) {
+			m_stats.blank_count++;
+			m_prev_high_usec = -1;
+			return;
+		}
+		int bin = (int)(width_usec / HISTOGRAM_BIN_USEC);
+		if (bin >= HISTOGRAM_BINS) {
+			bin = HISTOGRAM_BINS - 1;
+		}
+
+		if (level == 1) {
+			m_stats.high_histogram[bin]++;
+			m_stats.pulse_count++;
+			if (width_usec < m_stats.judge_usec) {
+				m_stats.short_high.add(width_usec);
+				if (m_stats.judge_usec - width_usec < m_stats.short_margin_usec) {
+					m_stats.short_margin_usec = m_stats.judge_usec - width_usec;
+				}
+			}
+			else {
+				m_stats.long_high.add(width_usec);
+				if (width_usec - m_stats.judge_usec < m_stats.long_margin_usec) {
+					m_stats.long_margin_usec = width_usec - m_stats.judge_usec;
+				}
+			}
+			if (fabs(width_usec - m_stats.judge_usec) < MARGINAL_USEC) {
+				m_stats.marginal_count++;
+			}
+			m_prev_high_usec = width_usec;
+		}
+		else {
+			m_stats.low_histogram[bin]++;
+			if (m_prev_high_usec < 0) {
+				return;
+			}
+			if (m_prev_high_usec < m_stats.judge_usec) {
+				m_stats.short_low.add(width_usec);
+			}
+			else {
+				m_stats.long_low.add(width_usec);
+			}
+			double duty = m_prev_high_usec / (m_prev_high_usec + width_usec);
+			if (m_stats.period_count == 0) {
+				m_stats.duty_recent = duty;
+			}
+			m_stats.duty_recent += (duty - m_stats.duty_recent) / DUTY_RECENT_PERIODS;
+			m_stats.duty_sum += duty;
+			m_stats.period_count++;
+			m_prev_high_usec = -1;
+		}
+	}
+
+	void publish(void) {
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_snapshot = m_stats;
+	}
+
+	static constexpr int DUTY_RECENT_PERIODS = 256;
+
+	// tape writer thread only
+	stats_t m_stats;
+	RunExtractor m_runs;
+	double m_unit_usec;
+	double m_prev_high_usec;      // high waiting for its low, -1 if none
+
+	std::mutex m_lock;
+	stats_t m_snapshot;
+};
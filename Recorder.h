@@ -2,13 +2,25 @@
 
 #include <stdio.h>
 #include <libusb.h>
+#include <winioctl.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <io.h>
-#include <queue>
+#include <vector>
 #include <mutex>
 #include <condition_variable>
 #include <thread>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <string>
+#include "UsbTransport.h"
+#include "Trace.h"
+#include "PulseAnalyzer.h"
+#include "PllDecoder.h"
+#include "FastLoadScanner.h"
+#include "AllocationCounter.h"
+#include "ThreadPriority.h"
 
 class BitStream {
 public:
@@ -23,32 +35,23 @@ public:
 		m_dirty = false;
 	}
 
-	~BitStream() {
-		if (m_byte_data != nullptr) {
-			delete[] m_byte_data;
-		}
-	}
-
-	void set_bit_pos(uint32_t pos)
+	void set_bit_pos(uint64_t pos)
 	{
-		m_byte_offset = pos / 8;
-		m_bit_offset = pos % 8;
+		m_byte_offset = (int64_t)(pos / 8);
+		m_bit_offset = (int)(pos % 8);
+		m_mask = 0x80 >> m_bit_offset;
 		update_current_byte();
 	}
 
-	uint32_t get_bit_pos(void)
+	uint64_t get_bit_pos(void)
 	{
-		return (uint32_t)(m_byte_offset * 8) + m_bit_offset;
+		return (uint64_t)m_byte_offset * 8 + m_bit_offset;
 	}
 
+	// the data is not copied, keep it while the stream is used
 	virtual void set_byte_stream(uint8_t* data, size_t length) {
-		if (m_byte_data != nullptr) {
-			delete[] m_byte_data;
-			m_byte_data = nullptr;
-		}
-		m_byte_data = new uint8_t[length];
-		memcpy(m_byte_data, data, length);
-		m_byte_length = length;
+		m_byte_data = data;
+		m_byte_length = (int64_t)length;
 
 		m_bit_offset = 0;
 		m_byte_offset = 0;
@@ -85,7 +88,7 @@ public:
 		m_dirty = true;
 	}
 
-	void flush(void)
+	virtual void flush(void)
 	{
 		if (m_dirty == true) {
 			write_current_byte();
@@ -101,7 +104,7 @@ public:
 			m_bit_offset = 0;
 			m_mask = 0x80;
 			m_byte_offset++;
-			if (m_byte_offset >= (int)m_byte_length) {
+			if (m_byte_offset >= m_byte_length && extend() == false) {
 				m_mask = 0x01;
 				m_bit_offset = 7;
 				m_byte_offset--;
@@ -115,6 +118,23 @@ public:
 		return 0;
 	}
 
+	// byte aligned access (for byte-oriented data in the stream)
+	uint8_t get_byte(void) {
+		return m_current_byte;
+	}
+
+	int move_forward_byte(void) {
+		m_byte_offset++;
+		if (m_byte_offset >= m_byte_length && extend() == false) {
+			m_mask = 0x01;
+			m_bit_offset = 7;
+			m_byte_offset--;
+			return -1;
+		}
+		update_current_byte();
+		return 0;
+	}
+
 	int move_backward(void) {
 		m_bit_offset--;
 		if (m_bit_offset < 0) {
@@ -144,6 +164,12 @@ protected:
 		m_current_byte = m_byte_data[m_byte_offset];
 	}
 
+	// called at the end of the data, true if the data has been made longer
+	virtual bool extend(void)
+	{
+		return false;
+	}
+
 	virtual void write_current_byte(void) {
 		m_byte_data[m_byte_offset] = m_current_byte;
 		m_dirty = false;
@@ -151,46 +177,225 @@ protected:
 
 
 	uint8_t* m_byte_data;
-	size_t m_byte_length;
+	int64_t m_byte_length;
 
 	uint8_t m_current_byte;
-	int m_byte_offset;
+	int64_t m_byte_offset;
 	int m_bit_offset;
 	uint8_t m_mask;
 	bool m_dirty;
 };
 
+// The file is read and written through a block buffer (one _read / _write per BLOCK_BYTES),
+// written back when the cursor leaves the block and by flush().
 class FileBitStream : public BitStream {
 public:
-	void set_byte_stream(int file_handle, int header_offset) {
+	static constexpr int BLOCK_BYTES = 64 * 1024;
+
+	FileBitStream(void) {
+		m_block.resize(BLOCK_BYTES);
+		m_block_start = 0;
+		m_block_length = 0;
+		m_block_dirty_from = 0;
+		m_block_dirty_to = 0;
+	}
+
+	void set_byte_stream(int file_handle, int64_t header_offset) {
 		m_file = file_handle;
 		m_bit_offset = 0;
 		m_byte_offset = 0;
 		m_mask = 0x80;
 		m_header_offset = header_offset;
+		m_grow_bytes = 0;
+		m_block_start = 0;
+		m_block_length = 0;
+		m_block_dirty_from = 0;
+		m_block_dirty_to = 0;
 
-		struct _stat stat_data;
-		_fstat(m_file, &stat_data);
-		m_byte_length = stat_data.st_size;
+		struct _stat64 stat_data;
+		_fstat64(m_file, &stat_data);
+		m_byte_length = stat_data.st_size - header_offset;
 
 		update_current_byte();
 	}
 
+	// the current byte and the block to the file
+	void flush(void)
+	{
+		BitStream::flush();
+		write_block();
+	}
+
+	// grow the file by grow_bytes each time the end is reached (0: fixed length)
+	void set_grow_bytes(int64_t grow_bytes)
+	{
+		m_grow_bytes = grow_bytes;
+	}
+
+	int64_t get_byte_length(void)
+	{
+		return m_byte_length;
+	}
+
+	// cut the file after byte_length bytes (the cursor must be inside)
+	bool truncate(int64_t byte_length)
+	{
+		write_block();
+		if (_chsize_s(m_file, m_header_offset + byte_length) != 0) {
+			return false;
+		}
+		m_byte_length = byte_length;
+		if (m_block_start + m_block_length > byte_length) {
+			m_block_length = (byte_length > m_block_start) ? (int)(byte_length - m_block_start) : 0;
+		}
+		return true;
+	}
+
 protected:
+	// a large extent at once: the blank part of a tape is 0, so it costs no writes
+	bool extend(void)
+	{
+		if (m_grow_bytes <= 0) {
+			return false;
+		}
+		if (_chsize_s(m_file, m_header_offset + m_byte_length + m_grow_bytes) != 0) {
+			return false;
+		}
+		m_byte_length += m_grow_bytes;
+		return true;
+	}
+
 	void update_current_byte(void)
 	{
 		m_dirty = false;
-		_lseek(m_file, m_byte_offset + m_header_offset, SEEK_SET);
-		_read(m_file, &m_current_byte, 1);
+		if (m_byte_offset < m_block_start || m_byte_offset >= m_block_start + m_block_length) {
+			read_block();
+		}
+		int64_t index = m_byte_offset - m_block_start;
+		m_current_byte = (index < m_block_length) ? m_block[(size_t)index] : 0;
 	}
 
 	void write_current_byte(void) {
-		_write(m_file, &m_current_byte, 1);
+		int64_t index = m_byte_offset - m_block_start;
+		if (index >= 0 && index < m_block_length) {
+			m_block[(size_t)index] = m_current_byte;
+			if (m_block_dirty_from == m_block_dirty_to) {
+				m_block_dirty_from = (int)index;
+				m_block_dirty_to = (int)index + 1;
+			}
+			else {
+				m_block_dirty_from = (std::min)(m_block_dirty_from, (int)index);
+				m_block_dirty_to = (std::max)(m_block_dirty_to, (int)index + 1);
+			}
+		}
 		m_dirty = false;
 	}
 
+	// the block containing the cursor (aligned, so moving backward also reads whole blocks)
+	void read_block(void) {
+		write_block();
+		m_block_start = m_byte_offset - m_byte_offset % BLOCK_BYTES;
+		_lseeki64(m_file, m_block_start + m_header_offset, SEEK_SET);
+		int length = _read(m_file, m_block.data(), (unsigned int)BLOCK_BYTES);
+		m_block_length = (length > 0) ? length : 0;
+	}
+
+	void write_block(void) {
+		if (m_block_dirty_to > m_block_dirty_from) {
+			_lseeki64(m_file, m_block_start + m_block_dirty_from + m_header_offset, SEEK_SET);
+			_write(m_file, m_block.data() + m_block_dirty_from, (unsigned int)(m_block_dirty_to - m_block_dirty_from));
+		}
+		m_block_dirty_from = 0;
+		m_block_dirty_to = 0;
+	}
+
 	int m_file;
-	int m_header_offset;
+	int64_t m_header_offset;
+	int64_t m_grow_bytes;
+	std::vector<uint8_t> m_block;
+	int64_t m_block_start;
+	int m_block_length;          // bytes read into m_block (less at the end of the file)
+	int m_block_dirty_from;      // written range of m_block, empty if from == to
+	int m_block_dirty_to;
+};
+
+
+// Estimates the rate EZ-USB really consumes PLAY data at (crystal error etc.)
+// EZ-USB accepts an OUT transfer only when a buffer is free, so in steady state
+// the completion times follow its sample clock. The rate is the slope of
+// a least squares fit of (completion time, samples sent).
+class UsbRateEstimator {
+public:
+	UsbRateEstimator(void) {
+		start(0);
+	}
+
+	void start(int nominal_rate)
+	{
+		m_nominal_rate = nominal_rate;
+		m_samples = 0;
+		m_count = 0;
+		m_sum_t = 0;
+		m_sum_s = 0;
+		m_sum_tt = 0;
+		m_sum_ts = 0;
+		m_last_time = 0;
+		m_start_time = std::chrono::steady_clock::now();
+	}
+
+	// called on completion of each OUT transfer
+	void add_transfer(int samples)
+	{
+		double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start_time).count();
+
+		m_samples += samples;
+		// skip while EZ-USB buffers are being filled
+		if (t < WARMUP_SEC) {
+			return;
+		}
+		double s = (double)m_samples;
+		m_count++;
+		m_sum_t += t;
+		m_sum_s += s;
+		m_sum_tt += t * t;
+		m_sum_ts += t * s;
+		m_last_time = t;
+	}
+
+	// returns 0 until the estimation is reliable
+	double get_rate(void)
+	{
+		if (m_count < MIN_TRANSFERS || m_last_time < WARMUP_SEC + MIN_WINDOW_SEC) {
+			return 0;
+		}
+		double n = (double)m_count;
+		double denominator = n * m_sum_tt - m_sum_t * m_sum_t;
+		if (denominator <= 0) {
+			return 0;
+		}
+		double rate = (n * m_sum_ts - m_sum_t * m_sum_s) / denominator;
+		// ignore obviously wrong results (stalls, etc.)
+		if (rate < m_nominal_rate * (1.0 - MAX_DEVIATION) || rate > m_nominal_rate * (1.0 + MAX_DEVIATION)) {
+			return 0;
+		}
+		return rate;
+	}
+
+private:
+	static constexpr double WARMUP_SEC = 0.5;
+	static constexpr double MIN_WINDOW_SEC = 2.0;
+	static constexpr int MIN_TRANSFERS = 32;
+	static constexpr double MAX_DEVIATION = 0.01;
+
+	int m_nominal_rate;
+	int64_t m_samples;
+	int m_count;
+	double m_sum_t;
+	double m_sum_s;
+	double m_sum_tt;
+	double m_sum_ts;
+	double m_last_time;
+	std::chrono::steady_clock::time_point m_start_time;
 };
 
 
@@ -198,10 +403,16 @@ class TapFile {
 public:
 	TapFile(void) {
 		m_usb_sample_rate = EZUSB_SAMPLE_RATE;
+		m_usb_rate_fixed = EZUSB_SAMPLE_RATE * USB_RATE_SCALE;
 		m_usb_time = 0;
 		m_continue = false;
 		m_file = 0;
 
+		m_pulse_time = 0;
+		m_pulse_count = 0;
+		m_pulse_level = 0;
+		m_pulse_end = false;
+
 		m_apss_bit = 0;
 		m_apss_bit_change_detected = false;
 		m_apss_detect_count = 0;
@@ -215,25 +426,235 @@ public:
 
 		m_file_readonly = false;
 		m_old_format = false;
+		m_extended_format = false;
 
 		m_rec_bit_conversion = false;
+		m_rec_capture = false;
+		m_rec_pll = false;
 		m_tape_end = false;
+
+		m_fast_load = false;
+		m_scan_run_flag = false;
+		m_is_scanned = false;
+		m_skip_index = 0;
+		m_skip_from = UINT64_MAX;
+		m_skipped_bits = 0;
+		m_skippable_bits = 0;
+		m_index_mtime = -1;
+		m_write_start_bytes = 0;
+		m_write_allocation_count = 0;
+
+		// REC runs on these buffers without allocations
+		m_usb_buffer.reserve(REC_BUFFER_BYTES);
+		m_usb_queue.resize(REC_QUEUE_BUFFERS);
+		for (auto& buffer : m_usb_queue) {
+			buffer.reserve(REC_BUFFER_BYTES);
+		}
+		m_usb_queue_head = 0;
+		m_usb_queue_count = 0;
+		m_pll_symbols.reserve(REC_BUFFER_BYTES * 8);
+		m_thread_config = { false, -1 };
 	}
 
 	~TapFile() {
+		stop_scan();
 		if (m_file != 0) {
 			_close(m_file);
 		}
 	}
 
+	// New blank tape in the extended format (bits are all 0), or with data (total_bits / 8 bytes rounded up).
+	// The file is sparse on NTFS, so a long tape takes no disk space until recorded.
+	static bool create(const wchar_t* filename, int tape_hz, uint64_t total_bits, const uint8_t* data = nullptr) {
+		X1TAPE_HEADER header;
+		X1TAPE_HEADER_EX header_ex;
+
+		memset(&header, 0, sizeof(header));
+		header.index = TAPE_INDEX;
+		header.reserve[0] = TAPE_EXTENDED_VERSION;
+		header.format = TAPE_FORMAT_CONSTANT_RATE;
+		header.frequency = tape_hz;
+		header.datasize = clip_32bit(total_bits);
+		header.position = 0;
+
+		header_ex.index = TAPE_EXTENDED_INDEX;
+		header_ex.size = sizeof(header_ex);
+		header_ex.datasize = total_bits;
+		header_ex.position = 0;
+
+		int file = _wopen(filename, _O_BINARY | _O_RDWR | _O_CREAT | _O_EXCL, _S_IREAD | _S_IWRITE);
+		if (file < 0) {
+			return false;
+		}
+		bool is_written = (_write(file, &header, sizeof(header)) == sizeof(header)
+			&& _write(file, &header_ex, sizeof(header_ex)) == sizeof(header_ex));
+		if (is_written == true && data != nullptr) {
+			uint64_t length = (total_bits + 7) / 8;
+			for (uint64_t offset = 0; offset < length && is_written == true; offset += WRITE_BLOCK_BYTES) {
+				unsigned int block = (unsigned int)((length - offset < WRITE_BLOCK_BYTES) ? length - offset : WRITE_BLOCK_BYTES);
+				is_written = (_write(file, data + offset, block) == (int)block);
+			}
+		}
+		else if (is_written == true) {
+			// not fatal: the file is just allocated on a file system without sparse files
+			DWORD returned;
+			::DeviceIoControl((HANDLE)_get_osfhandle(file), FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL);
+			is_written = (_chsize_s(file, sizeof(header) + sizeof(header_ex) + (int64_t)((total_bits + 7) / 8)) == 0);
+		}
+		_close(file);
+		if (is_written == false) {
+			_wremove(filename);
+		}
+		return is_written;
+	}
+
+	struct redecode_result_t {
+		double tape_seconds;     // of the source
+		uint64_t bit_count;
+		uint64_t ambiguous_count;
+		uint64_t unlock_count;
+		double unit_usec;        // tracked at the end
+	};
+
+	// Offline: decode a tape image saved without bit conversion (the raw signal) with PllDecoder,
+	// and write the bits as X1 standard pulses to a new tape image
+	static bool redecode(const wchar_t* source_name, const wchar_t* destination_name, redecode_result_t* result) {
+		TapFile source;
+		if (source.open((wchar_t*)source_name) == false) {
+			return false;
+		}
+		int tape_hz = source.get_tape_sample_rate();
+		PllDecoder decoder;
+		std::vector<PllDecoder::symbol_t> symbols;
+		std::vector<uint8_t> input(READ_BLOCK_BYTES);
+		std::vector<uint8_t> output;
+		uint64_t output_bits = 0;
+		int64_t offset = 0;
+
+		while (1) {
+			int length = source.read_data(offset, input.data(), (int)input.size());
+			symbols.clear();
+			if (length <= 0) {
+				decoder.finish(symbols);
+			}
+			else {
+				decoder.add_bits(input.data(), length, tape_hz, false, symbols);
+				offset += length;
+			}
+			for (auto& symbol : symbols) {
+				if (symbol.blank_usec > 0) {
+					append_bits(output, output_bits, 0, (uint64_t)((double)symbol.blank_usec * tape_hz / 1000000));
+				}
+				else {
+					append_bits(output, output_bits, 1, get_pulse_bits(tape_hz, symbol.bit));
+					append_bits(output, output_bits, 0, get_pulse_bits(tape_hz, symbol.bit));
+				}
+			}
+			if (length <= 0) {
+				break;
+			}
+		}
+
+		result->tape_seconds = (double)offset * 8 / tape_hz;
+		result->bit_count = decoder.get_bit_count();
+		result->ambiguous_count = decoder.get_ambiguous_count();
+		result->unlock_count = decoder.get_unlock_count();
+		result->unit_usec = decoder.get_unit_usec();
+		return create(destination_name, tape_hz, output_bits, output.data());
+	}
+
+	struct benchmark_result_t {
+		double tape_seconds;           // of the test signal
+		double play_seconds;           // PLAY data generation
+		double rec_converted_seconds;  // REC with bit conversion
+		double rec_sampled_seconds;    // REC without bit conversion (0 below 32kHz, always converted)
+	};
+
+	// Offline: run the PLAY / REC loops on a test signal (random X1 bits) in a work tape
+	static bool benchmark(const wchar_t* work_name, int tape_hz, int usb_hz, double seconds, benchmark_result_t* result) {
+		std::vector<uint8_t> usb_data;
+		uint64_t usb_bits = 0;
+		uint32_t random = 1;
+
+		// EZ-USB input is inverted
+		while (usb_bits < (uint64_t)(seconds * usb_hz)) {
+			random = random * 1103515245 + 12345;
+			uint8_t bit = (random >> 16) & 1;
+			append_bits(usb_data, usb_bits, 1, get_pulse_bits(usb_hz, bit));
+			append_bits(usb_data, usb_bits, 0, get_pulse_bits(usb_hz, bit));
+		}
+		for (auto& byte : usb_data) {
+			byte = ~byte;
+		}
+
+		_wremove(work_name);
+		if (create(work_name, tape_hz, (uint64_t)((seconds + 1) * tape_hz)) == false) {
+			return false;
+		}
+		TapFile tape;
+		if (tape.open((wchar_t*)work_name) == false) {
+			_wremove(work_name);
+			return false;
+		}
+		tape.set_usb_sample_rate(usb_hz);
+
+		result->tape_seconds = (double)usb_bits / usb_hz;
+		result->rec_sampled_seconds = 0;
+		for (int pass = 0; pass < 2; pass++) {
+			bool is_converted = (pass == 0);
+			if (is_converted == false && tape_hz < 32000) {
+				break;
+			}
+			tape.set_rec_bit_conversion(is_converted);
+			tape.set_bit_pos(0);
+			auto start_time = std::chrono::steady_clock::now();
+			tape.start_write();
+			for (size_t offset = 0; offset < usb_data.size(); offset += REC_BUFFER_BYTES) {
+				size_t length = (usb_data.size() - offset < REC_BUFFER_BYTES) ? usb_data.size() - offset : REC_BUFFER_BYTES;
+				tape.write_usb_data_to_tape(usb_data.data() + offset, length);
+			}
+			tape.stop_write();
+			double rec_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+			if (is_converted == true) {
+				result->rec_converted_seconds = rec_seconds;
+			}
+			else {
+				result->rec_sampled_seconds = rec_seconds;
+			}
+		}
+
+		// PLAY the recorded signal (the last REC)
+		std::vector<uint8_t> play_data(READ_BLOCK_BYTES);
+		tape.set_bit_pos(0);
+		auto start_time = std::chrono::steady_clock::now();
+		while (tape.fill_usb_data(play_data.data(), play_data.size()) == (ssize_t)play_data.size()) {
+		}
+		result->play_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+		tape.close();
+		_wremove(work_name);
+		return true;
+	}
+
+	// tape data bytes from offset (the header excluded), 0 at the end
+	int read_data(int64_t offset, uint8_t* data, int length) {
+		if (is_opened() == false) {
+			return -1;
+		}
+		if (_lseeki64(m_file, get_header_byte_size() + offset, SEEK_SET) < 0) {
+			return -1;
+		}
+		return _read(m_file, data, length);
+	}
+
 	bool open(wchar_t* filename) {
 		// close if opened
 		close();
 
 		// check read-only
-		struct _stat stat_data;
+		struct _stat64 stat_data;
 		int oflag = _O_BINARY;
-		int ret = _wstat(filename, &stat_data);
+		int ret = _wstat64(filename, &stat_data);
 		if (ret < 0) {
 			return false;
 		}
@@ -261,19 +682,31 @@ public:
 		}
 
 		// check if new format
+		m_extended_format = false;
 		if (m_header.index == TAPE_INDEX) {
 			// new format
-			m_header.datasize = (stat_data.st_size - sizeof(m_header)) * 8;
 			m_old_format = false;
+			m_header_ex.position = m_header.position;
+			if (m_header.reserve[0] == TAPE_EXTENDED_VERSION) {
+				// extended (64bit position) follows the header
+				ret = _read(m_file, &m_header_ex, sizeof(m_header_ex));
+				if (ret != sizeof(m_header_ex) || m_header_ex.index != TAPE_EXTENDED_INDEX) {
+					close();
+					return false;
+				}
+				m_extended_format = true;
+			}
+			m_header_ex.datasize = (stat_data.st_size - get_header_byte_size()) * 8;
 		}
 		else {
 			// old format
 			m_header.frequency = m_header.index;
-			m_header.datasize = (stat_data.st_size - sizeof(m_header.index)) * 8;
-			m_header.position = sizeof(m_header.index) * 8;
 			m_header.protect = (m_file_readonly == true) ? TAPE_PROTECT : 0;
 			m_old_format = true;
+			m_header_ex.position = sizeof(m_header.index) * 8;
+			m_header_ex.datasize = (stat_data.st_size - get_header_byte_size()) * 8;
 		}
+		m_header.datasize = clip_32bit(m_header_ex.datasize);
 
 		// initialize member variables
 		m_tape_hz = m_header.frequency;
@@ -295,24 +728,71 @@ public:
 		m_apss_detect_count = (int)(m_tape_hz * APSS_DETECT_SEC);
 
 		m_tape_data.set_byte_stream(m_file, get_header_byte_size());
-		m_tape_data.set_bit_pos(m_header.position);
+		if (m_header_ex.position < m_header_ex.datasize) {
+			m_tape_data.set_bit_pos(m_header_ex.position);
+		}
 
+		m_file_name = filename;
+		m_skipped_bits = 0;
+		if (m_fast_load == true) {
+			start_scan();
+		}
 		return true;
 	}
 
 	void close() {
+		stop_scan();
 		if (is_opened()) {
-			if (m_old_format == false && m_file_readonly == false) {
-				m_header.position = m_tape_data.get_bit_pos();
-				_lseek(m_file, 0, 0);
-				_write(m_file, &m_header, sizeof(m_header));
-			}
+			m_tape_data.flush();
+			// the index stays valid for the header written here if nothing else wrote the file
+			struct _stat64 stat_data;
+			bool is_index_current = (m_index_mtime >= 0 && _fstat64(m_file, &stat_data) == 0
+				&& (int64_t)stat_data.st_mtime == m_index_mtime);
+			write_header();
 			_close(m_file);
+			if (is_index_current == true) {
+				update_skip_index_mtime();
+			}
 		}
 		m_file = 0;
+		m_index_mtime = -1;
+	}
+
+	// the fast load scan of each tape is saved here (empty: not saved), from the next scan
+	void set_index_dir(const wchar_t* dir)
+	{
+		m_index_dir = dir;
+	}
+
+	// PLAY skips long leaders / blanks (see FastLoadScanner), the tape is scanned in background
+	void set_fast_load(bool use_fast_load)
+	{
+		m_fast_load = use_fast_load;
+		m_continue = false;
+		if (use_fast_load == true && is_opened() == true && m_scan_thread.joinable() == false) {
+			start_scan();
+		}
+	}
+
+	// PLAY time saved by fast load on this tape
+	double get_fast_load_saved_sec(void)
+	{
+		return (m_tape_hz > 0) ? (double)m_skipped_bits / m_tape_hz : 0;
+	}
+
+	// all that fast load can skip on this tape (0 until scanned)
+	double get_fast_load_skippable_sec(void)
+	{
+		return (m_tape_hz > 0) ? (double)m_skippable_bits / m_tape_hz : 0;
+	}
+
+	// extended format tapes are made longer when REC reaches the end
+	bool is_growable(void)
+	{
+		return (m_extended_format == true && is_write_protected() == false);
 	}
 
-	uint32_t get_bit_pos(void)
+	uint64_t get_bit_pos(void)
 	{
 		if (m_file != 0) {
 			return m_tape_data.get_bit_pos();
@@ -320,10 +800,19 @@ public:
 		return 0;
 	}
 
-	uint32_t get_total_bits(void)
+	// move the play head (PLAY data is generated from here on)
+	void set_bit_pos(uint64_t pos)
+	{
+		if (m_file != 0) {
+			m_continue = false;
+			m_tape_data.set_bit_pos(pos);
+		}
+	}
+
+	uint64_t get_total_bits(void)
 	{
 		if (is_opened()) {
-			return m_header.datasize;
+			return m_header_ex.datasize;
 		}
 		return 0;
 	}
@@ -335,6 +824,23 @@ public:
 	void set_usb_sample_rate(int sample_rate)
 	{
 		m_usb_sample_rate = sample_rate;
+		m_usb_rate_fixed = sample_rate * USB_RATE_SCALE;
+	}
+
+	// measured EZ-USB sample rate for PLAY (nominal rate if 0)
+	void set_usb_rate_estimate(double sample_rate)
+	{
+		if (sample_rate <= 0) {
+			m_usb_rate_fixed = m_usb_sample_rate * USB_RATE_SCALE;
+		}
+		else {
+			m_usb_rate_fixed = (int)(sample_rate * USB_RATE_SCALE + 0.5);
+		}
+	}
+
+	double get_usb_rate_estimate(void)
+	{
+		return (double)m_usb_rate_fixed / USB_RATE_SCALE;
 	}
 
 	ssize_t fill_usb_data(uint8_t* usb_data, size_t required) {
@@ -342,8 +848,13 @@ public:
 		int usb_data_index = 0;
 		int usb_bit_index = 0;
 
+		// in 1/USB_RATE_SCALE Hz unit to follow the measured rate
+		int usb_rate = m_usb_rate_fixed;
+		int tape_hz = m_tape_hz * USB_RATE_SCALE;
+
 		if (m_continue == false) {
-			m_usb_time = m_usb_sample_rate / 2;
+			m_usb_time = usb_rate / 2;
+			find_next_skip();
 		}
 		m_continue = false;
 
@@ -352,7 +863,7 @@ public:
 			while (m_usb_time > 0) {
 				usb_byte <<= 1;
 				usb_byte |= tape_bit;
-				m_usb_time -= m_tape_hz;
+				m_usb_time -= tape_hz;
 				usb_bit_index++;
 				if (usb_bit_index == 8) {
 					usb_bit_index = 0;
@@ -364,18 +875,87 @@ public:
 					}
 				}
 			}
-			if (m_tape_data.move_forward() < 0) {
+			if (move_forward_play() < 0) {
+				return usb_data_index;
+			}
+			m_usb_time += usb_rate;
+		}
+	}
+
+	// Pulse playback data: 2 bytes per run (MSB first)
+	//  bit15: level, bit14:0: duration in PULSE_CLOCK_HZ counts
+	ssize_t fill_pulse_data(uint8_t* usb_data, size_t required) {
+		size_t usb_data_index = 0;
+
+		if (m_continue == false) {
+			m_pulse_time = 0;
+			m_pulse_count = 0;
+			m_pulse_end = false;
+			find_next_skip();
+		}
+		m_continue = false;
+
+		while (usb_data_index + 2 <= required) {
+			if (m_pulse_count == 0) {
+				// measure the next run (at most 0.1sec at once)
+				uint8_t level = m_tape_data.get_bit();
+				int bits = 0;
+				int max_bits = m_tape_hz / 10;
+
+				while (m_tape_data.get_bit() == level && bits < max_bits) {
+					bits++;
+					if (move_forward_play() < 0) {
+						m_pulse_end = true;
+						break;
+					}
+				}
+				if (m_pulse_end == true && bits <= 1) {
+					return usb_data_index;
+				}
+				// carry the remainder so that the run lengths don't drift
+				m_pulse_time += (int64_t)bits * PULSE_CLOCK_HZ;
+				m_pulse_count = (int)(m_pulse_time / m_tape_hz);
+				m_pulse_time %= m_tape_hz;
+				m_pulse_level = level;
+			}
+
+			int count = m_pulse_count;
+			if (count > PULSE_MAX_COUNT) {
+				// split a long run, the last two halves evenly if the rest would be shorter than PULSE_MIN_COUNT
+				count = (count - PULSE_MAX_COUNT < PULSE_MIN_COUNT) ? count / 2 : PULSE_MAX_COUNT;
+			}
+			usb_data[usb_data_index++] = (uint8_t)((m_pulse_level << 7) | (count >> 8));
+			usb_data[usb_data_index++] = (uint8_t)(count & 0xff);
+			m_pulse_count -= count;
+
+			if (m_pulse_count == 0 && m_pulse_end == true) {
 				return usb_data_index;
 			}
-			m_usb_time += m_usb_sample_rate;
 		}
+		m_continue = true;
+		return usb_data_index;
 	}
 
 	void start_write(void)
 	{
+		m_index_mtime = -1;   // REC changes the data (the index is removed in stop_write())
 		m_continue = true;
 		m_tape_end = false;
-		std::thread write_thread([this]() {this->write_usb_data_to_tape_thread(); });
+		m_write_start_bytes = m_tape_data.get_byte_length();
+		m_write_jitter.reset();
+		if (m_rec_capture == false && (m_rec_bit_conversion == true || m_tape_hz < 32000)) {
+			m_pulse_analyzer.reset(get_judge_duration() * 1000000.0 / m_usb_sample_rate);
+		}
+		else {
+			m_pulse_analyzer.reset(PulseAnalyzer::STANDARD_JUDGE_USEC);
+		}
+		if (is_growable() == true) {
+			m_tape_data.set_grow_bytes((int64_t)m_tape_hz * GROW_EXTENT_SEC / 8);
+		}
+		std::thread write_thread([this]() {
+			this->write_usb_data_to_tape_thread();
+			m_write_allocation_count += AllocationCounter::get_thread_count();
+		});
 		write_thread.swap(m_write_tape_thread);
 	}
 
@@ -385,6 +965,26 @@ public:
 		m_write_cond.notify_one();
 		m_write_tape_thread.join();
 		m_tape_data.flush();
+
+		m_tape_data.set_grow_bytes(0);
+		if (m_tape_data.get_byte_length() > m_write_start_bytes) {
+			// drop the unused part of the last extent (up to the byte under the head),
+			// keep the blank tape that was there before REC
+			int64_t end_bytes = (int64_t)(m_tape_data.get_bit_pos() / 8) + 1;
+			if (end_bytes < m_write_start_bytes) {
+				end_bytes = m_write_start_bytes;
+			}
+			if (end_bytes < m_tape_data.get_byte_length()) {
+				m_tape_data.truncate(end_bytes);
+			}
+			m_header_ex.datasize = (uint64_t)m_tape_data.get_byte_length() * 8;
+			write_header();
+		}
+		// the saved data may have changed leaders / blanks
+		remove_skip_index();
+		if (m_fast_load == true) {
+			start_scan();
+		}
 	}
 
 	int write_usb_data_to_tape(uint8_t* data, size_t length)
@@ -393,19 +993,37 @@ public:
 		if (m_tape_end == true) {
 			return -1;
 		}
-		// FIXME: push data into vector 
-		m_usb_data.set_byte_stream(data, length);
+		{
+			std::lock_guard<std::mutex> lock(m_write_lock);
+			if (m_usb_queue_count == m_usb_queue.size()) {
+				// the writer is far behind (disk stall)
+				grow_usb_queue();
+			}
+			std::vector<uint8_t>& buffer = m_usb_queue[(m_usb_queue_head + m_usb_queue_count) % m_usb_queue.size()];
+			buffer.assign(data, data + length);
+			if (m_usb_queue_count == 0) {
+				// wakes the writer up
+				m_usb_queued_time = std::chrono::steady_clock::now();
+			}
+			m_usb_queue_count++;
+		}
 		m_write_cond.notify_one();
 		return 0;
 	}
 
+	// tape writer thread allocations after its start (debug build), all REC so far
+	uint64_t get_write_allocation_count(void)
+	{
+		return m_write_allocation_count;
+	}
+
 	int rewind(int msec)
 	{
 		int ret = 0;
-		int bits = (m_tape_hz / 1000) * msec * FAST_MODE_MULTIPLY;
+		int64_t bits = get_fast_mode_bits(msec);
 		m_continue = false;
 
-		for (int i = 0; i < bits; i++) {
+		for (int64_t i = 0; i < bits; i++) {
 			ret = m_tape_data.move_backward();
 			if (ret != 0) {
 				return ret;
@@ -417,10 +1035,10 @@ public:
 	int ff(int msec)
 	{
 		int ret = 0;
-		int bits = (m_tape_hz / 1000) * msec * FAST_MODE_MULTIPLY;
+		int64_t bits = get_fast_mode_bits(msec);
 		m_continue = false;
 
-		for (int i = 0; i < bits; i++) {
+		for (int64_t i = 0; i < bits; i++) {
 			ret = m_tape_data.move_forward();
 			if (ret != 0) {
 				return ret;
@@ -482,10 +1100,10 @@ public:
 
 	int aff(int msec)
 	{
-		int bits = (m_tape_hz / 1000) * msec * FAST_MODE_MULTIPLY;
+		int64_t bits = get_fast_mode_bits(msec);
 		int ret;
 
-		for (int i = 0; i < bits; i++) {
+		for (int64_t i = 0; i < bits; i++) {
 			uint8_t bit = m_tape_data.get_bit();
 			ret = apss_bit(bit);
 			if (ret != 0) {
@@ -501,10 +1119,10 @@ public:
 
 	int arew(int msec)
 	{
-		int bits = (m_tape_hz / 1000) * msec * FAST_MODE_MULTIPLY;
+		int64_t bits = get_fast_mode_bits(msec);
 		int ret;
 
-		for (int i = 0; i < bits; i++) {
+		for (int64_t i = 0; i < bits; i++) {
 			uint8_t bit = m_tape_data.get_bit();
 			ret = apss_bit(bit);
 			if (ret != 0) {
@@ -518,6 +1136,12 @@ public:
 		return 0;
 	}
 
+	// signal of the last / current REC
+	PulseAnalyzer::stats_t get_pulse_stats(void)
+	{
+		return m_pulse_analyzer.get_stats();
+	}
+
 	bool is_write_protected(void)
 	{
 		if (m_header.protect != 0 || m_file_readonly == true) {
@@ -533,17 +1157,68 @@ public:
 		m_rec_bit_conversion = use_bit_conversion;
 	}
 
-private:
-	int write_bit(uint8_t bit) {
-		int duration;
+	void set_rec_capture(bool use_capture)
+	{
+		m_rec_capture = use_capture;
+	}
 
-		//::OutputDebugStringA((bit == 0) ? "0" : "1");
+	// bit conversion with PllDecoder instead of the fixed decision point
+	void set_rec_pll(bool use_pll)
+	{
+		m_rec_pll = use_pll;
+	}
+
+	// scheduling of the tape writer thread, from the next REC
+	void set_thread_priority(const ThreadPriority::config_t& config)
+	{
+		m_thread_config = config;
+	}
+
+	// tape writer: USB data queued to the thread running (last / current REC)
+	JitterHistogram::stats_t get_write_jitter(void)
+	{
+		return m_write_jitter.get_stats();
+	}
+
+private:
+	// high (and low) of an X1 standard bit in tape bits
+	static int get_pulse_bits(int tape_hz, uint8_t bit)
+	{
 		if (bit == 1) {
-			duration = (m_tape_hz / 8000) * 2; // 250u
+			return (tape_hz / 8000) * 2; // 250u
 		}
 		else {
-			duration = m_tape_hz / 8000; // 125u
+			return tape_hz / 8000; // 125u
+		}
+	}
+
+	// to a tape image in memory (redecode)
+	static void append_bits(std::vector<uint8_t>& data, uint64_t& bit_count, uint8_t level, uint64_t count)
+	{
+		for (; count > 0; count--) {
+			if ((bit_count % 8) == 0) {
+				// whole bytes of 0 at once (blank)
+				if (level == 0 && count >= 8) {
+					data.resize(data.size() + (size_t)(count / 8), 0);
+					bit_count += count & ~7ULL;
+					count &= 7;
+					if (count == 0) {
+						break;
+					}
+				}
+				data.push_back(0);
+			}
+			if (level != 0) {
+				data.back() |= (uint8_t)(0x80 >> (bit_count % 8));
+			}
+			bit_count++;
 		}
+	}
+
+	int write_bit(uint8_t bit) {
+		int duration = get_pulse_bits(m_tape_hz, bit);
+
+		//::OutputDebugStringA((bit == 0) ? "0" : "1");
 
 		for (int index = 0; index < duration; index++) {
 			m_tape_data.write_bit(1);
@@ -560,15 +1235,18 @@ private:
 		return 0;
 	}
 
-	int write_blank(int usb_bit_count)
+	// 64bit: a pause of hours in a long save is still written
+	int write_blank(int64_t usb_bit_count)
 	{
-		int tape_duration;
+		return write_blank_bits(usb_bit_count * m_tape_hz / m_usb_sample_rate);
+	}
 
-		tape_duration = usb_bit_count * (m_tape_hz / 100) / (m_usb_sample_rate / 100);
+	int write_blank_bits(int64_t tape_duration)
+	{
 //		char tmp[256];
 //		snprintf(tmp, sizeof(tmp), "\nBlank in tape bits %d\n", tape_duration);
 //		::OutputDebugStringA(tmp);
-		for (int index = 0; index < tape_duration; index++) {
+		for (int64_t index = 0; index < tape_duration; index++) {
 			m_tape_data.write_bit(0);
 			if (m_tape_data.move_forward() < 0) {
 				return -1;
@@ -578,10 +1256,10 @@ private:
 		return 0;
 	}
 
-	int search_edge(BitStream* stream, bool isRising) {
+	int64_t search_edge(BitStream* stream, bool isRising) {
 		uint8_t prev_bit;
 		uint8_t current_bit;
-		int bit_count = 0;
+		int64_t bit_count = 0;
 		uint8_t prev_cond;
 		uint8_t current_cond;
 
@@ -606,9 +1284,7 @@ private:
 			prev_bit = current_bit;
 
 			if (stream->move_forward() < 0) {
-				std::unique_lock lk(m_write_lock);
-				m_write_cond.wait(lk, [this]() {return (m_usb_data.get_bit_pos() == 0 || m_continue == false); });
-				if (m_continue == false) {
+				if (wait_usb_data() == false) {
 					return -bit_count;
 				}
 			}
@@ -619,21 +1295,27 @@ private:
 	{
 		uint8_t bit;
 		int duration_125us = 8000;
-		int judge_duration = m_usb_sample_rate / duration_125us + (m_usb_sample_rate / duration_125us) / 2;
+		int judge_duration = get_judge_duration();
 
+		Trace::set_thread_name("tape writer");
+		ThreadPriority priority(m_thread_config);
+		AllocationCounter::reset_thread_count();
 		// Wait for start REC
-		{
-			std::unique_lock lk(m_write_lock);
-			m_write_cond.wait(lk, [this]() {return (m_usb_data.get_bit_pos() == 0 || m_continue == false); });
-			if (m_continue == false) {
-				return 0;
-			}
+		if (wait_usb_data() == false) {
+			return 0;
 		}
 
-		if (m_rec_bit_conversion == true || m_tape_hz < 32000) {
-			while (1) {
+		if (m_rec_pll == true && (m_rec_bit_conversion == true || m_tape_hz < 32000)) {
+			return write_pll_data_to_tape();
+		}
+		if (m_rec_capture == true) {
+			return write_capture_data_to_tape();
+		}
+
+		if (m_rec_bit_conversion == true || m_tape_hz < 32000) {
+			while (1) {
 				// search rising edge
-				int bit_count = search_edge(&m_usb_data, true);
+				int64_t bit_count = search_edge(&m_usb_data, true);
 				if (bit_count < 0) {
 					write_blank(-bit_count);
 					m_tape_end = true;
@@ -651,9 +1333,7 @@ private:
 				// forward 187.5usec
 				for (int index = 0; index < judge_duration; index++) {
 					if (m_usb_data.move_forward() < 0) {
-						std::unique_lock lk(m_write_lock);
-						m_write_cond.wait(lk, [this]() {return (m_usb_data.get_bit_pos() == 0 || m_continue == false); });
-						if (m_continue == false) {
+						if (wait_usb_data() == false) {
 							return -1;
 						}
 					}
@@ -700,9 +1380,7 @@ private:
 					}
 				}
 				if (m_usb_data.move_forward() < 0) {
-					std::unique_lock lk(m_write_lock);
-					m_write_cond.wait(lk, [this]() {return (m_usb_data.get_bit_pos() == 0 || m_continue == false); });
-					if (m_continue == false) {
+					if (wait_usb_data() == false) {
 						return -1;
 					}
 				}
@@ -711,16 +1389,447 @@ private:
 		}
 	}
 
+	// wait for the next USB data, false if REC is stopped and all data is written
+	bool wait_usb_data(void)
+	{
+		std::unique_lock lk(m_write_lock);
+		bool is_waiting = (m_usb_queue_count == 0);
+		Trace::begin("wait usb data");
+		m_write_cond.wait(lk, [this]() {return (m_usb_queue_count > 0 || m_continue == false); });
+		Trace::end("wait usb data");
+		if (m_usb_queue_count == 0) {
+			return false;
+		}
+		if (is_waiting == true) {
+			m_write_jitter.add(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - m_usb_queued_time).count());
+		}
+		// the emptied buffer goes back to the queue
+		m_usb_buffer.swap(m_usb_queue[m_usb_queue_head]);
+		m_usb_queue_head = (m_usb_queue_head + 1) % m_usb_queue.size();
+		m_usb_queue_count--;
+		Trace::counter("rec queue", (int32_t)m_usb_queue_count);
+		lk.unlock();
+
+		m_usb_data.set_byte_stream(m_usb_buffer.data(), m_usb_buffer.size());
+
+		Trace::begin("pulse analyzer");
+		if (m_rec_capture == true) {
+			m_pulse_analyzer.add_capture_data(m_usb_buffer.data(), m_usb_buffer.size(), CAPTURE_TICK_HZ);
+		}
+		else {
+			m_pulse_analyzer.add_usb_data(m_usb_buffer.data(), m_usb_buffer.size(), m_usb_sample_rate);
+		}
+		Trace::end("pulse analyzer");
+		return true;
+	}
+
+	// twice the buffers, in order from the head (m_write_lock held)
+	void grow_usb_queue(void)
+	{
+		std::vector<std::vector<uint8_t>> queue(m_usb_queue.size() * 2);
+		for (size_t index = 0; index < queue.size(); index++) {
+			if (index < m_usb_queue_count) {
+				queue[index].swap(m_usb_queue[(m_usb_queue_head + index) % m_usb_queue.size()]);
+			}
+			else {
+				queue[index].reserve(REC_BUFFER_BYTES);
+			}
+		}
+		m_usb_queue.swap(queue);
+		m_usb_queue_head = 0;
+		Trace::instant("rec queue grown", (int32_t)m_usb_queue.size());
+	}
+
+	// USB samples from a rising edge to the bit decision (187.5usec)
+	int get_judge_duration(void)
+	{
+		int duration_125us = 8000;
+		return m_usb_sample_rate / duration_125us + (m_usb_sample_rate / duration_125us) / 2;
+	}
+
+	// bit conversion by PllDecoder, a whole USB buffer at once (bitstream or edge capture data)
+	DWORD write_pll_data_to_tape(void)
+	{
+		m_pll_decoder.reset();
+		while (1) {
+			bool is_end = false;
+
+			m_pll_symbols.clear();
+			if (m_usb_buffer.empty() == true) {
+				m_pll_decoder.finish(m_pll_symbols);
+				is_end = true;
+			}
+			else if (m_rec_capture == true) {
+				m_pll_decoder.add_capture_data(m_usb_buffer.data(), m_usb_buffer.size(), CAPTURE_TICK_HZ, m_pll_symbols);
+			}
+			else {
+				m_pll_decoder.add_bits(m_usb_buffer.data(), m_usb_buffer.size(), m_usb_sample_rate, true, m_pll_symbols);
+			}
+
+			for (auto& symbol : m_pll_symbols) {
+				int ret;
+				if (symbol.blank_usec > 0) {
+					ret = write_blank_bits((int64_t)((double)symbol.blank_usec * m_tape_hz / 1000000));
+				}
+				else {
+					ret = write_bit(symbol.bit);
+				}
+				if (ret < 0) {
+					m_tape_end = true;
+					return -1;
+				}
+			}
+			if (is_end == true) {
+				return 0;
+			}
+			if (wait_usb_data() == false) {
+				m_usb_buffer.clear();
+			}
+		}
+	}
+
+	// Edge capture data: 1 byte per run  bit7: level, bit6:0: duration in CAPTURE_TICK_HZ ticks
+	DWORD write_capture_data_to_tape(void)
+	{
+		bool is_bit_conversion = (m_rec_bit_conversion == true || m_tape_hz < 32000);
+		int tape_time = 0;
+		int run_level = -1;
+		int64_t run_ticks = 0;
+
+		while (1) {
+			uint8_t record = m_usb_data.get_byte();
+			// Bit-inversion was required for better compatibility
+			int level = (record & 0x80) ? 0 : 1;
+			int ticks = record & CAPTURE_TICKS_MASK;
+
+			if (is_bit_conversion == false) {
+				// render the run at the tape rate, carrying the remainder to the next run
+				tape_time += ticks * m_tape_hz;
+				while (tape_time >= CAPTURE_TICK_HZ) {
+					m_tape_data.write_bit((uint8_t)level);
+					tape_time -= CAPTURE_TICK_HZ;
+					if (m_tape_data.move_forward() < 0) {
+						m_tape_end = true;
+						return -1;
+					}
+				}
+			}
+			else if (level == run_level) {
+				run_ticks += ticks;
+			}
+			else {
+				if (run_level == 1) {
+					// high width > 187.5usec : 1
+					if (write_bit((run_ticks * 16000 > CAPTURE_TICK_HZ * 3) ? 1 : 0) < 0) {
+						m_tape_end = true;
+						return -1;
+					}
+				}
+				else if (run_level == 0 && run_ticks > CAPTURE_TICK_HZ / 2) {
+					// write blank bits if edge isn't detected within 0.5sec
+					if (write_blank_bits((int64_t)run_ticks * m_tape_hz / CAPTURE_TICK_HZ) < 0) {
+						m_tape_end = true;
+						return -1;
+					}
+				}
+				run_level = level;
+				run_ticks = ticks;
+			}
+
+			if (m_usb_data.move_forward_byte() < 0) {
+				if (wait_usb_data() == false) {
+					return 0;
+				}
+			}
+		}
+	}
+
 	int get_header_byte_size(void)
 	{
 		if (m_old_format == true) {
 			return sizeof(m_header.index);
 		}
+		else if (m_extended_format == true) {
+			return sizeof(X1TAPE_HEADER) + sizeof(X1TAPE_HEADER_EX);
+		}
 		else {
 			return sizeof(X1TAPE_HEADER);
 		}
 	}
 
+	void start_scan(void)
+	{
+		stop_scan();
+		m_is_scanned = false;
+		m_skippable_bits = 0;
+		m_skips.clear();
+		m_index_mtime = -1;
+		m_scan_run_flag = true;
+		std::thread scan_thread([this, index_path = get_skip_index_path()]() {
+			this->scan_tape_thread(m_file_name, get_header_byte_size(), m_tape_hz, index_path);
+		});
+		scan_thread.swap(m_scan_thread);
+	}
+
+	void stop_scan(void)
+	{
+		m_scan_run_flag = false;
+		if (m_scan_thread.joinable() == true) {
+			m_scan_thread.join();
+		}
+		m_is_scanned = false;
+	}
+
+	// own file handle: the play head shares the file pointer of m_file
+	//  index_path: the skips saved by an earlier scan of the same data, empty if not saved
+	void scan_tape_thread(std::wstring file_name, int header_size, int tape_hz, std::wstring index_path)
+	{
+		Trace::set_thread_name("fast load scan");
+		TraceScope trace("scan tape");
+
+		int file = _wopen(file_name.c_str(), _O_BINARY | _O_RDONLY);
+		if (file < 0) {
+			return;
+		}
+		FastLoadScanner scanner(tape_hz);
+		std::vector<FastLoadScanner::skip_t> skips;
+		std::vector<uint8_t> data(READ_BLOCK_BYTES);
+		skip_index_header_t index_key = get_skip_index_key(file, header_size, tape_hz);
+
+		if (index_path.empty() == false && load_skip_index(index_path, index_key, skips) == true) {
+			_close(file);
+			m_index_mtime = index_key.mtime;
+			set_skips(skips);
+			return;
+		}
+		_lseeki64(file, header_size, SEEK_SET);
+		while (m_scan_run_flag == true) {
+			int length = _read(file, data.data(), (unsigned int)data.size());
+			if (length <= 0) {
+				scanner.finish(skips);
+				break;
+			}
+			scanner.add_data(data.data(), length, skips);
+		}
+		_close(file);
+		if (m_scan_run_flag == false) {
+			return;
+		}
+		if (index_path.empty() == false && save_skip_index(index_path, index_key, skips) == true) {
+			m_index_mtime = index_key.mtime;
+		}
+		set_skips(skips);
+	}
+
+	void set_skips(std::vector<FastLoadScanner::skip_t>& skips)
+	{
+		uint64_t skippable_bits = 0;
+		for (auto& skip : skips) {
+			skippable_bits += skip.to - skip.from;
+		}
+		m_skips.swap(skips);
+		m_skippable_bits = skippable_bits;
+		m_is_scanned = true;  // m_skips is read by PLAY from here on
+	}
+
+	// Skip index file: skip_index_header_t + FastLoadScanner::skip_t x skip_count.
+	// The key is the modified time, the size and the data at both ends of the tape. The header
+	// (play position) written at every close changes the modified time, close() moves the index
+	// to the new time if the file had not been written since the index was made.
+	// REC removes the index of its tape.
+	struct skip_index_header_t {
+		char magic[4];
+		uint32_t version;
+		uint64_t file_size;
+		uint64_t data_hash;
+		int64_t mtime;
+		uint32_t tape_hz;
+		uint32_t skip_count;
+	};
+
+	static constexpr char SKIP_INDEX_MAGIC[4] = { 'E', '8', 'S', 'I' };
+	static constexpr uint32_t SKIP_INDEX_VERSION = 2;   // up with FastLoadScanner changes
+	static constexpr int SKIP_INDEX_HASH_BYTES = 64 * 1024;
+
+	// file name from the tape path, empty if the index is not saved
+	std::wstring get_skip_index_path(void)
+	{
+		if (m_index_dir.empty() == true) {
+			return std::wstring();
+		}
+		uint64_t hash = 0xcbf29ce484222325ULL;
+		for (wchar_t c : m_file_name) {
+			hash = (hash ^ (uint64_t)c) * 0x100000001b3ULL;
+		}
+		wchar_t name[32];
+		swprintf(name, sizeof(name) / sizeof(name[0]), L"\\%016llx.idx", (unsigned long long)hash);
+		return m_index_dir + name;
+	}
+
+	static skip_index_header_t get_skip_index_key(int file, int header_size, int tape_hz)
+	{
+		skip_index_header_t key;
+		struct _stat64 stat_data;
+		std::vector<uint8_t> data(SKIP_INDEX_HASH_BYTES);
+
+		memset(&key, 0, sizeof(key));
+		memcpy(key.magic, SKIP_INDEX_MAGIC, sizeof(SKIP_INDEX_MAGIC));
+		key.version = SKIP_INDEX_VERSION;
+		key.tape_hz = tape_hz;
+		if (_fstat64(file, &stat_data) == 0) {
+			key.file_size = stat_data.st_size;
+			key.mtime = (int64_t)stat_data.st_mtime;
+		}
+		key.data_hash = 0xcbf29ce484222325ULL;
+		for (int64_t offset : { (int64_t)header_size, (int64_t)key.file_size - SKIP_INDEX_HASH_BYTES }) {
+			if (offset < header_size) {
+				offset = header_size;
+			}
+			_lseeki64(file, offset, SEEK_SET);
+			int length = _read(file, data.data(), (unsigned int)data.size());
+			for (int index = 0; index < length; index++) {
+				key.data_hash = (key.data_hash ^ data[index]) * 0x100000001b3ULL;
+			}
+		}
+		return key;
+	}
+
+	static bool load_skip_index(const std::wstring& index_path, const skip_index_header_t& key, std::vector<FastLoadScanner::skip_t>& skips)
+	{
+		FILE* fp;
+		skip_index_header_t header;
+		bool is_loaded = false;
+
+		if (_wfopen_s(&fp, index_path.c_str(), L"rb") != 0 || fp == NULL) {
+			return false;
+		}
+		if (fread(&header, sizeof(header), 1, fp) == 1 && memcmp(header.magic, key.magic, sizeof(header.magic)) == 0
+			&& header.version == key.version && header.file_size == key.file_size
+			&& header.data_hash == key.data_hash && header.mtime == key.mtime && header.tape_hz == key.tape_hz
+			&& (uint64_t)header.skip_count * sizeof(FastLoadScanner::skip_t) <= key.file_size * 8) {
+			skips.resize(header.skip_count);
+			is_loaded = (fread(skips.data(), sizeof(FastLoadScanner::skip_t), skips.size(), fp) == skips.size());
+		}
+		fclose(fp);
+		if (is_loaded == false) {
+			skips.clear();
+		}
+		return is_loaded;
+	}
+
+	// not fatal: scanned again next time
+	static bool save_skip_index(const std::wstring& index_path, const skip_index_header_t& key, const std::vector<FastLoadScanner::skip_t>& skips)
+	{
+		FILE* fp;
+		skip_index_header_t header = key;
+
+		if (_wfopen_s(&fp, index_path.c_str(), L"wb") != 0 || fp == NULL) {
+			return false;
+		}
+		header.skip_count = (uint32_t)skips.size();
+		bool is_written = (fwrite(&header, sizeof(header), 1, fp) == 1
+			&& fwrite(skips.data(), sizeof(FastLoadScanner::skip_t), skips.size(), fp) == skips.size());
+		if (fclose(fp) != 0 || is_written == false) {
+			_wremove(index_path.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	// after close() has written the header (the data is the same), removed if not updated
+	void update_skip_index_mtime(void)
+	{
+		std::wstring index_path = get_skip_index_path();
+		struct _stat64 stat_data;
+		skip_index_header_t header;
+		FILE* fp;
+
+		if (index_path.empty() == true || _wfopen_s(&fp, index_path.c_str(), L"r+b") != 0 || fp == NULL) {
+			return;
+		}
+		bool is_updated = (_wstat64(m_file_name.c_str(), &stat_data) == 0
+			&& fread(&header, sizeof(header), 1, fp) == 1 && header.version == SKIP_INDEX_VERSION);
+		if (is_updated == true) {
+			header.mtime = (int64_t)stat_data.st_mtime;
+			is_updated = (fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1);
+		}
+		if (fclose(fp) != 0 || is_updated == false) {
+			_wremove(index_path.c_str());
+		}
+	}
+
+	void remove_skip_index(void)
+	{
+		std::wstring index_path = get_skip_index_path();
+		if (index_path.empty() == false) {
+			_wremove(index_path.c_str());
+		}
+	}
+
+	// next skip after the play head (PLAY starts, or the head has moved)
+	void find_next_skip(void)
+	{
+		m_skip_from = UINT64_MAX;
+		if (m_fast_load == false || m_is_scanned == false) {
+			return;
+		}
+		uint64_t pos = m_tape_data.get_bit_pos();
+		auto it = std::upper_bound(m_skips.begin(), m_skips.end(), pos,
+			[](uint64_t pos, const FastLoadScanner::skip_t& skip) {return pos < skip.to; });
+		m_skip_index = it - m_skips.begin();
+		if (it != m_skips.end()) {
+			m_skip_from = it->from;
+		}
+	}
+
+	// move_forward() for PLAY: jumps over the next skip when the head reaches it
+	int move_forward_play(void)
+	{
+		int ret = m_tape_data.move_forward();
+		if (ret == 0 && m_tape_data.get_bit_pos() >= m_skip_from) {
+			uint64_t pos = m_tape_data.get_bit_pos();
+			uint64_t to = m_skips[m_skip_index].to;
+			// a blank to the tape end: stop at the last bit
+			if (to >= get_total_bits()) {
+				to = get_total_bits() - 1;
+			}
+			if (to > pos) {
+				m_skipped_bits += to - pos;
+				m_tape_data.set_bit_pos(to);
+			}
+			m_skip_index++;
+			m_skip_from = (m_skip_index < m_skips.size()) ? m_skips[m_skip_index].from : UINT64_MAX;
+		}
+		return ret;
+	}
+
+	// save the tape state (new format only)
+	void write_header(void)
+	{
+		if (m_old_format == false && m_file_readonly == false) {
+			m_header_ex.position = m_tape_data.get_bit_pos();
+			// the 32bit fields stay readable by other tools as long as the tape fits
+			m_header.position = clip_32bit(m_header_ex.position);
+			m_header.datasize = clip_32bit(m_header_ex.datasize);
+			_lseeki64(m_file, 0, SEEK_SET);
+			_write(m_file, &m_header, sizeof(m_header));
+			if (m_extended_format == true) {
+				_write(m_file, &m_header_ex, sizeof(m_header_ex));
+			}
+		}
+	}
+
+	// tape bits passed in msec of FF / REW
+	int64_t get_fast_mode_bits(int msec)
+	{
+		return (int64_t)m_tape_hz * msec * FAST_MODE_MULTIPLY / 1000;
+	}
+
+	static uint32_t clip_32bit(uint64_t value)
+	{
+		return (value > UINT32_MAX) ? UINT32_MAX : (uint32_t)value;
+	}
+
 	bool is_opened(void)
 	{
 		return (m_file != 0);
@@ -742,14 +1851,40 @@ private:
 		uint32_t position;    /* 24H:テープの位置（ビット単位）         */
 	}X1TAPE_HEADER;
 
+	// Extended header: follows X1TAPE_HEADER when reserve[0] == TAPE_EXTENDED_VERSION.
+	// 64bit sizes for tapes over 4Gbit (about 24 hours at 48kHz).
+	// datasize / position of X1TAPE_HEADER are kept too (UINT32_MAX if they don't fit).
+	typedef struct X1TapeHeaderExtension
+	{
+		uint32_t index;       /* 28H:識別インデックス "TPEX"            */
+		uint32_t size;        /* 2CH:拡張ヘッダのサイズ                 */
+		uint64_t datasize;    /* 30H:テープデータのサイズ（ビット単位） */
+		uint64_t position;    /* 38H:テープの位置（ビット単位）         */
+	}X1TAPE_HEADER_EX;
+
 	static constexpr int EZUSB_SAMPLE_RATE = 48000;
+	static constexpr int USB_RATE_SCALE = 16;
+	static constexpr int CAPTURE_TICK_HZ = 100000;
+	static constexpr int PULSE_CLOCK_HZ = 4000000;
+	static constexpr int PULSE_MAX_COUNT = 0x7fff;
+	static constexpr int PULSE_MIN_COUNT = 64;   // 16usec, the firmware can't time shorter runs (PULSE_MIN_COUNT there)
+	static constexpr uint8_t CAPTURE_TICKS_MASK = 0x7f;
 	static constexpr int FAST_MODE_MULTIPLY = 18;
+	static constexpr int GROW_EXTENT_SEC = 60;
+	static constexpr size_t REC_BUFFER_BYTES = 512;   // a REC transfer
+	static constexpr size_t REC_QUEUE_BUFFERS = 256;  // 22sec at 48kHz, grows if the writer is behind more
+	static constexpr int READ_BLOCK_BYTES = 1024 * 1024;
+	static constexpr unsigned int WRITE_BLOCK_BYTES = 1024 * 1024;
 	static constexpr float APSS_DETECT_SEC = 3.5;
 	static constexpr float APSS_IGNORE_SEC = 3.5;
 	static constexpr uint32_t TAPE_INDEX = 0x45504154;
 	static constexpr uint8_t TAPE_PROTECT = 0x10;
+	static constexpr uint32_t TAPE_EXTENDED_INDEX = 0x58455054;
+	static constexpr uint8_t TAPE_EXTENDED_VERSION = 0x01;
+	static constexpr uint8_t TAPE_FORMAT_CONSTANT_RATE = 0x01;
 
 	int m_usb_sample_rate;
+	std::atomic<int> m_usb_rate_fixed;  // set by the tape thread, read by the play render thread and the UI
 	int m_tape_hz;
 	int m_usb_time;
 
@@ -766,16 +1901,51 @@ private:
 
 	bool m_continue;
 
+	int64_t m_pulse_time;
+	int m_pulse_count;
+	uint8_t m_pulse_level;
+	bool m_pulse_end;
+
 	BitStream m_usb_data;
+	std::vector<uint8_t> m_usb_buffer; // data behind m_usb_data
+	std::vector<std::vector<uint8_t>> m_usb_queue; // ring of USB data not yet written, guarded by m_write_lock
+	size_t m_usb_queue_head;
+	size_t m_usb_queue_count;
+	std::chrono::steady_clock::time_point m_usb_queued_time;  // into the empty queue
+	ThreadPriority::config_t m_thread_config;
+	JitterHistogram m_write_jitter;
 	FileBitStream m_tape_data;
+	PulseAnalyzer m_pulse_analyzer;
+	PllDecoder m_pll_decoder;
+
+	std::wstring m_file_name;
+	bool m_fast_load;
+
+	std::wstring m_index_dir;
+	std::atomic<int64_t> m_index_mtime;            // modified time of the tape the saved index is for, -1: none
+	std::thread m_scan_thread;
+	std::atomic<bool> m_scan_run_flag;
+	std::atomic<bool> m_is_scanned;
+	std::vector<FastLoadScanner::skip_t> m_skips;  // written by the scan thread until m_is_scanned
+	size_t m_skip_index;                           // PLAY: next skip
+	uint64_t m_skip_from;                          // PLAY: its start, UINT64_MAX if none
+	std::atomic<uint64_t> m_skipped_bits;
+	std::atomic<uint64_t> m_skippable_bits;
+	std::vector<PllDecoder::symbol_t> m_pll_symbols;  // decoded from one USB buffer
 
 	int m_file;
 	X1TAPE_HEADER m_header;
+	X1TAPE_HEADER_EX m_header_ex;  // 64bit datasize / position of any format
 	bool m_file_readonly;
 	bool m_old_format;
+	bool m_extended_format;
 
 	bool m_rec_bit_conversion;
+	bool m_rec_capture;
+	bool m_rec_pll;
 	bool m_tape_end;
+	int64_t m_write_start_bytes;  // tape length when REC started
+	std::atomic<uint64_t> m_write_allocation_count;
 
 	std::thread m_write_tape_thread;
 	std::mutex m_write_lock;
@@ -783,6 +1953,292 @@ private:
 };
 
 
+//
+//
+//
+
+// Renders PLAY data ahead of the play head on its own thread, so that the
+// USB thread only copies ready chunks into transfers.
+// The cache owns the TapFile bit position while it is active: the play head
+// is the end of the last chunk read, and stop() moves the tape back there.
+// Anything else touching the tape position (seek, REC, eject) or changing
+// how PLAY data is made (pulse playback, USB rate) must stop() it first.
+// start() / stop() are called by the command sender only, the state can be read anywhere.
+class PlaybackCache {
+public:
+	PlaybackCache(void) {
+		m_tape = nullptr;
+		m_is_active = false;
+		m_run_flag = false;
+		m_is_end = false;
+		m_head = 0;
+		m_count = 0;
+		m_ahead_chunks = 0;
+		m_bit_pos = 0;
+		m_allocation_count = 0;
+	}
+
+	static constexpr int CHUNK_SIZE = 64;
+
+	// start rendering from the current tape position
+	//  bytes_per_sec: USB data rate, to keep about CACHE_MSEC of data ahead
+	void start(TapFile* tape, bool is_pulse, int bytes_per_sec)
+	{
+		if (m_is_active == true) {
+			return;
+		}
+		m_tape = tape;
+		m_is_pulse = is_pulse;
+		m_bit_pos = tape->get_bit_pos();
+		m_head = 0;
+		m_count = 0;
+		m_is_end = false;
+		m_ahead_chunks = (int)((int64_t)bytes_per_sec * CACHE_MSEC / 1000 / CHUNK_SIZE);
+		if (m_ahead_chunks < 2) {
+			m_ahead_chunks = 2;
+		}
+		else if (m_ahead_chunks > MAX_CHUNKS) {
+			m_ahead_chunks = MAX_CHUNKS;
+		}
+
+		m_run_flag = true;
+		m_is_active = true;
+		std::thread producer_thread([this]() {
+			this->render_thread();
+			m_allocation_count += AllocationCounter::get_thread_count();
+		});
+		producer_thread.swap(m_render_thread);
+	}
+
+	// drop the rendered data and put the tape back to the play head
+	void stop(void)
+	{
+		if (m_is_active == false) {
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_run_flag = false;
+		}
+		m_cond.notify_all();
+		m_render_thread.join();
+
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_count = 0;
+		}
+		m_tape->set_bit_pos(m_bit_pos);
+		m_is_active = false;
+	}
+
+	bool is_active(void)
+	{
+		return m_is_active;
+	}
+
+	// play head while active
+	uint64_t get_bit_pos(void)
+	{
+		return m_bit_pos;
+	}
+
+	// render thread allocations after its start (debug build), all PLAY so far
+	uint64_t get_allocation_count(void)
+	{
+		return m_allocation_count;
+	}
+
+	// copy the next chunk, 0 at the tape end (waits if the renderer is behind)
+	size_t read(uint8_t* data)
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+		m_cond.wait(lock, [this] {return (m_count > 0 || m_is_end == true || m_run_flag == false); });
+		if (m_count == 0) {
+			return 0;
+		}
+		chunk_t* chunk = &m_chunks[m_head];
+		size_t length = chunk->length;
+		memcpy(data, chunk->data, length);
+		m_bit_pos = chunk->end_pos;
+		m_head = (m_head + 1) % MAX_CHUNKS;
+		m_count--;
+		Trace::counter("play cache chunks", m_count);
+		lock.unlock();
+
+		m_cond.notify_all();
+		return length;
+	}
+
+private:
+	void render_thread(void)
+	{
+		Trace::set_thread_name("play render");
+		AllocationCounter::reset_thread_count();
+		while (1) {
+			int tail;
+			{
+				std::unique_lock<std::mutex> lock(m_lock);
+				m_cond.wait(lock, [this] {return (m_count < m_ahead_chunks || m_run_flag == false); });
+				if (m_run_flag == false) {
+					return;
+				}
+				tail = (m_head + m_count) % MAX_CHUNKS;
+			}
+
+			// the tail chunk is not seen by read() until m_count includes it
+			chunk_t* chunk = &m_chunks[tail];
+			ssize_t length;
+			if (m_is_pulse == true) {
+				length = m_tape->fill_pulse_data(chunk->data, CHUNK_SIZE);
+			}
+			else {
+				length = m_tape->fill_usb_data(chunk->data, CHUNK_SIZE);
+			}
+			chunk->length = (length > 0) ? (size_t)length : 0;
+			chunk->end_pos = m_tape->get_bit_pos();
+
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				if (chunk->length > 0) {
+					m_count++;
+				}
+				if (chunk->length < CHUNK_SIZE) {
+					m_is_end = true;
+				}
+			}
+			m_cond.notify_all();
+			if (chunk->length < CHUNK_SIZE) {
+				return;
+			}
+		}
+	}
+
+	struct chunk_t {
+		uint8_t data[CHUNK_SIZE];
+		size_t length;
+		uint64_t end_pos;
+	};
+
+	static constexpr int CACHE_MSEC = 3000;
+	static constexpr int MAX_CHUNKS = 512; // 5.4sec at 48kHz
+
+	TapFile* m_tape;
+	bool m_is_pulse;
+	std::atomic<bool> m_is_active;
+	bool m_run_flag;
+	bool m_is_end;
+
+	chunk_t m_chunks[MAX_CHUNKS];
+	int m_head;
+	int m_count;
+	int m_ahead_chunks;
+	std::atomic<uint64_t> m_bit_pos;  // read by the UI too
+	std::atomic<uint64_t> m_allocation_count;
+
+	std::thread m_render_thread;
+	std::mutex m_lock;
+	std::condition_variable m_cond;
+};
+
+
+//
+//
+//
+
+// Bounded ring, lock-free: any number of producers, one consumer.
+//  RING_SIZE: power of 2
+template <typename entry_t, uint32_t RING_SIZE>
+class MpscRing {
+public:
+	MpscRing(void) {
+		for (uint32_t index = 0; index < RING_SIZE; index++) {
+			m_slots[index].sequence.store(index, std::memory_order_relaxed);
+		}
+		m_tail.store(0, std::memory_order_relaxed);
+		m_head = 0;
+	}
+
+	// false if full
+	bool push(const entry_t& entry) {
+		uint32_t pos = m_tail.load(std::memory_order_relaxed);
+		slot_t* slot;
+
+		while (1) {
+			slot = &m_slots[pos & (RING_SIZE - 1)];
+			int32_t diff = (int32_t)(slot->sequence.load(std::memory_order_acquire) - pos);
+			if (diff == 0) {
+				// the slot is free, claim it
+				if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) == true) {
+					break;
+				}
+			}
+			else if (diff < 0) {
+				return false;
+			}
+			else {
+				pos = m_tail.load(std::memory_order_relaxed);
+			}
+		}
+		slot->entry = entry;
+		slot->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// consumer only, false if empty
+	bool pop(entry_t* entry) {
+		slot_t* slot = &m_slots[m_head & (RING_SIZE - 1)];
+
+		if (slot->sequence.load(std::memory_order_acquire) != m_head + 1) {
+			return false;
+		}
+		*entry = slot->entry;
+		slot->sequence.store(m_head + RING_SIZE, std::memory_order_release);
+		m_head++;
+		return true;
+	}
+
+	// consumer only
+	bool is_empty(void) {
+		return (m_slots[m_head & (RING_SIZE - 1)].sequence.load(std::memory_order_acquire) != m_head + 1);
+	}
+
+private:
+	struct slot_t {
+		std::atomic<uint32_t> sequence;  // pos: free for push at pos, pos + 1: filled
+		entry_t entry;
+	};
+
+	slot_t m_slots[RING_SIZE];
+	std::atomic<uint32_t> m_tail;
+	uint32_t m_head;
+};
+
+// Tape commands from X1 (command receive thread) and the GUI, and host commands
+// (DataRecorder::host_command_t), to the command sender thread.
+struct command_entry_t {
+	enum source_t {
+		SOURCE_X1,
+		SOURCE_HOST,
+	};
+
+	uint8_t command;
+	source_t source;
+	uint64_t value;                              // argument of a host command
+	std::chrono::steady_clock::time_point time;  // when queued
+};
+
+typedef MpscRing<command_entry_t, 64> CommandRing;
+
+// Responses to EZ-USB from any thread, to the response sender thread.
+struct response_entry_t {
+	uint8_t type;
+	uint16_t value;
+	uint8_t length;   // of the value: 1 or 2 (LSB first)
+};
+
+typedef MpscRing<response_entry_t, 64> ResponseRing;
+
+
 //
 //
 //
@@ -793,21 +2249,55 @@ public:
 		m_sensor_state = 0;
 		m_tape_mode = TAPE_MODE_EJECT;
 		m_tape_run_flag = false;
-		m_tape_transfer = libusb_alloc_transfer(0);
+		m_pending_stop_count = 0;
+		m_stop_latency_sum_ms = 0;
+		m_stop_latency_max_ms = 0;
+		m_stop_count = 0;
+		for (auto& slot : m_tape_transfers) {
+			slot.transfer = libusb_alloc_transfer(0);
+		}
+		m_response_transfer = libusb_alloc_transfer(0);
+		m_stream_allocation_count = 0;
+		m_thread_config = { false, -1 };
+		m_is_realtime = false;
+		m_has_last_complete = false;
+		m_transfer_depth = INITIAL_TRANSFER_DEPTH;
+		m_depth_change_tick = 0;
+		m_is_tape_streaming = false;
+		m_is_buffer_stats_valid = false;
+		m_underrun_count = 0;
+		m_overrun_count = 0;
+		m_dropped_count = 0;
+		m_underrun_total = 0;
+		m_overrun_total = 0;
+		m_dropped_total = 0;
+		reset_transfer_stats();
 
 		m_usb_handle = nullptr;
+		m_transport = nullptr;
 		m_usb_callback = this->usb_callback;
 
 		m_is_send_event = true;
 		m_event_callback = nullptr;
 
-		m_use_alt_44k = false;
+		m_use_pulse_play = false;
+		m_use_rec_capture = false;
+		m_usb_sample_rate = 0;
 
 		m_command_receive_run_flag = true;
 		m_command_sender_run_flag = true;
+		m_response_sender_run_flag = true;
 		m_usb_error = false;
+		m_is_disconnected = false;
+		m_is_reconnect_queued = false;
+
+		m_mechanical_delay_ms = DEFAULT_MECHANICAL_DELAY_MS;
+		m_notify_count[0] = 0;
+		m_notify_count[1] = 0;
 	}
 
+	static constexpr int DEFAULT_MECHANICAL_DELAY_MS = 500;
+
 	enum tape_command_t {
 		COM_EJECT = 0x00,
 		COM_STOP = 0x01,
@@ -845,64 +2335,88 @@ public:
 		EVENT_UPDATE_SCREEN,
 		EVENT_USB_DISCONNECTED,
 		EVENT_USB_ERROR,
+		EVENT_USB_RECONNECTED,
+		EVENT_TAPE_ERROR,        // set_tape(): could not be opened
 	};
 
 	void power_on(void)
 	{
+		start_response_sender_thread();
 		start_command_receive_thread();
 		start_command_sender_thread();
 	}
 
 	void power_off(void)
 	{
-		eject_tape();
-		::Sleep(500);  // wait for stop_tape() process
+		// no more commands, then the tape is stopped here
+		m_command_sender_run_flag = false;
+		wake_command_sender();
+		m_command_sender_thread.join();
+
+		stop_tape(false);
+		close_tape(false);
 		m_command_receive_run_flag = false;
 		if (m_usb_error == false) {
-			libusb_cancel_transfer(m_command_receive_transfer);
+			m_transport->cancel_transfer(m_command_receive_transfer);
 		}
 		m_command_receive_thread.join();
 
-		m_command_sender_run_flag = false;
-		m_command_cond.notify_one();
-		m_command_sender_thread.join();
+		// after the responses queued so far
+		m_response_sender_run_flag = false;
+		wake_response_sender();
+		m_response_sender_thread.join();
+		discard_host_commands();
 
-		if (m_usb_thread.joinable() == true) {
-			libusb_cancel_transfer(m_tape_transfer);
-			m_tape_run_flag = false;
-			m_usb_thread.join();
-			libusb_free_transfer(m_tape_transfer);
+		for (auto& slot : m_tape_transfers) {
+			libusb_free_transfer(slot.transfer);
 		}
+		libusb_free_transfer(m_response_transfer);
+	}
 
+	// Tape and setting changes are queued with the tape commands and done by the command
+	// sender, the only thread that changes the tape and (with the tape thread at the tape end)
+	// the tape mode. The GUI sees the result by get_current_mode() / get_sensor().
+	// Host events are noted when queued, so a replay queues them in the same order.
+
+	// EVENT_TAPE_ERROR if it cannot be opened
+	bool set_tape(const wchar_t* file_name) {
+		note_host_event(UsbTransport::HOST_TAPE_SET, file_name, (int)(wcslen(file_name) * sizeof(wchar_t)));
+		return enqueue_host_string(HOST_COM_SET_TAPE, file_name);
 	}
 
-	bool set_tape(wchar_t* file_name) {
-		if (m_tape.open(file_name) == false) {
-			return false;
+	// move the stopped tape (restoring a session), ignored beyond the end
+	void set_tape_position(uint64_t bit_pos) {
+		uint8_t value[8];
+		for (int index = 0; index < 8; index++) {
+			value[index] = (uint8_t)(bit_pos >> (index * 8));
 		}
-		m_sensor_state = TAPE_SET | ((m_tape.is_write_protected() == true) ? 0 : TAPE_NOT_WRITE_PROTECT);
-		m_tape_mode = TAPE_MODE_STOP;
-		set_usb_sample_rate();
-		send_sensor();
+		note_host_event(UsbTransport::HOST_TAPE_POSITION, value, sizeof(value));
+		enqueue_command(HOST_COM_TAPE_POSITION, command_entry_t::SOURCE_HOST, bit_pos);
+	}
 
-		return true;
+	// render PLAY data from the stopped tape now, so the next PLAY starts at once
+	void warm_play_cache(void) {
+		enqueue_command(HOST_COM_WARM_PLAY_CACHE, command_entry_t::SOURCE_HOST);
 	}
 
-	void eject_tape(bool is_internal = false) {
-		m_tape.close();
-		m_sensor_state = 0;
-		send_sensor();
-		if (is_internal == true) {
-			m_event_callback(EVENT_TAPE_EJECT);
-		}
+	// see TapFile::set_index_dir()
+	void set_index_dir(const wchar_t* dir) {
+		enqueue_host_string(HOST_COM_INDEX_DIR, dir);
+	}
+
+	void eject_tape(void) {
+		// COM_EJECT from X1 is in the USB traffic itself
+		note_host_event(UsbTransport::HOST_TAPE_EJECT, nullptr, 0);
+		enqueue_command(HOST_COM_EJECT, command_entry_t::SOURCE_HOST);
 	}
 
 	tape_mode_t get_current_mode(void) {
 		return m_tape_mode;
 	}
 
+	// TAPE_RUNNING follows the tape mode
 	uint8_t get_sensor(void) {
-		return m_sensor_state;
+		return (uint8_t)(m_sensor_state | ((is_running_mode(m_tape_mode) == true) ? TAPE_RUNNING : 0));
 	}
 
 	uint32_t get_tape_sample_rate(void)
@@ -910,30 +2424,136 @@ public:
 		return m_tape.get_tape_sample_rate();
 	}
 
-	void set_event_callback(void(*fn)(uint8_t)) {
+	void set_event_callback(void(*fn)(DataRecorder*, uint8_t)) {
 		m_event_callback = fn;
 	}
 
-	void set_alt_44k(bool use_alt_44k) {
-		m_use_alt_44k = use_alt_44k;
-		set_usb_sample_rate();
+	void set_rec_strategy(bool use_bit_conversion) {
+		note_host_setting(UsbTransport::HOST_REC_STRATEGY, use_bit_conversion);
+		enqueue_command(HOST_COM_REC_STRATEGY, command_entry_t::SOURCE_HOST, use_bit_conversion);
 	}
 
-	void set_rec_strategy(bool use_bit_conversion) {
-		m_tape.set_rec_bit_conversion(use_bit_conversion);
+	// bit conversion follows the X1 bit rate (see PllDecoder)
+	void set_rec_pll(bool use_pll) {
+		note_host_setting(UsbTransport::HOST_REC_PLL, use_pll);
+		enqueue_command(HOST_COM_REC_PLL, command_entry_t::SOURCE_HOST, use_pll);
+	}
+
+	void set_fast_load(bool use_fast_load) {
+		note_host_setting(UsbTransport::HOST_FAST_LOAD, use_fast_load);
+		enqueue_command(HOST_COM_FAST_LOAD, command_entry_t::SOURCE_HOST, use_fast_load);
+	}
+
+	void set_pulse_play(bool use_pulse_play) {
+		note_host_setting(UsbTransport::HOST_PULSE_PLAY, use_pulse_play);
+		enqueue_command(HOST_COM_PULSE_PLAY, command_entry_t::SOURCE_HOST, use_pulse_play);
 	}
 
-	uint32_t get_counter(void) {
+	void set_rec_capture(bool use_capture) {
+		note_host_setting(UsbTransport::HOST_REC_CAPTURE, use_capture);
+		enqueue_command(HOST_COM_REC_CAPTURE, command_entry_t::SOURCE_HOST, use_capture);
+	}
+
+	// delay to simulate the mechanical transition after the tape stops (0 = no delay)
+	void set_mechanical_delay(int msec) {
+		uint8_t value[2] = { (uint8_t)(msec & 0xff), (uint8_t)(msec >> 8) };
+		note_host_event(UsbTransport::HOST_MECHANICAL_DELAY, value, 2);
+		enqueue_command(HOST_COM_MECHANICAL_DELAY, command_entry_t::SOURCE_HOST, (uint64_t)(msec & 0xffff));
+	}
+
+	// EZ-USB sample rate used for PLAY (measured)
+	double get_usb_rate(void) {
+		return m_tape.get_usb_rate_estimate();
+	}
+
+	// tape transfers kept in flight, and EZ-USB buffer underruns (PLAY) / overruns (REC)
+	int get_transfer_depth(void) {
+		return m_transfer_depth;
+	}
+
+	uint32_t get_underrun_count(void) {
+		return m_underrun_total;
+	}
+
+	uint32_t get_overrun_count(void) {
+		return m_overrun_total;
+	}
+
+	// tape transfer throughput (bytes/sec) and submit to completion latency, over the last second
+	double get_throughput(void) {
+		return m_throughput;
+	}
+
+	double get_latency_avg_ms(void) {
+		return m_latency_avg_ms;
+	}
+
+	double get_latency_max_ms(void) {
+		return m_latency_max_ms;
+	}
+
+	// REC samples (runs in edge capture) lost in EZ-USB overruns
+	uint32_t get_dropped_count(void) {
+		return m_dropped_total;
+	}
+
+	uint64_t get_counter(void) {
+		if (m_play_cache.is_active() == true) {
+			return m_play_cache.get_bit_pos();
+		}
 		return m_tape.get_bit_pos();
 	}
 
-	uint32_t get_total_counter(void) {
+	uint64_t get_total_counter(void) {
 		return m_tape.get_total_bits();
 	}
 
-	void set_usb_handle(libusb_device_handle* handle)
+	PulseAnalyzer::stats_t get_pulse_stats(void) {
+		return m_tape.get_pulse_stats();
+	}
+
+	// real-time scheduling / CPU pinning of the tape thread and the tape writer, from the next run
+	void set_thread_priority(const ThreadPriority::config_t& config) {
+		enqueue_command(HOST_COM_THREAD_PRIORITY, command_entry_t::SOURCE_HOST,
+			((uint64_t)(uint32_t)config.cpu << 32) | (config.is_realtime ? 1 : 0));
+	}
+
+	// the tape thread got the real-time priority (last / current run)
+	bool is_realtime(void) {
+		return m_is_realtime;
+	}
+
+	// tape thread: transfer completions later than the data (sampled PLAY / REC)
+	JitterHistogram::stats_t get_tape_jitter(void) {
+		return m_tape_jitter.get_stats();
+	}
+
+	JitterHistogram::stats_t get_write_jitter(void) {
+		return m_tape.get_write_jitter();
+	}
+
+	// heap allocations while PLAY / REC were running (tape, play render and tape writer threads),
+	// counted in debug builds only (AllocationCounter)
+	uint64_t get_stream_allocation_count(void) {
+		return m_stream_allocation_count + m_play_cache.get_allocation_count() + m_tape.get_write_allocation_count();
+	}
+
+	double get_fast_load_saved_sec(void) {
+		return m_tape.get_fast_load_saved_sec();
+	}
+
+	double get_fast_load_skippable_sec(void) {
+		return m_tape.get_fast_load_skippable_sec();
+	}
+
+	void set_transport(UsbTransport* transport)
 	{
-		m_usb_handle = handle;
+		m_transport = transport;
+		m_usb_handle = transport->get_handle();
+	}
+
+	const char* get_name(void) {
+		return m_transport->get_name();
 	}
 
 	bool is_running(void)
@@ -941,29 +2561,348 @@ public:
 		return m_tape_run_flag;
 	}
 
+	// the board has gone (waiting for reconnect())
+	bool is_disconnected(void)
+	{
+		return (m_is_disconnected == true && m_is_reconnect_queued == false);
+	}
+
+	// The board is back with firmware loaded (handle: opened on the same bus / port,
+	// nullptr for the simulated board). Only queued here, the command sender takes it over
+	// (reconnect_board()). false if not queued, the handle is left to the caller.
+	bool reconnect(libusb_device_handle* handle = nullptr)
+	{
+		bool is_queued = false;
+
+		if (m_is_reconnect_queued.compare_exchange_strong(is_queued, true) == false) {
+			return false;
+		}
+		if (enqueue_command(HOST_COM_RECONNECT, command_entry_t::SOURCE_HOST, (uint64_t)(uintptr_t)handle) == false) {
+			m_is_reconnect_queued = false;
+			return false;
+		}
+		return true;
+	}
+
+	// tape command from the GUI, processed in order with X1 commands
 	void command(uint8_t command) {
-		process_command(command);
-		// ignore return value
+		enqueue_command(command, command_entry_t::SOURCE_HOST);
+	}
+
+	// STOP / EJECT: queued to processed (msec)
+	double get_stop_latency_avg_ms(void) {
+		return (m_stop_count > 0) ? m_stop_latency_sum_ms / m_stop_count : 0;
+	}
+
+	double get_stop_latency_max_ms(void) {
+		return m_stop_latency_max_ms;
+	}
+
+private:
+	// processed by the command sender like tape commands, only from SOURCE_HOST
+	enum host_command_t {
+		HOST_COM_RECONNECT = 0xc0,   // value: libusb_device_handle* (the first host command)
+		HOST_COM_SET_TAPE,           // value: std::wstring* file name
+		HOST_COM_TAPE_POSITION,      // value: bit position
+		HOST_COM_WARM_PLAY_CACHE,
+		HOST_COM_EJECT,
+		HOST_COM_INDEX_DIR,          // value: std::wstring* directory
+		HOST_COM_REC_STRATEGY,       // value: bit conversion
+		HOST_COM_REC_PLL,            // value: PLL bit decoder
+		HOST_COM_FAST_LOAD,          // value: leader / blank compression on PLAY
+		HOST_COM_PULSE_PLAY,         // value: pulse playback
+		HOST_COM_REC_CAPTURE,        // value: edge capture
+		HOST_COM_MECHANICAL_DELAY,   // value: msec
+		HOST_COM_THREAD_PRIORITY,    // value: bit0 real-time, bit63:32 CPU
+	};
+
+	bool enqueue_command(uint8_t command, command_entry_t::source_t source, uint64_t value = 0)
+	{
+		command_entry_t entry = { command, source, value, std::chrono::steady_clock::now() };
 
-		if (command == COM_STOP) {
+		if (m_command_ring.push(entry) == false) {
+			Trace::instant("command ring full", command);
+			return false;
+		}
+		if (command == COM_STOP || command == COM_EJECT) {
+			// end the running operation now, not when the command is processed
+			cancel_tape_operation();
+		}
+		wake_command_sender();
+		return true;
+	}
+
+	// the string belongs to the entry until processed (or discarded at power off)
+	bool enqueue_host_string(uint8_t command, const wchar_t* text)
+	{
+		std::wstring* value = new std::wstring(text);
+
+		if (enqueue_command(command, command_entry_t::SOURCE_HOST, (uint64_t)(uintptr_t)value) == false) {
+			delete value;
+			return false;
+		}
+		return true;
+	}
+
+	bool is_host_command(const command_entry_t& entry)
+	{
+		return (entry.source == command_entry_t::SOURCE_HOST && entry.command >= HOST_COM_RECONNECT);
+	}
+
+	void process_host_command(const command_entry_t& entry)
+	{
+		TraceScope trace("process_host_command", entry.command);
+
+		bool is_on = (entry.value != 0);
+
+		switch (entry.command) {
+		case HOST_COM_RECONNECT:
+			reconnect_board((libusb_device_handle*)(uintptr_t)entry.value);
+			break;
+		case HOST_COM_SET_TAPE:
+		{
+			std::wstring* file_name = (std::wstring*)(uintptr_t)entry.value;
+			open_tape(*file_name);
+			delete file_name;
+			break;
+		}
+		case HOST_COM_TAPE_POSITION:
+			move_tape(entry.value);
+			break;
+		case HOST_COM_WARM_PLAY_CACHE:
+			if (m_tape_mode == TAPE_MODE_STOP && m_usb_error == false) {
+				m_play_cache.start(&m_tape, m_use_pulse_play, m_usb_sample_rate / 8);
+			}
+			break;
+		case HOST_COM_EJECT:
+			stop_for_host_command();
+			change_mode(m_tape_mode, TAPE_MODE_EJECT);
+			close_tape(false);
+			break;
+		case HOST_COM_INDEX_DIR:
+		{
+			std::wstring* dir = (std::wstring*)(uintptr_t)entry.value;
+			m_tape.set_index_dir(dir->c_str());
+			delete dir;
+			break;
+		}
+		case HOST_COM_REC_STRATEGY:
+			m_tape.set_rec_bit_conversion(is_on);
+			break;
+		case HOST_COM_REC_PLL:
+			m_tape.set_rec_pll(is_on);
+			break;
+		case HOST_COM_FAST_LOAD:
+			stop_for_host_command();
+			m_play_cache.stop();
+			m_tape.set_fast_load(is_on);
+			break;
+		case HOST_COM_PULSE_PLAY:
+			stop_for_host_command();
+			m_play_cache.stop();
+			m_use_pulse_play = is_on;
+			send_response(PC_PLAY_MODE_CHANGE, (uint8_t)(is_on ? PLAY_MODE_PULSE : PLAY_MODE_SAMPLED));
+			break;
+		case HOST_COM_REC_CAPTURE:
+			stop_for_host_command();
+			m_use_rec_capture = is_on;
+			m_tape.set_rec_capture(is_on);
+			send_response(PC_REC_MODE_CHANGE, (uint8_t)(is_on ? REC_MODE_CAPTURE : REC_MODE_SAMPLED));
+			break;
+		case HOST_COM_MECHANICAL_DELAY:
+			m_mechanical_delay_ms = (int)entry.value;
+			break;
+		case HOST_COM_THREAD_PRIORITY:
+			m_thread_config = { (entry.value & 1) != 0, (int)(int32_t)(entry.value >> 32) };
+			m_tape.set_thread_priority(m_thread_config);
+			break;
+		default:
+			break;
+		}
+	}
+
+	// the tape is changed or moved, or PLAY data is made differently: stop the tape first,
+	// as STOP by the GUI
+	void stop_for_host_command(void)
+	{
+		if (is_running_mode(m_tape_mode) == true) {
+			process_command(COM_STOP);
 			send_response(PC_REQUEST, COM_STOP);
 		}
 	}
 
-private:
+	void open_tape(std::wstring& file_name)
+	{
+		stop_for_host_command();
+		m_play_cache.stop();
+		tape_mode_t mode = m_tape_mode;
+		if (m_tape.open(&file_name[0]) == false) {
+			// the previous tape has been closed
+			m_sensor_state = 0;
+			change_mode(mode, TAPE_MODE_EJECT);
+			send_sensor();
+			m_event_callback(this, EVENT_TAPE_ERROR);
+			return;
+		}
+		m_sensor_state = (uint8_t)(TAPE_SET | ((m_tape.is_write_protected() == true) ? 0 : TAPE_NOT_WRITE_PROTECT));
+		change_mode(mode, TAPE_MODE_STOP);
+		set_usb_sample_rate();
+		send_sensor();
+	}
+
+	// the stopped tape only, ignored beyond the end
+	void move_tape(uint64_t bit_pos)
+	{
+		if (m_tape_mode != TAPE_MODE_STOP || bit_pos >= m_tape.get_total_bits()) {
+			return;
+		}
+		m_play_cache.stop();
+		m_tape.set_bit_pos(bit_pos);
+	}
+
+	// is_internal: ejected by X1, the GUI is told
+	void close_tape(bool is_internal)
+	{
+		m_play_cache.stop();
+		m_tape.close();
+		m_sensor_state = 0;
+		send_sensor();
+		if (is_internal == true) {
+			m_event_callback(this, EVENT_TAPE_EJECT);
+		}
+	}
+
+	// power off: host commands left in the ring give back what they hold
+	void discard_host_commands(void)
+	{
+		command_entry_t entry;
+
+		while (m_command_ring.pop(&entry) == true) {
+			if (is_host_command(entry) == false) {
+				continue;
+			}
+			if (entry.command == HOST_COM_RECONNECT) {
+				// closed with the transport
+				m_transport->reopen((libusb_device_handle*)(uintptr_t)entry.value);
+			}
+			else if (entry.command == HOST_COM_SET_TAPE || entry.command == HOST_COM_INDEX_DIR) {
+				delete (std::wstring*)(uintptr_t)entry.value;
+			}
+		}
+	}
+
+	// Command sender: restart USB threads on the reopened board and bring EZ-USB to the state
+	// before disconnection. The tape stays open, so its position is kept.
+	void reconnect_board(libusb_device_handle* handle)
+	{
+		// threads stopped by the disconnection, and the response sender, off the old handle
+		m_tape_run_flag = false;
+		if (m_usb_thread.joinable() == true) {
+			m_usb_thread.join();
+		}
+		if (m_command_receive_thread.joinable() == true) {
+			m_command_receive_thread.join();
+		}
+		m_response_sender_run_flag = false;
+		wake_response_sender();
+		m_response_sender_thread.join();
+
+		m_transport->reopen(handle);
+		m_usb_handle = m_transport->get_handle();
+		m_is_buffer_stats_valid = false;
+		m_usb_error = false;
+		m_is_disconnected = false;
+		m_is_reconnect_queued = false;
+		tape_mode_t mode = m_tape_mode;
+		if (mode != TAPE_MODE_EJECT) {
+			change_mode(mode, TAPE_MODE_STOP);
+		}
+
+		m_response_sender_run_flag = true;
+		start_response_sender_thread();
+		m_command_receive_run_flag = true;
+		start_command_receive_thread();
+
+		// the firmware has started with its defaults
+		if (m_usb_sample_rate != 0) {
+			send_response_word(PC_TAPE_SAMPLE_RATE_CHANGE, (uint16_t)m_usb_sample_rate);
+		}
+		send_response(PC_REC_MODE_CHANGE, (uint8_t)(m_use_rec_capture ? REC_MODE_CAPTURE : REC_MODE_SAMPLED));
+		send_response(PC_PLAY_MODE_CHANGE, (uint8_t)(m_use_pulse_play ? PLAY_MODE_PULSE : PLAY_MODE_SAMPLED));
+		send_sensor();
+
+		m_event_callback(this, EVENT_USB_RECONNECTED);
+	}
+
+	// STOP / EJECT has been queued, and not processed yet
+	bool is_stop_pending(void)
+	{
+		return (m_pending_stop_count > 0);
+	}
+
+	void wake_command_sender(void)
+	{
+		{
+			// the sender is either before its check or waiting
+			std::lock_guard<std::mutex> lock(m_command_lock);
+		}
+		m_command_cond.notify_one();
+	}
+
+	// Until the STOP / EJECT is processed, tape operations end at once
+	// (also the ones started by the commands queued before it), so it is not kept waiting.
+	void cancel_tape_operation(void)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_cancel_lock);
+			m_pending_stop_count++;
+		}
+		m_cancel_cond.notify_all();
+	}
+
+	void end_tape_cancel(void)
+	{
+		std::lock_guard<std::mutex> lock(m_cancel_lock);
+		m_pending_stop_count--;
+	}
+
+	// sleep, false if cancelled
+	bool wait_not_cancelled(int msec)
+	{
+		std::unique_lock<std::mutex> lock(m_cancel_lock);
+		return (m_cancel_cond.wait_for(lock, std::chrono::milliseconds(msec), [this] {return (m_pending_stop_count > 0); }) == false);
+	}
+
+	void update_stop_latency(const command_entry_t& entry)
+	{
+		double latency = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - entry.time).count();
+
+		m_stop_latency_sum_ms += latency;
+		m_stop_count++;
+		if (latency > m_stop_latency_max_ms) {
+			m_stop_latency_max_ms = latency;
+		}
+		Trace::counter("stop latency usec", (int32_t)(latency * 1000));
+	}
+
 	void stop_tape(bool is_send_event = true)
 	{
-		if (m_tape_mode == TAPE_MODE_REC) {
-			::Sleep(500);// wait for EZ-USB to complete OUT process 
-			m_tape_run_flag = false;
-			m_tape.stop_write();
-			libusb_cancel_transfer(m_tape_transfer);
+		tape_mode_t prev_mode = m_tape_mode;
+
+		if (prev_mode == TAPE_MODE_REC) {
+			// keep reading EP6 until EZ-USB has flushed the rest of the recording
+			request_tape_stop(NOTIFY_EP6_FLUSHED);
 		}
-		// FIXME: clean-up stop tape handling.. 
 		m_tape_run_flag = false;
 		if (m_usb_thread.joinable() == true) {
+			for (auto& slot : m_tape_transfers) {
+				m_transport->cancel_transfer(slot.transfer);
+			}
 			m_usb_thread.join();
 		}
+		if (prev_mode == TAPE_MODE_PLAY) {
+			request_tape_stop(NOTIFY_TIMER_STOPPED);
+		}
 		if (is_send_event == true) {
 			send_sensor();
 			send_response(PC_REQUEST, DataRecorder::COM_STOP);
@@ -971,75 +2910,146 @@ private:
 		m_is_send_event = true;
 	}
 
+	static bool is_running_mode(tape_mode_t mode)
+	{
+		return (mode >= TAPE_MODE_PLAY && mode <= TAPE_MODE_AFF);
+	}
+
+	// Tape mode changes allowed (see change_mode()):
+	//  a tape is set (EJECT -> STOP), runs from STOP, and goes back to STOP when stopped
+	//  (by a command or at the tape end); a running mode given again stays as it is
+	static bool is_valid_transition(tape_mode_t from, tape_mode_t to)
+	{
+		static constexpr uint16_t STOP = 1 << TAPE_MODE_STOP;
+		static constexpr uint16_t EJECT = 1 << TAPE_MODE_EJECT;
+		static constexpr uint16_t RUNNING = (1 << TAPE_MODE_PLAY) | (1 << TAPE_MODE_REC) | (1 << TAPE_MODE_REW)
+			| (1 << TAPE_MODE_FF) | (1 << TAPE_MODE_AREW) | (1 << TAPE_MODE_AFF);
+		static const uint16_t next_modes[] = {
+			0,                                // NONE
+			(1 << TAPE_MODE_PLAY) | STOP,     // PLAY
+			(1 << TAPE_MODE_REC) | STOP,      // REC
+			(1 << TAPE_MODE_REW) | STOP,      // REW
+			(1 << TAPE_MODE_FF) | STOP,       // FF
+			(1 << TAPE_MODE_AREW) | STOP,     // AREW
+			(1 << TAPE_MODE_AFF) | STOP,      // AFF
+			RUNNING | STOP | EJECT,           // STOP
+			STOP | EJECT,                     // EJECT
+		};
+
+		return ((next_modes[from] & (1 << to)) != 0);
+	}
+
+	// One tape mode change, by the command sender or by the tape thread at the tape end:
+	// false if not allowed, or the mode is no longer 'from' (the other one has changed it)
+	bool change_mode(tape_mode_t from, tape_mode_t to)
+	{
+		if (is_valid_transition(from, to) == false) {
+			Trace::instant("invalid tape mode change", from * 16 + to);
+			return false;
+		}
+		if (m_tape_mode.compare_exchange_strong(from, to) == false) {
+			return false;
+		}
+		Trace::counter("tape mode", to);
+		return true;
+	}
+
+	static tape_mode_t get_command_mode(uint8_t command)
+	{
+		switch (command) {
+		case COM_PLAY:
+			return TAPE_MODE_PLAY;
+		case COM_STOP:
+			return TAPE_MODE_STOP;
+		case COM_REW:
+			return TAPE_MODE_REW;
+		case COM_FF:
+			return TAPE_MODE_FF;
+		case COM_AREW:
+			return TAPE_MODE_AREW;
+		case COM_AFF:
+			return TAPE_MODE_AFF;
+		case COM_EJECT:
+			return TAPE_MODE_EJECT;
+		case COM_REC:
+			return TAPE_MODE_REC;
+		default:
+			return TAPE_MODE_NONE;
+		}
+	}
+
 	bool process_command(uint8_t command) {
+		TraceScope trace("process_command", command);
 		bool is_respond_immediately = true;
-		uint8_t new_sensor = m_sensor_state;
-		tape_mode_t new_mode = TAPE_MODE_NONE;
+		tape_mode_t new_mode = get_command_mode(command);
+		tape_mode_t mode = m_tape_mode;
+
+		if (new_mode == TAPE_MODE_NONE) {
+			return true;
+		}
+		if (is_running_mode(mode) == true && new_mode != mode) {
+			// To change the tape mode, stop the tape first (it may have stopped at the end meanwhile)
+			stop_tape(false);
+			mode = m_tape_mode;
+			if (mode != TAPE_MODE_STOP) {
+				change_mode(mode, TAPE_MODE_STOP);
+			}
+			mode = TAPE_MODE_STOP;
+		}
+		if (is_valid_transition(mode, new_mode) == false || (mode == TAPE_MODE_EJECT && new_mode == TAPE_MODE_STOP)) {
+			// no tape (only open_tape() brings EJECT to STOP)
+			Trace::instant("tape command ignored", command);
+			send_sensor();
+			return true;
+		}
 
 		switch (command) {
 		case COM_PLAY:
-//			::OutputDebugStringA("PLAY\n");
-			new_sensor |= TAPE_RUNNING;
-			new_mode = TAPE_MODE_PLAY;
+			if (m_usb_error == false) {
+				// already warm if PLAY has been stopped here
+				m_play_cache.start(&m_tape, m_use_pulse_play, m_usb_sample_rate / 8);
+			}
 			break;
 		case COM_STOP:
-//			::OutputDebugStringA("STOP\n");
-			new_mode = TAPE_MODE_STOP;
-			new_sensor &= ~TAPE_RUNNING;
 			stop_tape(false);
 			break;
 		case COM_REW:
-//			::OutputDebugStringA("REW\n");
-			new_sensor |= TAPE_RUNNING;
-			new_mode = TAPE_MODE_REW;
-			break;
 		case COM_FF:
-//			::OutputDebugStringA("FF\n");
-			new_sensor |= TAPE_RUNNING;
-			new_mode = TAPE_MODE_FF;
+			// the tape is moved other than by PLAY: put it back to the play head
+			m_play_cache.stop();
 			break;
 		case COM_AREW:
-//			::OutputDebugStringA("AREW\n");
-			new_sensor |= TAPE_RUNNING;
-			new_mode = TAPE_MODE_AREW;
-			m_tape.start_arew();
+			m_play_cache.stop();
+			if (mode != TAPE_MODE_AREW) {
+				m_tape.start_arew();
+			}
 			is_respond_immediately = false;
 			break;
 		case COM_AFF:
-//			::OutputDebugStringA("AFF\n");
-			new_sensor |= TAPE_RUNNING;
-			new_mode = TAPE_MODE_AFF;
-			m_tape.start_aff();
+			m_play_cache.stop();
+			if (mode != TAPE_MODE_AFF) {
+				m_tape.start_aff();
+			}
 			is_respond_immediately = false;
 			break;
 		case COM_EJECT:
-			stop_tape(false);
-//			::OutputDebugStringA("Eject\n");
-			new_mode = TAPE_MODE_EJECT;
-			new_sensor &= ~(TAPE_RUNNING | TAPE_SET);
-			eject_tape(true);
+			close_tape(true);
 			break;
 		case COM_REC:
-//			::OutputDebugStringA("REC\n");
-			new_sensor |= TAPE_RUNNING;
-			new_mode = TAPE_MODE_REC;
-			if (m_tape_mode != TAPE_MODE_REC) {
+			m_play_cache.stop();
+			if (mode != TAPE_MODE_REC) {
 				m_tape.start_write();
 			}
 			break;
 		default:
-//			::OutputDebugStringA("Unknown code..\n");
 			break;
 		}
 
-		if (m_tape_mode != TAPE_MODE_STOP && m_tape_mode != TAPE_MODE_EJECT && new_mode != m_tape_mode) {
-			// To change the tape mode, stop thet tape first
-			stop_tape(false);
+		if (change_mode(mode, new_mode) == false) {
+			// the same mode again, ended at the tape end meanwhile
+			is_respond_immediately = true;
 		}
-		m_tape_mode = new_mode;
-		m_sensor_state = new_sensor;
-
-		if (m_tape_run_flag == false && (new_sensor & TAPE_RUNNING) && (new_sensor & TAPE_SET)) {
+		else if (m_tape_run_flag == false && is_running_mode(new_mode) == true) {
 			m_tape_run_flag = true;
 
 			if (m_usb_thread.joinable() == true) {
@@ -1050,51 +3060,73 @@ private:
 			::OutputDebugStringA("Tape Running..");
 		}
 		send_sensor();
-		m_event_callback(EVENT_UPDATE_SCREEN);
+		m_event_callback(this, EVENT_UPDATE_SCREEN);
 
 		return is_respond_immediately;
 	}
 
 	void run_tape_thread(void) {
-		uint8_t trans_data[512];
-		int actual_length = 0;
 		ULONGLONG prev_time = 0;
 		bool is_usb_task = false;
 		bool is_send_event = false;
+		bool is_data_end = false;
+		int head = 0;      // oldest transfer in flight
+		int in_flight = 0;
+		tape_mode_t run_mode = m_tape_mode;
 
+		Trace::set_thread_name("tape");
 		if (m_usb_error) {
 			return;
 		}
+		ThreadPriority priority(m_thread_config);
+		m_is_realtime = priority.is_realtime();
+		m_tape_jitter.reset();
+		m_has_last_complete = false;
+		if (m_tape_mode == TAPE_MODE_PLAY) {
+			m_rate_estimator.start(m_usb_sample_rate);
+		}
+		m_is_tape_streaming = true;
+		reset_transfer_stats();
 
+		AllocationCounter::reset_thread_count();
 		while (m_tape_run_flag) {
-			usb_callback_user_data_t user_data;
-			user_data.completed = 0;
-			user_data.recorder = this;
 			is_usb_task = false;
 
-			switch (m_tape_mode) {
-			case TAPE_MODE_REC:
-				libusb_fill_bulk_transfer(m_tape_transfer, m_usb_handle, IN_TAPE_EP, trans_data,
-					sizeof(trans_data), m_usb_callback, &user_data, USB_TIMEOUT_MS);
-				is_usb_task = true;
+			if (is_stop_pending() && run_mode != TAPE_MODE_REC) {
+				// STOP / EJECT is coming (REC is stopped by stop_tape() to keep its tail)
+				m_tape_run_flag = false;
 				break;
+			}
 
+			switch (m_tape_mode) {
+			case TAPE_MODE_REC:
 			case TAPE_MODE_PLAY:
-			{
-				ssize_t num_read = m_tape.fill_usb_data(trans_data, READ_CHUNK_SIZE);
-				if (num_read <= 0) {
-					m_tape_run_flag = false;
-					is_send_event = true;
-					num_read = -num_read;
+				// keep m_transfer_depth transfers queued, so EZ-USB does not wait for this thread
+				while (is_data_end == false && in_flight < m_transfer_depth) {
+					int ret = submit_tape_transfer(&m_tape_transfers[(head + in_flight) % MAX_TRANSFER_DEPTH], &is_data_end);
+					if (ret < 0) {
+						m_usb_error = true;
+						m_tape_run_flag = false;
+						break;
+					}
+					if (ret == 0) {
+						break;
+					}
+					in_flight++;
 				}
-				if (num_read == 0) {
+				Trace::counter("transfers in flight", in_flight);
+				if (is_data_end == true) {
+					// EZ-USB underruns from now on are the end of the tape
+					m_is_tape_streaming = false;
+				}
+				if (in_flight == 0) {
+					// all data has been sent
+					m_tape_run_flag = false;
+					is_send_event = (m_usb_error == false);
 					break;
 				}
-				libusb_fill_bulk_transfer(m_tape_transfer, m_usb_handle, OUT_TAPE_EP, trans_data,
-					(int)num_read, m_usb_callback, &user_data, USB_TIMEOUT_MS);
 				is_usb_task = true;
-			}
-			break;
+				break;
 
 			case TAPE_MODE_REW:
 				if (m_tape.rewind(10) < 0) {
@@ -1102,7 +3134,7 @@ private:
 					is_send_event = true;
 				}
 				else {
-					::Sleep(10);
+					wait_not_cancelled(10);
 				}
 				break;
 
@@ -1112,7 +3144,7 @@ private:
 					is_send_event = true;
 				}
 				else {
-					::Sleep(10);
+					wait_not_cancelled(10);
 				}
 				break;
 
@@ -1122,7 +3154,7 @@ private:
 					is_send_event = true;
 				}
 				else {
-					::Sleep(10);
+					wait_not_cancelled(10);
 				}
 				break;
 
@@ -1132,53 +3164,256 @@ private:
 					is_send_event = true;
 				}
 				else {
-					::Sleep(10);
+					wait_not_cancelled(10);
 				}
 				break;
 			}
 
 			if (is_usb_task == true) {
-				int ret = libusb_submit_transfer(m_tape_transfer);
-				if (ret < 0) {
-					m_usb_error = true;
-					return;
-				}
-				while (!user_data.completed && m_tape_run_flag == true) {
-					if (libusb_handle_events_completed(NULL, &user_data.completed) < 0) {
-						if (user_data.completed == 2) {
-							m_usb_error = true;
-						}
-						return;
-					}
-				}
+				tape_transfer_t* slot = &m_tape_transfers[head];
+
 				if (m_tape_run_flag == false) {
+					// stop_tape() may have missed this transfer
+					m_transport->cancel_transfer(slot->transfer);
+				}
+				bool is_completed = wait_tape_transfer(slot);
+				head = (head + 1) % MAX_TRANSFER_DEPTH;
+				in_flight--;
+				if (is_completed == false) {
+					m_usb_error = true;
 					break;
 				}
-			}
-			if (m_tape_run_flag == true && m_tape_mode == TAPE_MODE_REC) {
-				if (m_tape.write_usb_data_to_tape(m_tape_transfer->buffer, m_tape_transfer->actual_length) < 0) {
+				if (complete_tape_transfer(slot) == false) {
 					m_tape_run_flag = false;
 					is_send_event = true;
 				}
+				if (m_tape_run_flag == false) {
+					break;
+				}
 			}
 
 			if ((GetTickCount64() - prev_time) > 90) {
 				prev_time = GetTickCount64();
-				m_event_callback(EVENT_UPDATE_SCREEN);
+				m_event_callback(this, EVENT_UPDATE_SCREEN);
+			}
+		}
+		m_is_tape_streaming = false;
+		m_stream_allocation_count += AllocationCounter::get_thread_count();
+
+		// reap the transfers still in flight, as their user_data lives in m_tape_transfers
+		for (int index = 0; index < in_flight; index++) {
+			m_transport->cancel_transfer(m_tape_transfers[(head + index) % MAX_TRANSFER_DEPTH].transfer);
+		}
+		for (; in_flight > 0; in_flight--) {
+			tape_transfer_t* slot = &m_tape_transfers[head];
+			head = (head + 1) % MAX_TRANSFER_DEPTH;
+			if (wait_tape_transfer(slot) == false) {
+				m_usb_error = true;
+				continue;
 			}
+			complete_tape_transfer(slot);
+		}
+		if (m_tape_mode == TAPE_MODE_REC) {
+			// also when REC has reached the tape end by itself
+			m_tape.stop_write();
+		}
+		if (m_usb_error) {
+			// reconnect_board() brings the tape to STOP
+			m_tape_run_flag = false;
+			return;
+		}
+		if (is_stop_pending() && run_mode != TAPE_MODE_REC) {
+			// the command sender does the transition
+			m_event_callback(this, EVENT_UPDATE_SCREEN);
+			return;
 		}
 
-		m_sensor_state &= ~(TAPE_RUNNING);
-		m_tape_mode = TAPE_MODE_STOP;
+		// the tape end, unless a command has changed the mode meanwhile
+		if (change_mode(run_mode, TAPE_MODE_STOP) == false) {
+			m_event_callback(this, EVENT_UPDATE_SCREEN);
+			return;
+		}
 		// simulate mechanical transition
-		::Sleep(500);
+		if (m_mechanical_delay_ms > 0 && wait_not_cancelled(m_mechanical_delay_ms) == false) {
+			is_send_event = false;
+		}
 
 		if (is_send_event == true) {
-//			::OutputDebugStringA("Stop event");
 			send_sensor();
 			send_response(PC_REQUEST, DataRecorder::COM_STOP);
 		}
-		m_event_callback(EVENT_UPDATE_SCREEN);
+		m_event_callback(this, EVENT_UPDATE_SCREEN);
+	}
+
+	struct tape_transfer_t;
+
+	// fill and submit one tape transfer
+	//  return 1: submitted, 0: no more PLAY data, -1: USB error
+	int submit_tape_transfer(tape_transfer_t* slot, bool* is_data_end)
+	{
+		int length = sizeof(slot->buffer);
+
+		slot->user_data.completed = 0;
+		slot->user_data.recorder = this;
+
+		if (m_tape_mode == TAPE_MODE_REC) {
+			libusb_fill_bulk_transfer(slot->transfer, m_usb_handle, IN_TAPE_EP, slot->buffer,
+				length, m_usb_callback, &slot->user_data, USB_TIMEOUT_MS);
+		}
+		else {
+			// rendered by m_play_cache
+			size_t num_read = m_play_cache.read(slot->buffer);
+			if (num_read < READ_CHUNK_SIZE) {
+				*is_data_end = true;
+			}
+			if (num_read == 0) {
+				return 0;
+			}
+			libusb_fill_bulk_transfer(slot->transfer, m_usb_handle, OUT_TAPE_EP, slot->buffer,
+				(int)num_read, m_usb_callback, &slot->user_data, USB_TIMEOUT_MS);
+		}
+		slot->submit_time = std::chrono::steady_clock::now();
+		int ret = m_transport->submit_transfer(slot->transfer);
+		if (ret < 0) {
+			set_usb_error(ret);
+			return -1;
+		}
+		Trace::async_begin((m_tape_mode == TAPE_MODE_REC) ? "rec transfer" : "play transfer", (int32_t)(intptr_t)slot->transfer);
+		return 1;
+	}
+
+	void note_host_event(UsbTransport::host_event_t code, const void* data, int length)
+	{
+		if (m_transport != nullptr) {
+			m_transport->note_host_event(code, data, length);
+		}
+	}
+
+	void note_host_setting(UsbTransport::host_event_t code, bool is_on)
+	{
+		uint8_t value = is_on;
+		note_host_event(code, &value, 1);
+	}
+
+	// failed USB call, the board may have gone
+	void set_usb_error(int error)
+	{
+		m_usb_error = true;
+		if (error == LIBUSB_ERROR_NO_DEVICE && m_is_disconnected == false) {
+			m_is_disconnected = true;
+			m_event_callback(this, EVENT_USB_DISCONNECTED);
+		}
+	}
+
+	void reset_transfer_stats(void)
+	{
+		m_stats_start = std::chrono::steady_clock::now();
+		m_stats_bytes = 0;
+		m_stats_count = 0;
+		m_stats_latency_sum = 0;
+		m_stats_latency_max = 0;
+		m_throughput = 0;
+		m_latency_avg_ms = 0;
+		m_latency_max_ms = 0;
+	}
+
+	void update_transfer_stats(tape_transfer_t* slot)
+	{
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		double latency = std::chrono::duration<double, std::milli>(now - slot->submit_time).count();
+
+		m_stats_bytes += slot->transfer->actual_length;
+		m_stats_count++;
+		m_stats_latency_sum += latency;
+		if (latency > m_stats_latency_max) {
+			m_stats_latency_max = latency;
+		}
+
+		double elapsed = std::chrono::duration<double>(now - m_stats_start).count();
+		if (elapsed >= 1.0) {
+			m_throughput = m_stats_bytes / elapsed;
+			m_latency_avg_ms = m_stats_latency_sum / m_stats_count;
+			m_latency_max_ms = m_stats_latency_max;
+			m_stats_start = now;
+			m_stats_bytes = 0;
+			m_stats_count = 0;
+			m_stats_latency_sum = 0;
+			m_stats_latency_max = 0;
+			decay_transfer_depth(now);
+		}
+	}
+
+	// one transfer less after DEPTH_DECAY_SEC without EZ-USB underrun / overrun (grown in handle_buffer_stats())
+	void decay_transfer_depth(std::chrono::steady_clock::time_point now)
+	{
+		int depth = m_transfer_depth.load();
+		int64_t now_tick = now.time_since_epoch().count();
+		int64_t decay_ticks = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::seconds(DEPTH_DECAY_SEC)).count();
+
+		if (depth > INITIAL_TRANSFER_DEPTH && now_tick - m_depth_change_tick.load() >= decay_ticks
+			&& m_transfer_depth.compare_exchange_strong(depth, depth - 1) == true) {
+			m_depth_change_tick = now_tick;
+			Trace::counter("transfer depth", depth - 1);
+		}
+	}
+
+	// A transfer completes as EZ-USB has sent (or sampled) its data, so it can come as late as
+	// the previous one plus its own data length. Later than that is how late this thread woke up.
+	// Pulse PLAY and edge capture REC have no fixed data rate, not measured.
+	void update_tape_jitter(int length)
+	{
+		if ((m_use_pulse_play == true && m_tape_mode == TAPE_MODE_PLAY)
+			|| (m_use_rec_capture == true && m_tape_mode == TAPE_MODE_REC)
+			|| m_usb_sample_rate == 0) {
+			return;
+		}
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (m_has_last_complete == true) {
+			double interval = std::chrono::duration<double, std::micro>(now - m_last_complete_time).count();
+			m_tape_jitter.add(interval - (double)length * 8 * 1000000 / m_usb_sample_rate);
+		}
+		m_last_complete_time = now;
+		m_has_last_complete = true;
+	}
+
+	// wait for completion (or cancellation), false if USB has gone
+	bool wait_tape_transfer(tape_transfer_t* slot)
+	{
+		while (!slot->user_data.completed) {
+			if (m_transport->handle_events_completed(&slot->user_data.completed) < 0) {
+				return false;
+			}
+		}
+		return (slot->user_data.completed != 2);
+	}
+
+	// pass the transferred data on, false if the tape has reached its end
+	bool complete_tape_transfer(tape_transfer_t* slot)
+	{
+		struct libusb_transfer* transfer = slot->transfer;
+
+		Trace::async_end((m_tape_mode == TAPE_MODE_REC) ? "rec transfer" : "play transfer", (int32_t)(intptr_t)transfer);
+
+		if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+			update_transfer_stats(slot);
+			update_tape_jitter(transfer->actual_length);
+		}
+		if (m_tape_mode == TAPE_MODE_PLAY && m_use_pulse_play == false
+			&& transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+			// follow the real EZ-USB sample clock
+			m_rate_estimator.add_transfer(transfer->actual_length * 8);
+			double rate = m_rate_estimator.get_rate();
+			if (rate > 0) {
+				m_tape.set_usb_rate_estimate(rate);
+			}
+		}
+		if (m_tape_mode == TAPE_MODE_REC && transfer->actual_length > 0) {
+			// store the data even if canceled, it may be the tail of the recording
+			if (m_tape.write_usb_data_to_tape(transfer->buffer, transfer->actual_length) < 0) {
+				return false;
+			}
+		}
+		return true;
 	}
 
 	enum pc_response_t {
@@ -1186,22 +3421,29 @@ private:
 		PC_STATUS_CHANGE,
 		PC_REQUEST,
 		PC_TAPE_SAMPLE_RATE_CHANGE,
+		PC_TAPE_STOP,
+		PC_REC_MODE_CHANGE,
+		PC_PLAY_MODE_CHANGE,
 	};
 
-	enum tape_sample_rate_t {
-		TAPE_SAMPLE_48K = 0,
-		TAPE_SAMPLE_44K = 1,
-		TAPE_SAMPLE_44K_ALT = 2,
-		TAPE_SAMPLE_32K = 3,
+	enum play_mode_t {
+		PLAY_MODE_SAMPLED = 0,
+		PLAY_MODE_PULSE = 1,
 	};
 
-	struct pc_response_arg {
-		pc_response_t type;
-		uint8_t response;
+	enum rec_mode_t {
+		REC_MODE_SAMPLED = 0,
+		REC_MODE_CAPTURE = 1,
+	};
+
+	// notifications from EZ-USB (on the command endpoint)
+	enum pc_notify_t {
+		NOTIFY_TIMER_STOPPED = 0xf0,
+		NOTIFY_EP6_FLUSHED = 0xf1,
+		NOTIFY_BUFFER_STATS = 0xf2, // + underrun count, overrun count, dropped REC samples (16bit LSB first)
 	};
 
-	struct send_response_thread_param_t {
-		DataRecorder* obj;
+	struct pc_response_arg {
 		pc_response_t type;
 		uint8_t response;
 	};
@@ -1211,57 +3453,174 @@ private:
 		int completed;
 	};
 
-	void send_response_thread(pc_response_t type, uint8_t response)
+	struct tape_transfer_t {
+		struct libusb_transfer* transfer;
+		usb_callback_user_data_t user_data;
+		std::chrono::steady_clock::time_point submit_time;
+		uint8_t buffer[512];
+	};
+
+	void start_response_sender_thread(void)
 	{
-		struct libusb_transfer* response_transfer;
+		std::thread sender_thread([this]() {this->response_sender_thread(); });
+		sender_thread.swap(m_response_sender_thread);
+	}
 
-		if (m_usb_error) {
+	void wake_response_sender(void)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_response_lock);
+		}
+		m_response_cond.notify_one();
+	}
+
+	// one thread and one transfer for all responses, in the order queued
+	void response_sender_thread(void)
+	{
+		Trace::set_thread_name("response");
+		while (1) {
+			{
+				std::unique_lock<std::mutex> a_lock(m_response_lock);
+				m_response_cond.wait(a_lock, [this] {return (m_response_ring.is_empty() == false || m_response_sender_run_flag == false); });
+			}
+			response_entry_t entry;
+			while (m_response_ring.pop(&entry) == true) {
+				m_response_space_cond.notify_all();
+				send_response_transfer(entry);
+			}
+			if (m_response_sender_run_flag == false) {
+				return;
+			}
+		}
+	}
+
+	void send_response_transfer(const response_entry_t& entry)
+	{
+		if (m_usb_error || m_response_transfer == NULL) {
 			return;
 		}
+		TraceScope trace("send response", entry.type);
 
-		int actual_length = 0;
-		uint8_t tmp[2];
 		usb_callback_user_data_t user_data;
 
 		user_data.completed = 0;
 		user_data.recorder = this;
 
-		tmp[0] = type;
-		tmp[1] = response;
-
-//		char tmp_str[256];
-//		snprintf(tmp_str, sizeof(tmp_str), "Resp: Type:%d  Data:%d\n", type, response);
-//		::OutputDebugStringA(tmp_str);
-
-		response_transfer = libusb_alloc_transfer(0);
-		if (response_transfer == NULL) {
-			return;
-		}
+		m_response_buffer[0] = entry.type;
+		m_response_buffer[1] = (uint8_t)(entry.value & 0xff);
+		m_response_buffer[2] = (uint8_t)(entry.value >> 8);
 
-		libusb_fill_bulk_transfer(response_transfer, m_usb_handle, OUT_RESPONSE_EP, tmp,
-			2, m_usb_callback, &user_data, USB_TIMEOUT_MS);
-		int ret = libusb_submit_transfer(response_transfer);
+		libusb_fill_bulk_transfer(m_response_transfer, m_usb_handle, OUT_RESPONSE_EP, m_response_buffer,
+			1 + entry.length, m_usb_callback, &user_data, USB_TIMEOUT_MS);
+		int ret = m_transport->submit_transfer(m_response_transfer);
 		if (ret < 0) {
-			libusb_free_transfer(response_transfer);
-			m_usb_error = true;
+			set_usb_error(ret);
 			return;
 		}
-		while (!user_data.completed && m_command_receive_run_flag == true) {
-			if (libusb_handle_events_completed(NULL, &user_data.completed) < 0) {
-				if (user_data.completed == 2) {
-					m_usb_error == true;
+		while (!user_data.completed) {
+			if (m_transport->handle_events_completed(&user_data.completed) < 0) {
+				// user_data is on this stack: the transfer must not outlive it
+				m_transport->cancel_transfer(m_response_transfer);
+				while (!user_data.completed) {
+					m_transport->handle_events_completed(&user_data.completed);
 				}
+				break;
+			}
+		}
+		if (user_data.completed == 2) {
+			m_usb_error = true;
+		}
+	}
+
+	void queue_response(pc_response_t type, uint16_t response, int length)
+	{
+		response_entry_t entry = { (uint8_t)type, response, (uint8_t)length };
+
+		// never drop: wait while the EZ-USB holds its EP1 OUT (its queue to X1 is full)
+		while (m_response_ring.push(entry) == false) {
+			if (m_response_sender_run_flag == false || m_usb_error) {
+				Trace::instant("response dropped", type);
 				return;
 			}
+			wake_response_sender();
+			std::unique_lock<std::mutex> a_lock(m_response_lock);
+			m_response_space_cond.wait_for(a_lock, std::chrono::milliseconds(10));
 		}
-		libusb_free_transfer(response_transfer);
+		wake_response_sender();
 	}
 
 	void send_response(pc_response_t type, uint8_t response)
 	{
-		std::thread send_response([this, type, response]() {this->send_response_thread(type, response); });
-		// in a rude way..
-		send_response.detach();
+		queue_response(type, response, 1);
+	}
+
+	// 16bit value (LSB first)
+	void send_response_word(pc_response_t type, uint16_t response)
+	{
+		queue_response(type, response, 2);
+	}
+
+	// ask EZ-USB to stop sampling, and wait (bounded) for its notification
+	bool request_tape_stop(pc_notify_t notify)
+	{
+		int index = notify & NOTIFY_INDEX_MASK;
+		uint32_t count;
+
+		if (m_usb_error) {
+			return false;
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_notify_lock);
+			count = m_notify_count[index];
+		}
+		send_response(PC_TAPE_STOP, 0);
+
+		std::unique_lock<std::mutex> lock(m_notify_lock);
+		return m_notify_cond.wait_for(lock, std::chrono::milliseconds(TAPE_STOP_TIMEOUT_MS),
+			[this, index, count] {return (m_notify_count[index] != count || m_usb_error == true); });
+	}
+
+	// EZ-USB buffer counters (since its power on), keep one more transfer in flight for new events
+	// (one less again after DEPTH_DECAY_SEC without them, see decay_transfer_depth())
+	void handle_buffer_stats(uint16_t underruns, uint16_t overruns, uint16_t dropped)
+	{
+		uint16_t new_underruns = underruns - m_underrun_count;
+		uint16_t new_overruns = overruns - m_overrun_count;
+		uint16_t new_dropped = dropped - m_dropped_count;
+
+		m_underrun_count = underruns;
+		m_overrun_count = overruns;
+		m_dropped_count = dropped;
+		Trace::counter("EZ-USB underruns", underruns);
+		Trace::counter("EZ-USB overruns", overruns);
+		if (m_is_buffer_stats_valid == false) {
+			// first report after start up, counts from previous runs
+			m_is_buffer_stats_valid = true;
+			return;
+		}
+		if (m_is_tape_streaming == false) {
+			// underrun after the last PLAY data, not a host delay
+			return;
+		}
+		m_underrun_total += new_underruns;
+		m_overrun_total += new_overruns;
+		m_dropped_total += new_dropped;
+		if (new_underruns != 0 || new_overruns != 0) {
+			int depth = m_transfer_depth.load();
+			if (depth < MAX_TRANSFER_DEPTH && m_transfer_depth.compare_exchange_strong(depth, depth + 1) == true) {
+				Trace::counter("transfer depth", depth + 1);
+			}
+			m_depth_change_tick = std::chrono::steady_clock::now().time_since_epoch().count();
+		}
+	}
+
+	void handle_notify(uint8_t notify)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_notify_lock);
+			m_notify_count[notify & NOTIFY_INDEX_MASK]++;
+		}
+		m_notify_cond.notify_all();
 	}
 
 	void send_sensor(void)
@@ -1269,9 +3628,7 @@ private:
 		uint8_t sensor;
 
 		sensor = get_sensor();
-//		char tmp[256];
-//		snprintf(tmp, sizeof(tmp), "Sensor: %d\n", sensor);
-//		::OutputDebugStringA(tmp);
+		Trace::instant("sensor", sensor);
 		send_response(PC_SENSOR_CHANGE, 0x80 | sensor);
 	}
 
@@ -1286,6 +3643,7 @@ private:
 		int actual_length = 0;
 		ULONGLONG prev_time = 0;
 
+		Trace::set_thread_name("command receive");
 		m_command_receive_transfer = libusb_alloc_transfer(0);
 
 		if (m_command_receive_transfer == NULL) {
@@ -1301,15 +3659,20 @@ private:
 
 			libusb_fill_bulk_transfer(m_command_receive_transfer, m_usb_handle, IN_COMMAND_EP, trans_data,
 				sizeof(trans_data), m_usb_callback, &user_data, 0);
-			int ret = libusb_submit_transfer(m_command_receive_transfer);
+			int ret = m_transport->submit_transfer(m_command_receive_transfer);
 			if (ret < 0) {
 				libusb_free_transfer(m_command_receive_transfer);
-				m_usb_error = true;
+				set_usb_error(ret);
 				return;
 			}
 
-			while (!user_data.completed && m_command_receive_run_flag == true) {
-				if (libusb_handle_events_completed(NULL, &user_data.completed) < 0) {
+			if (m_command_receive_run_flag == false) {
+				// power_off() may have missed this transfer
+				m_transport->cancel_transfer(m_command_receive_transfer);
+			}
+			// wait for completion (or cancellation) before the transfer is reused or freed
+			while (!user_data.completed) {
+				if (m_transport->handle_events_completed(&user_data.completed) < 0) {
 					if (user_data.completed == 2) {
 						m_usb_error = true;
 					}
@@ -1317,21 +3680,32 @@ private:
 					return;
 				}
 			}
+			// check if the board has gone
+			if (user_data.completed == 2) {
+				m_usb_error = true;
+				libusb_free_transfer(m_command_receive_transfer);
+				return;
+			}
 			// check if canceled
 			if (m_command_receive_run_flag == false) {
 				libusb_free_transfer(m_command_receive_transfer);
 				return;
 			}
-//			char tmp[512];
-//			snprintf(tmp, sizeof(tmp), "Command received: %x (%d)\n", trans_data[0], m_command_receive_transfer->actual_length);
-//			::OutputDebugStringA(tmp);
-
-			{
-				std::lock_guard<std::mutex> lock(m_command_lock);
+			Trace::instant("command received", trans_data[0]);
 
-				m_command_queue.push(trans_data[0]);
+			if (trans_data[0] == NOTIFY_BUFFER_STATS) {
+				if (m_command_receive_transfer->actual_length >= 7) {
+					handle_buffer_stats(trans_data[1] | (trans_data[2] << 8), trans_data[3] | (trans_data[4] << 8),
+						trans_data[5] | (trans_data[6] << 8));
+				}
+				continue;
+			}
+			if ((trans_data[0] & NOTIFY_MASK) == NOTIFY_MASK) {
+				handle_notify(trans_data[0]);
+				continue;
 			}
-			m_command_cond.notify_one();
+
+			enqueue_command(trans_data[0], command_entry_t::SOURCE_X1);
 		}
 		libusb_free_transfer(m_command_receive_transfer);
 	}
@@ -1344,84 +3718,87 @@ private:
 
 	void command_sender_thread(void)
 	{
+		Trace::set_thread_name("command sender");
 		while (m_command_sender_run_flag) {
+			command_entry_t entry;
 			{
-				uint8_t command;
 				std::unique_lock<std::mutex> a_lock(m_command_lock);
-				m_command_cond.wait(a_lock, [this] {return (m_command_queue.size() > 0 || m_command_sender_run_flag == false); });
-				// command lock is aquired here
-				while (m_command_queue.size() > 0) {
-					command = m_command_queue.front();
-					m_command_queue.pop();
-					a_lock.unlock();
+				m_command_cond.wait(a_lock, [this] {return (m_command_ring.is_empty() == false || m_command_sender_run_flag == false); });
+			}
+			// the only thread that changes the tape mode by commands
+			while (m_command_sender_run_flag && m_command_ring.pop(&entry) == true) {
+				bool is_respond_immediately;
 
-					bool is_respond_immediately;
-					is_respond_immediately = process_command(command);
+				if (is_host_command(entry) == true) {
+					process_host_command(entry);
+					continue;
+				}
+				is_respond_immediately = process_command(entry.command);
 
+				if (entry.command == COM_STOP || entry.command == COM_EJECT) {
+					update_stop_latency(entry);
+					end_tape_cancel();
+				}
+				if (entry.source == command_entry_t::SOURCE_X1) {
 					if (is_respond_immediately == true) {
-						send_response(PC_REQUEST, command);
+						send_response(PC_REQUEST, entry.command);
 					}
-					a_lock.lock();
+				}
+				else if (entry.command == COM_STOP) {
+					// STOP by the GUI, let X1 know
+					send_response(PC_REQUEST, COM_STOP);
 				}
 			}
 		}
 	}
 
 	void set_usb_sample_rate() {
-		uint32_t sample_rate_val;
-		tape_sample_rate_t real_usb_sample_rate;
-		int usb_sample_rate;
+		uint32_t usb_sample_rate;
 
-		sample_rate_val = get_tape_sample_rate();
-		if (sample_rate_val == 44100 || sample_rate_val == 22050) {
-			usb_sample_rate = 44100;
-			if (m_use_alt_44k == true) {
-				real_usb_sample_rate = TAPE_SAMPLE_44K_ALT;
-			}
-			else {
-				real_usb_sample_rate = TAPE_SAMPLE_44K;
-			}
+		// EZ-USB generates any rate exactly (on average), use the tape rate
+		// itself or its multiple (e.g. 22.05kHz -> 44.1kHz, 16kHz -> 32kHz)
+		usb_sample_rate = get_tape_sample_rate();
+		if (usb_sample_rate == 0 || usb_sample_rate > USB_SAMPLE_RATE_MAX) {
+			usb_sample_rate = USB_SAMPLE_RATE_MAX;
 		}
-		else if (sample_rate_val == 32000 || sample_rate_val == 16000) {
-			usb_sample_rate = 32000;
-			real_usb_sample_rate = TAPE_SAMPLE_32K;
-		}
-		else {
-			usb_sample_rate = 48000;
-			real_usb_sample_rate = TAPE_SAMPLE_48K;
+		while (usb_sample_rate < USB_SAMPLE_RATE_MIN) {
+			usb_sample_rate *= 2;
 		}
 
 		m_tape.set_usb_sample_rate(usb_sample_rate);
+		m_usb_sample_rate = usb_sample_rate;
 
-		send_response(PC_TAPE_SAMPLE_RATE_CHANGE, (uint8_t)real_usb_sample_rate);
+		send_response_word(PC_TAPE_SAMPLE_RATE_CHANGE, (uint16_t)usb_sample_rate);
 	}
 
 	static void __stdcall usb_callback(struct libusb_transfer* xfr) {
 		static int recv_count = 0;
 		usb_callback_user_data_t* user_data = (usb_callback_user_data_t*)xfr->user_data;
-//		char temp[256];
 
 		switch (xfr->status) {
 		case LIBUSB_TRANSFER_COMPLETED:
 			break;
 		case LIBUSB_TRANSFER_ERROR:
-			user_data->recorder->m_event_callback(EVENT_USB_ERROR);
+			Trace::instant("transfer error", xfr->endpoint);
+			user_data->recorder->m_event_callback(user_data->recorder, EVENT_USB_ERROR);
 			break;
 		case LIBUSB_TRANSFER_TIMED_OUT:
-//			snprintf(temp, sizeof(temp), "USB: transfer %d timed out\n", xfr->endpoint);
-//			::OutputDebugStringA(temp);
-			user_data->recorder->m_event_callback(EVENT_USB_ERROR);
+			Trace::instant("transfer timed out", xfr->endpoint);
+			user_data->recorder->m_event_callback(user_data->recorder, EVENT_USB_ERROR);
 			break;
 		case LIBUSB_TRANSFER_OVERFLOW:
-//			::OutputDebugStringA("USB: transfer overflow\n");
-			user_data->recorder->m_event_callback(EVENT_USB_ERROR);
+			Trace::instant("transfer overflow", xfr->endpoint);
+			user_data->recorder->m_event_callback(user_data->recorder, EVENT_USB_ERROR);
 			break;
 		case LIBUSB_TRANSFER_CANCELLED:
-//			::OutputDebugStringA("USB: transfer canceled.\n");
+			Trace::instant("transfer canceled", xfr->endpoint);
 			break;
 		case LIBUSB_TRANSFER_NO_DEVICE:
-//			::OutputDebugStringA("Disconnected\n");
-			user_data->recorder->m_event_callback(EVENT_USB_DISCONNECTED);
+			Trace::instant("transfer no device", xfr->endpoint);
+			if (user_data->recorder->m_is_disconnected == false) {
+				user_data->recorder->m_is_disconnected = true;
+				user_data->recorder->m_event_callback(user_data->recorder, EVENT_USB_DISCONNECTED);
+			}
 			user_data->completed = 2;
 			return;
 		default:
@@ -1432,35 +3809,98 @@ private:
 	}
 
 
-	static constexpr int READ_CHUNK_SIZE = 64;
+	static constexpr int READ_CHUNK_SIZE = PlaybackCache::CHUNK_SIZE;
+	static constexpr int INITIAL_TRANSFER_DEPTH = 2;
+	static constexpr int MAX_TRANSFER_DEPTH = 8;
+	static constexpr int DEPTH_DECAY_SEC = 10;
 	static constexpr int  USB_TIMEOUT_MS = 2000;
+	static constexpr int TAPE_STOP_TIMEOUT_MS = 1000;
+	static constexpr uint32_t USB_SAMPLE_RATE_MIN = 32000;
+	static constexpr uint32_t USB_SAMPLE_RATE_MAX = 48000;
+
+	static constexpr uint8_t NOTIFY_MASK = 0xf0;
+	static constexpr uint8_t NOTIFY_INDEX_MASK = 0x01;
 
 	static constexpr uint8_t OUT_RESPONSE_EP = 0x01;
 	static constexpr uint8_t IN_COMMAND_EP = 0x81;
 	static constexpr uint8_t IN_TAPE_EP = 0x86;
-	static constexpr uint8_t OUT_TAPE_EP = 0x04;
+	static constexpr uint8_t OUT_TAPE_EP = 0x02;
 
 	void(__stdcall* m_usb_callback)(struct libusb_transfer* xfr);
 	libusb_device_handle* m_usb_handle;
-	struct libusb_transfer* m_tape_transfer;
-	uint8_t m_sensor_state;
-	tape_mode_t m_tape_mode;
+	UsbTransport* m_transport;
+	tape_transfer_t m_tape_transfers[MAX_TRANSFER_DEPTH];
+	std::atomic<uint64_t> m_stream_allocation_count;  // tape thread in PLAY / REC
+	ThreadPriority::config_t m_thread_config;
+	bool m_is_realtime;
+	JitterHistogram m_tape_jitter;
+	std::chrono::steady_clock::time_point m_last_complete_time;
+	bool m_has_last_complete;
+	std::atomic<int> m_transfer_depth;          // grown by the command receive thread, decayed by the tape thread
+	std::atomic<int64_t> m_depth_change_tick;   // steady_clock
+	bool m_is_tape_streaming;
+	bool m_is_buffer_stats_valid;
+	uint16_t m_underrun_count;
+	uint16_t m_overrun_count;
+	uint16_t m_dropped_count;
+	uint32_t m_underrun_total;
+	uint32_t m_overrun_total;
+	uint32_t m_dropped_total;
+
+	std::chrono::steady_clock::time_point m_stats_start;
+	int64_t m_stats_bytes;
+	int m_stats_count;
+	double m_stats_latency_sum;
+	double m_stats_latency_max;
+	double m_throughput;
+	double m_latency_avg_ms;
+	double m_latency_max_ms;
+	std::atomic<uint8_t> m_sensor_state;       // TAPE_SET, TAPE_NOT_WRITE_PROTECT
+	std::atomic<tape_mode_t> m_tape_mode;      // changed by change_mode() only
 	TapFile m_tape;
-	bool m_tape_run_flag;
+	PlaybackCache m_play_cache;
+	std::atomic<bool> m_tape_run_flag;
+
+	// STOP / EJECT queued: tape operations end
+	std::atomic<int> m_pending_stop_count;
+	std::mutex m_cancel_lock;
+	std::condition_variable m_cancel_cond;
+	double m_stop_latency_sum_ms;
+	double m_stop_latency_max_ms;
+	uint32_t m_stop_count;
 	std::thread m_usb_thread;
 
-	bool m_command_receive_run_flag;
+	std::atomic<bool> m_command_receive_run_flag;
 	struct libusb_transfer* m_command_receive_transfer;
 	std::thread m_command_receive_thread;
 
-	void(*m_event_callback)(uint8_t);
+	void(*m_event_callback)(DataRecorder*, uint8_t);
 	bool m_is_send_event;
-	bool m_use_alt_44k;
+	bool m_use_pulse_play;
+	bool m_use_rec_capture;
+	int m_usb_sample_rate;
+	UsbRateEstimator m_rate_estimator;
 
-	std::mutex m_command_lock;
-	std::queue<uint8_t> m_command_queue;
+	std::mutex m_command_lock;            // only for the sender to sleep
+	CommandRing m_command_ring;
 	std::condition_variable m_command_cond;
-	bool m_command_sender_run_flag;
+	std::atomic<bool> m_command_sender_run_flag;
 	std::thread m_command_sender_thread;
-	bool m_usb_error;
+
+	std::mutex m_response_lock;           // only for the sender to sleep
+	ResponseRing m_response_ring;
+	std::condition_variable m_response_cond;
+	std::condition_variable m_response_space_cond; // for a producer waiting on a full ring
+	std::atomic<bool> m_response_sender_run_flag;
+	std::thread m_response_sender_thread;
+	struct libusb_transfer* m_response_transfer;
+	uint8_t m_response_buffer[3];
+	std::atomic<bool> m_usb_error;
+	std::atomic<bool> m_is_disconnected;
+	std::atomic<bool> m_is_reconnect_queued;      // reconnect() to the command sender
+
+	std::atomic<int> m_mechanical_delay_ms;
+	std::mutex m_notify_lock;
+	std::condition_variable m_notify_cond;
+	uint32_t m_notify_count[2];
 };
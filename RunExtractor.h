@@ -0,0 +1,91 @@
+#pragma once
+
+//
+//  Level runs of the tape signal, for PulseAnalyzer, PllDecoder and FastLoadScanner
+//  - bitstreams (1 bit per sample, MSB first) or edge capture records
+//    (1 byte per run  bit7: level, bit6:0: duration in ticks, long runs as several records)
+//  - whole bytes of the current level are added at once (most bytes of a tape)
+//  - a run is given to the handler when the level changes: handler(level, start, length),
+//    start and length in samples / ticks since reset()
+//  - levels are as X1 outputs (high = 1), USB data and capture records are inverted
+//
+
+#include <stdint.h>
+#include <stddef.h>
+
+class RunExtractor {
+public:
+	RunExtractor(void) {
+		reset();
+	}
+
+	void reset(void) {
+		m_level = -1;
+		m_run_start = 0;
+		m_pos = 0;
+	}
+
+	//  is_inverted: true for the USB data (EZ-USB input is inverted), false for a tape image
+	template <typename RunHandler>
+	void add_bits(const uint8_t* data, size_t length, bool is_inverted, RunHandler&& handler) {
+		uint8_t invert = is_inverted ? 0xff : 0x00;
+
+		for (size_t index = 0; index < length; index++) {
+			uint8_t byte = data[index] ^ invert;
+			if ((byte == 0xff && m_level == 1) || (byte == 0x00 && m_level == 0)) {
+				m_pos += 8;
+				continue;
+			}
+			for (int bit = 7; bit >= 0; bit--) {
+				add_span((byte >> bit) & 1, 1, handler);
+			}
+		}
+	}
+
+	template <typename RunHandler>
+	void add_capture_data(const uint8_t* data, size_t length, RunHandler&& handler) {
+		for (size_t index = 0; index < length; index++) {
+			add_span((data[index] & 0x80) ? 0 : 1, data[index] & 0x7f, handler);
+		}
+	}
+
+	// end of the data: the last run to the handler
+	template <typename RunHandler>
+	void finish(RunHandler&& handler) {
+		if (m_level >= 0) {
+			handler(m_level, m_run_start, m_pos - m_run_start);
+		}
+		m_level = -1;
+		m_run_start = m_pos;
+	}
+
+	// the run not finished yet, level -1 before the first sample
+	int get_level(void) {
+		return m_level;
+	}
+
+	uint64_t get_run_length(void) {
+		return m_pos - m_run_start;
+	}
+
+	uint64_t get_pos(void) {
+		return m_pos;
+	}
+
+private:
+	template <typename RunHandler>
+	void add_span(int level, uint64_t length, RunHandler& handler) {
+		if (level != m_level) {
+			if (m_level >= 0) {
+				handler(m_level, m_run_start, m_pos - m_run_start);
+			}
+			m_level = level;
+			m_run_start = m_pos;
+		}
+		m_pos += length;
+	}
+
+	int m_level;
+	uint64_t m_run_start;
+	uint64_t m_pos;
+};
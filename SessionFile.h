@@ -0,0 +1,130 @@
+#pragma once
+
+//
+//  Session file (INI style, UTF-8): settings and the tape of each board, restored at the next start
+//    [section]
+//    key=value
+//  - sections and keys are kept in the order read / set, so sections of boards not connected
+//    this time are written back as they were
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+class SessionFile {
+public:
+	// false if there is no file (all keys give the default value)
+	bool load(const wchar_t* file_path) {
+		FILE* fp;
+		char line[1024];
+		std::string section;
+
+		m_entries.clear();
+		if (_wfopen_s(&fp, file_path, L"rt") != 0 || fp == NULL) {
+			return false;
+		}
+		while (fgets(line, sizeof(line), fp) != NULL) {
+			std::string text = trim(line);
+			if (text.empty() == true || text[0] == ';') {
+				continue;
+			}
+			if (text.front() == '[' && text.back() == ']') {
+				section = text.substr(1, text.size() - 2);
+				continue;
+			}
+			size_t separator = text.find('=');
+			if (separator != std::string::npos) {
+				set(section.c_str(), trim(text.substr(0, separator)).c_str(), trim(text.substr(separator + 1)).c_str());
+			}
+		}
+		fclose(fp);
+		return true;
+	}
+
+	bool save(const wchar_t* file_path) {
+		FILE* fp;
+		std::vector<std::string> sections;
+
+		if (_wfopen_s(&fp, file_path, L"wt") != 0 || fp == NULL) {
+			return false;
+		}
+		for (auto& entry : m_entries) {
+			if (std::find(sections.begin(), sections.end(), entry.section) == sections.end()) {
+				sections.push_back(entry.section);
+			}
+		}
+		for (auto& section : sections) {
+			fprintf(fp, "[%s]\n", section.c_str());
+			for (auto& entry : m_entries) {
+				if (entry.section == section) {
+					fprintf(fp, "%s=%s\n", entry.key.c_str(), entry.value.c_str());
+				}
+			}
+			fprintf(fp, "\n");
+		}
+		return (fclose(fp) == 0);
+	}
+
+	const char* get(const char* section, const char* key, const char* default_value = "") {
+		entry_t* entry = find(section, key);
+		return (entry != nullptr) ? entry->value.c_str() : default_value;
+	}
+
+	int64_t get_int(const char* section, const char* key, int64_t default_value = 0) {
+		entry_t* entry = find(section, key);
+		return (entry != nullptr && entry->value.empty() == false) ? _strtoi64(entry->value.c_str(), NULL, 10) : default_value;
+	}
+
+	bool get_bool(const char* section, const char* key, bool default_value) {
+		return get_int(section, key, (default_value == true) ? 1 : 0) != 0;
+	}
+
+	void set(const char* section, const char* key, const char* value) {
+		entry_t* entry = find(section, key);
+		if (entry != nullptr) {
+			entry->value = value;
+			return;
+		}
+		m_entries.push_back({ section, key, value });
+	}
+
+	void set_int(const char* section, const char* key, int64_t value) {
+		set(section, key, std::to_string(value).c_str());
+	}
+
+	void set_bool(const char* section, const char* key, bool value) {
+		set_int(section, key, (value == true) ? 1 : 0);
+	}
+
+private:
+	struct entry_t {
+		std::string section;
+		std::string key;
+		std::string value;
+	};
+
+	entry_t* find(const char* section, const char* key) {
+		for (auto& entry : m_entries) {
+			if (entry.section == section && entry.key == key) {
+				return &entry;
+			}
+		}
+		return nullptr;
+	}
+
+	static std::string trim(const std::string& text) {
+		size_t start = text.find_first_not_of(" \t\r\n");
+		if (start == std::string::npos) {
+			return std::string();
+		}
+		size_t end = text.find_last_not_of(" \t\r\n");
+		return text.substr(start, end - start + 1);
+	}
+
+	std::vector<entry_t> m_entries;
+};
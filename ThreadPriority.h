@@ -0,0 +1,149 @@
+#pragma once
+
+//
+//  Scheduling of the tape threads (USB tape transfers, REC writer)
+//  - real-time: MMCSS "Pro Audio" task on Windows, SCHED_FIFO on Linux (needs rtprio / CAP_SYS_NICE),
+//    so a busy desktop does not delay the PLAY data and EZ-USB does not underrun
+//  - CPU pinning: keeps the thread on one CPU (and its cache)
+//  - JitterHistogram: how late a thread wakes up, for the diagnostics view
+//
+
+#include <stdint.h>
+#include <atomic>
+#ifdef _WIN32
+#include <Windows.h>
+#include <avrt.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+class ThreadPriority {
+public:
+	struct config_t {
+		bool is_realtime;
+		int cpu;           // pin to this CPU, -1: any
+	};
+
+	// for the calling thread, until destroyed
+	ThreadPriority(const config_t& config) {
+		m_is_realtime = false;
+		m_is_pinned = false;
+#ifdef _WIN32
+		m_mmcss = NULL;
+		if (config.is_realtime == true) {
+			DWORD task_index = 0;
+			m_mmcss = AvSetMmThreadCharacteristicsW(L"Pro Audio", &task_index);
+			if (m_mmcss != NULL) {
+				AvSetMmThreadPriority(m_mmcss, AVRT_PRIORITY_HIGH);
+				m_is_realtime = true;
+			}
+			else {
+				// MMCSS service stopped
+				m_is_realtime = (SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) != 0);
+			}
+		}
+		if (config.cpu >= 0 && config.cpu < (int)(sizeof(DWORD_PTR) * 8)) {
+			m_is_pinned = (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << config.cpu) != 0);
+		}
+#else
+		if (config.is_realtime == true) {
+			sched_param param;
+			param.sched_priority = sched_get_priority_min(SCHED_FIFO) + REALTIME_PRIORITY;
+			m_is_realtime = (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0);
+		}
+		if (config.cpu >= 0 && config.cpu < CPU_SETSIZE) {
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(config.cpu, &cpus);
+			m_is_pinned = (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0);
+		}
+#endif
+	}
+
+	~ThreadPriority() {
+#ifdef _WIN32
+		if (m_mmcss != NULL) {
+			AvRevertMmThreadCharacteristics(m_mmcss);
+		}
+#endif
+	}
+
+	// false if not permitted (or not asked)
+	bool is_realtime(void) {
+		return m_is_realtime;
+	}
+
+	bool is_pinned(void) {
+		return m_is_pinned;
+	}
+
+private:
+	static constexpr int REALTIME_PRIORITY = 30;   // SCHED_FIFO 1 - 99, above typical audio threads
+
+	bool m_is_realtime;
+	bool m_is_pinned;
+#ifdef _WIN32
+	HANDLE m_mmcss;
+#endif
+};
+
+// Wake-up delays of one thread, log2 bins (bin n: 2^n - 2^(n+1) usec, bin 0 from 0).
+// Written by that thread only, read by the UI at any time without a lock.
+class JitterHistogram {
+public:
+	static constexpr int HISTOGRAM_BINS = 17;   // the last bin: 65msec and longer
+
+	struct stats_t {
+		uint32_t histogram[HISTOGRAM_BINS];
+		uint64_t count;
+		double mean_usec;
+		double max_usec;
+	};
+
+	JitterHistogram(void) {
+		reset();
+	}
+
+	void reset(void) {
+		for (auto& bin : m_histogram) {
+			bin.store(0, std::memory_order_relaxed);
+		}
+		m_count.store(0, std::memory_order_relaxed);
+		m_sum_usec.store(0, std::memory_order_relaxed);
+		m_max_usec.store(0, std::memory_order_relaxed);
+	}
+
+	void add(double delay_usec) {
+		uint64_t usec = (delay_usec > 0) ? (uint64_t)delay_usec : 0;
+		int bin = 0;
+		while (bin < HISTOGRAM_BINS - 1 && (usec >> (bin + 1)) != 0) {
+			bin++;
+		}
+		m_histogram[bin].store(m_histogram[bin].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		m_sum_usec.store(m_sum_usec.load(std::memory_order_relaxed) + usec, std::memory_order_relaxed);
+		if (usec > m_max_usec.load(std::memory_order_relaxed)) {
+			m_max_usec.store(usec, std::memory_order_relaxed);
+		}
+		m_count.store(m_count.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// the bins may be one sample off the count while the thread is running
+	stats_t get_stats(void) {
+		stats_t stats;
+
+		stats.count = m_count.load(std::memory_order_acquire);
+		for (int bin = 0; bin < HISTOGRAM_BINS; bin++) {
+			stats.histogram[bin] = m_histogram[bin].load(std::memory_order_relaxed);
+		}
+		stats.mean_usec = (stats.count > 0) ? (double)m_sum_usec.load(std::memory_order_relaxed) / stats.count : 0;
+		stats.max_usec = (double)m_max_usec.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+private:
+	std::atomic<uint32_t> m_histogram[HISTOGRAM_BINS];
+	std::atomic<uint64_t> m_count;
+	std::atomic<uint64_t> m_sum_usec;
+	std::atomic<uint64_t> m_max_usec;
+};
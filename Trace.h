@@ -0,0 +1,230 @@
+#pragma once
+
+//
+//  Event trace
+//  - each thread records into its own ring (no lock, a few 10ns per event),
+//    so the trace can be left on while the tape is running
+//  - write_chrome_json() dumps the rings in Chrome trace format
+//    (chrome://tracing, https://ui.perfetto.dev)
+//
+//  Event names must be string literals (only the pointer is recorded).
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <chrono>
+#include <new>
+
+class Trace {
+public:
+	// duration events ('B' / 'E') must nest on each thread
+	static void begin(const char* name, int32_t arg = 0) {
+		record(name, 'B', arg);
+	}
+
+	static void end(const char* name) {
+		record(name, 'E', 0);
+	}
+
+	static void instant(const char* name, int32_t arg = 0) {
+		record(name, 'i', arg);
+	}
+
+	// value over time, drawn as a graph
+	static void counter(const char* name, int32_t value) {
+		record(name, 'C', value);
+	}
+
+	// overlapping operations on any thread (e.g. USB transfers), matched by id
+	static void async_begin(const char* name, int32_t id) {
+		record(name, 'b', id);
+	}
+
+	static void async_end(const char* name, int32_t id) {
+		record(name, 'e', id);
+	}
+
+	// name shown for the calling thread
+	static void set_thread_name(const char* name) {
+		ring_t* ring = get_ring();
+		if (ring != nullptr) {
+			ring->thread_name = name;
+		}
+	}
+
+	static void set_enabled(bool is_enabled) {
+		m_is_enabled = is_enabled;
+	}
+
+	static bool is_enabled(void) {
+		return m_is_enabled;
+	}
+
+	// the last RING_SIZE events of every thread, false if the file could not be written
+	static bool write_chrome_json(const wchar_t* file_path) {
+		std::vector<ring_t*> rings;
+		std::vector<event_t> events;
+		FILE* fp;
+
+		if (_wfopen_s(&fp, file_path, L"w") != 0 || fp == NULL) {
+			return false;
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_rings_lock);
+			rings = m_rings;
+		}
+
+		fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"em8RL1\"}}");
+		for (ring_t* ring : rings) {
+			fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				ring->tid, (ring->thread_name != nullptr) ? ring->thread_name : "thread");
+
+			copy_events(ring, events);
+			for (auto& event : events) {
+				double ts = std::chrono::duration<double, std::micro>(trace_clock_t::duration(event.time - m_start_time)).count();
+
+				fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d",
+					event.name, event.phase, ts, ring->tid);
+				switch (event.phase) {
+				case 'b':
+				case 'e':
+					fprintf(fp, ",\"cat\":\"usb\",\"id\":%d}", event.arg);
+					break;
+				case 'C':
+					fprintf(fp, ",\"args\":{\"value\":%d}}", event.arg);
+					break;
+				case 'i':
+					fprintf(fp, ",\"s\":\"t\",\"args\":{\"value\":%d}}", event.arg);
+					break;
+				case 'B':
+					fprintf(fp, ",\"args\":{\"value\":%d}}", event.arg);
+					break;
+				default:
+					fprintf(fp, "}");
+					break;
+				}
+			}
+		}
+		fprintf(fp, "\n]}\n");
+		return (fclose(fp) == 0);
+	}
+
+	static constexpr uint32_t RING_SIZE = 8192;    // events per thread (power of 2)
+
+private:
+	typedef std::chrono::steady_clock trace_clock_t;
+
+	struct event_t {
+		int64_t time;      // trace_clock_t ticks
+		const char* name;
+		int32_t arg;
+		char phase;
+	};
+
+	// written by its thread only, read by write_chrome_json()
+	struct ring_t {
+		event_t events[RING_SIZE];
+		std::atomic<uint32_t> head;
+		int tid;
+		const char* thread_name;
+		bool is_used;
+	};
+
+	// gives the ring back when its thread ends (response threads come and go)
+	struct ring_owner_t {
+		ring_t* ring = nullptr;
+
+		~ring_owner_t(void) {
+			if (ring != nullptr) {
+				std::lock_guard<std::mutex> lock(m_rings_lock);
+				ring->is_used = false;
+			}
+		}
+	};
+
+	static void record(const char* name, char phase, int32_t arg) {
+		if (m_is_enabled == false) {
+			return;
+		}
+		ring_t* ring = get_ring();
+		if (ring == nullptr) {
+			return;
+		}
+		uint32_t head = ring->head.load(std::memory_order_relaxed);
+		event_t& event = ring->events[head & (RING_SIZE - 1)];
+		event.time = trace_clock_t::now().time_since_epoch().count();
+		event.name = name;
+		event.arg = arg;
+		event.phase = phase;
+		ring->head.store(head + 1, std::memory_order_release);
+	}
+
+	static ring_t* get_ring(void) {
+		thread_local ring_owner_t owner;
+
+		if (owner.ring == nullptr) {
+			// first event of this thread: reuse a ring of an ended thread, or add one
+			std::lock_guard<std::mutex> lock(m_rings_lock);
+			for (ring_t* ring : m_rings) {
+				if (ring->is_used == false) {
+					owner.ring = ring;
+					break;
+				}
+			}
+			if (owner.ring == nullptr) {
+				owner.ring = new (std::nothrow) ring_t();
+				if (owner.ring == nullptr) {
+					return nullptr;
+				}
+				owner.ring->head = 0;
+				owner.ring->tid = (int)m_rings.size() + 1;
+				m_rings.push_back(owner.ring);
+			}
+			owner.ring->thread_name = nullptr;
+			owner.ring->is_used = true;
+		}
+		return owner.ring;
+	}
+
+	// snapshot of a ring while its thread may still be recording
+	static void copy_events(ring_t* ring, std::vector<event_t>& events) {
+		uint32_t head = ring->head.load(std::memory_order_acquire);
+		uint32_t first = (head > RING_SIZE) ? head - RING_SIZE : 0;
+
+		events.clear();
+		for (uint32_t index = first; index < head; index++) {
+			events.push_back(ring->events[index & (RING_SIZE - 1)]);
+		}
+		// drop the events overwritten during the copy
+		uint32_t new_head = ring->head.load(std::memory_order_acquire);
+		if (new_head - first > RING_SIZE) {
+			uint32_t overwritten = new_head - first - RING_SIZE;
+			events.erase(events.begin(), events.begin() + ((overwritten < events.size()) ? overwritten : events.size()));
+		}
+	}
+
+	static inline std::atomic<bool> m_is_enabled{ true };
+	static inline std::mutex m_rings_lock;
+	static inline std::vector<ring_t*> m_rings;
+	static inline const int64_t m_start_time = trace_clock_t::now().time_since_epoch().count();
+};
+
+// begin / end of a scope
+class TraceScope {
+public:
+	TraceScope(const char* name, int32_t arg = 0) {
+		m_name = name;
+		Trace::begin(name, arg);
+	}
+
+	~TraceScope(void) {
+		Trace::end(m_name);
+	}
+
+private:
+	const char* m_name;
+};
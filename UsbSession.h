@@ -0,0 +1,721 @@
+#pragma once
+
+//
+//  USB session capture and replay
+//  - CaptureTransport: records every transfer of a recorder board into a session file
+//  - ReplayTransport: plays a session file back to DataRecorder, without the board
+//
+//  Session file (little endian)
+//    header: "E8RS", version (16bit), header size (16bit), reserved (32bit x2)
+//    record: time since the previous record in usec (32bit), type (8bit),
+//            endpoint or host event code (8bit), libusb_transfer_status (8bit),
+//            reserved (8bit), payload length (16bit), reserved (16bit), payload
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <libusb.h>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include "UsbTransport.h"
+
+class UsbSession {
+public:
+	enum record_type_t {
+		RECORD_OUT_SUBMIT = 0,  // PC -> EZ-USB data, when submitted
+		RECORD_OUT_DONE = 1,    // its completion status (no payload)
+		RECORD_IN_DONE = 2,     // EZ-USB -> PC data, when completed
+		RECORD_HOST = 3,        // UsbTransport::host_event_t + its data
+	};
+
+	struct header_t {
+		char magic[4];
+		uint16_t version;
+		uint16_t header_size;
+		uint32_t reserved[2];
+	};
+
+	struct record_header_t {
+		uint32_t delta_usec;
+		uint8_t type;
+		uint8_t endpoint;
+		uint8_t status;
+		uint8_t reserved;
+		uint16_t length;
+		uint16_t reserved2;
+	};
+
+	static constexpr char MAGIC[4] = { 'E', '8', 'R', 'S' };
+	static constexpr uint16_t VERSION = 1;
+
+	// endpoints and messages of em8rl1 firmware, used to follow the session
+	static constexpr uint8_t RESPONSE_EP = 0x01;
+	static constexpr uint8_t OUT_TAPE_EP = 0x02;
+	static constexpr uint8_t COMMAND_EP = 0x81;
+	static constexpr uint8_t PC_REQUEST = 2;
+	static constexpr uint8_t NOTIFY_MASK = 0xf0;
+};
+
+
+//
+//
+//
+
+// Passes transfers on to the board's transport, and writes them to a session file.
+// Owns the wrapped transport.
+class CaptureTransport : public UsbTransport {
+public:
+	CaptureTransport(UsbTransport* transport) {
+		m_transport = transport;
+		m_fp = NULL;
+	}
+
+	~CaptureTransport(void) {
+		close();
+		for (auto pending : m_free_pending) {
+			delete pending;
+		}
+		delete m_transport;
+	}
+
+	bool open(const wchar_t* file_path) {
+		UsbSession::header_t header;
+
+		if (_wfopen_s(&m_fp, file_path, L"wb") != 0 || m_fp == NULL) {
+			m_fp = NULL;
+			return false;
+		}
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, UsbSession::MAGIC, sizeof(header.magic));
+		header.version = UsbSession::VERSION;
+		header.header_size = sizeof(header);
+		fwrite(&header, sizeof(header), 1, m_fp);
+		m_prev_time = capture_clock_t::now();
+		return true;
+	}
+
+	void close(void) {
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (m_fp != NULL) {
+			fclose(m_fp);
+			m_fp = NULL;
+		}
+	}
+
+	UsbTransport* get_transport(void) {
+		return m_transport;
+	}
+
+	const char* get_name(void) {
+		return m_transport->get_name();
+	}
+
+	libusb_device_handle* get_handle(void) {
+		return m_transport->get_handle();
+	}
+
+	bool is_simulated(void) {
+		return m_transport->is_simulated();
+	}
+
+	void reopen(libusb_device_handle* handle) {
+		m_transport->reopen(handle);
+	}
+
+	int submit_transfer(struct libusb_transfer* transfer) {
+		capture_pending_t* pending;
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			if (m_free_pending.empty() == false) {
+				pending = m_free_pending.back();
+				m_free_pending.pop_back();
+			}
+			else {
+				pending = new capture_pending_t;
+			}
+		}
+		if (!(transfer->endpoint & 0x80)) {
+			write_record(UsbSession::RECORD_OUT_SUBMIT, transfer->endpoint, LIBUSB_TRANSFER_COMPLETED,
+				transfer->buffer, transfer->length);
+		}
+
+		// see the completion first
+		pending->capture = this;
+		pending->callback = transfer->callback;
+		pending->user_data = transfer->user_data;
+		transfer->callback = capture_callback;
+		transfer->user_data = pending;
+
+		int ret = m_transport->submit_transfer(transfer);
+		if (ret < 0) {
+			restore_transfer(transfer);
+		}
+		return ret;
+	}
+
+	int cancel_transfer(struct libusb_transfer* transfer) {
+		return m_transport->cancel_transfer(transfer);
+	}
+
+	int handle_events_completed(int* completed) {
+		return m_transport->handle_events_completed(completed);
+	}
+
+	void note_host_event(host_event_t code, const void* data, int length) {
+		write_record(UsbSession::RECORD_HOST, (uint8_t)code, LIBUSB_TRANSFER_COMPLETED, (const uint8_t*)data, length);
+	}
+
+private:
+	typedef std::chrono::steady_clock capture_clock_t;
+
+	struct capture_pending_t {
+		CaptureTransport* capture;
+		libusb_transfer_cb_fn callback;
+		void* user_data;
+	};
+
+	static void LIBUSB_CALL capture_callback(struct libusb_transfer* transfer) {
+		capture_pending_t* pending = (capture_pending_t*)transfer->user_data;
+		CaptureTransport* capture = pending->capture;
+
+		capture->restore_transfer(transfer);
+		if (transfer->endpoint & 0x80) {
+			capture->write_record(UsbSession::RECORD_IN_DONE, transfer->endpoint, transfer->status,
+				transfer->buffer, transfer->actual_length);
+		}
+		else {
+			capture->write_record(UsbSession::RECORD_OUT_DONE, transfer->endpoint, transfer->status, nullptr, 0);
+		}
+		transfer->callback(transfer);
+	}
+
+	void restore_transfer(struct libusb_transfer* transfer) {
+		capture_pending_t* pending = (capture_pending_t*)transfer->user_data;
+
+		transfer->callback = pending->callback;
+		transfer->user_data = pending->user_data;
+
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_free_pending.push_back(pending);
+	}
+
+	void write_record(UsbSession::record_type_t type, uint8_t endpoint, int status, const uint8_t* data, int length) {
+		UsbSession::record_header_t record;
+		std::lock_guard<std::mutex> lock(m_lock);
+
+		if (m_fp == NULL) {
+			return;
+		}
+		capture_clock_t::time_point now = capture_clock_t::now();
+		record.delta_usec = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(now - m_prev_time).count();
+		record.type = type;
+		record.endpoint = endpoint;
+		record.status = (uint8_t)status;
+		record.reserved = 0;
+		record.reserved2 = 0;
+		record.length = (uint16_t)((length > 0) ? length : 0);
+		fwrite(&record, sizeof(record), 1, m_fp);
+		if (record.length > 0) {
+			fwrite(data, 1, record.length, m_fp);
+		}
+		m_prev_time = now;
+	}
+
+	UsbTransport* m_transport;
+	FILE* m_fp;
+	capture_clock_t::time_point m_prev_time;
+	std::mutex m_lock;
+	std::vector<capture_pending_t*> m_free_pending;
+};
+
+
+//
+//
+//
+
+// Plays a captured session back as the board:
+//  - IN data (X1 commands, notifications, REC data) are given in the captured order,
+//    each one after DataRecorder has sent as much as it had at that point in the session
+//  - host events are handed to the caller (wait_host_event()) in the same order
+//  - OUT transfers are compared with the captured ones, and complete at once
+//    (tape data only as far as the board had taken it at that point)
+//  speed: 0 as fast as possible, otherwise limits the replay to N times the captured pace
+class ReplayTransport : public UsbTransport {
+public:
+	ReplayTransport(void) {
+		m_speed = 0;
+		m_next = 0;
+		m_is_finished = false;
+		m_is_diverged = false;
+		for (int index = 0; index < NUM_OUT_EP; index++) {
+			m_out_bytes[index] = 0;
+			m_out_mismatch[index] = 0;
+		}
+	}
+
+	bool load(const wchar_t* file_path, double speed) {
+		UsbSession::header_t header;
+		FILE* fp;
+		uint64_t time_usec = 0;
+		uint64_t out_bytes[NUM_OUT_EP] = { 0 };
+
+		if (_wfopen_s(&fp, file_path, L"rb") != 0 || fp == NULL) {
+			return false;
+		}
+		if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, UsbSession::MAGIC, sizeof(header.magic)) != 0
+			|| header.version != UsbSession::VERSION) {
+			fclose(fp);
+			return false;
+		}
+		fseek(fp, header.header_size, SEEK_SET);
+
+		while (1) {
+			UsbSession::record_header_t record_header;
+			record_t record;
+
+			if (fread(&record_header, sizeof(record_header), 1, fp) != 1) {
+				break;
+			}
+			record.data.resize(record_header.length);
+			if (record_header.length > 0 && fread(record.data.data(), 1, record_header.length, fp) != record_header.length) {
+				break;
+			}
+			time_usec += record_header.delta_usec;
+			record.time_usec = time_usec;
+			record.type = record_header.type;
+			record.endpoint = record_header.endpoint;
+			record.status = record_header.status;
+			record.is_consumed = false;
+			for (int index = 0; index < NUM_OUT_EP; index++) {
+				record.out_bytes[index] = out_bytes[index];
+			}
+
+			if (record.type == UsbSession::RECORD_OUT_SUBMIT && (record.endpoint & 0x0f) < NUM_OUT_EP) {
+				std::vector<uint8_t>& stream = m_captured_out[record.endpoint & 0x0f];
+				stream.insert(stream.end(), record.data.begin(), record.data.end());
+				out_bytes[record.endpoint & 0x0f] += record.data.size();
+				if (record.endpoint == UsbSession::RESPONSE_EP) {
+					m_captured_latency.response(record.data.data(), (int)record.data.size(), record.time_usec);
+				}
+			}
+			else if (record.type == UsbSession::RECORD_IN_DONE && record.endpoint == UsbSession::COMMAND_EP
+				&& record.data.empty() == false) {
+				m_captured_latency.command(record.data[0], record.time_usec);
+			}
+			m_records.push_back(record);
+		}
+		fclose(fp);
+
+		m_speed = speed;
+		m_duration_usec = time_usec;
+		m_start_time = replay_clock_t::now();
+		m_progress_time = m_start_time;
+		skip_to_input();
+		return true;
+	}
+
+	const char* get_name(void) {
+		return "Replay";
+	}
+
+	libusb_device_handle* get_handle(void) {
+		return nullptr;
+	}
+
+	bool is_simulated(void) {
+		return true;
+	}
+
+	int submit_transfer(struct libusb_transfer* transfer) {
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			pending_t pending;
+
+			pending.transfer = transfer;
+			pending.status = LIBUSB_TRANSFER_COMPLETED;
+			pending.is_done = false;
+			pending.out_offset = 0;
+			if (!(transfer->endpoint & 0x80)) {
+				pending.out_offset = m_out_bytes[transfer->endpoint & 0x0f];
+				compare_out(transfer->endpoint, transfer->buffer, transfer->length);
+				transfer->actual_length = transfer->length;
+				pending.is_done = (transfer->endpoint == UsbSession::RESPONSE_EP);
+			}
+			m_pending.push_back(pending);
+		}
+		m_cond.notify_all();
+		return 0;
+	}
+
+	int cancel_transfer(struct libusb_transfer* transfer) {
+		std::lock_guard<std::mutex> lock(m_lock);
+		for (auto& pending : m_pending) {
+			if (pending.transfer == transfer && pending.is_done == false) {
+				// the captured transfer may have been canceled with data in it
+				transfer->actual_length = 0;
+				for (size_t index = m_next; index < m_records.size(); index++) {
+					record_t& record = m_records[index];
+					if (record.is_consumed == false && record.type == UsbSession::RECORD_IN_DONE
+						&& record.endpoint == transfer->endpoint) {
+						if (record.status == LIBUSB_TRANSFER_CANCELLED) {
+							transfer->actual_length = copy_in_data(transfer, record);
+							record.is_consumed = true;
+						}
+						break;
+					}
+				}
+				pending.status = LIBUSB_TRANSFER_CANCELLED;
+				pending.is_done = true;
+				m_cond.notify_all();
+				return 0;
+			}
+		}
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	int handle_events_completed(int* completed) {
+		std::unique_lock<std::mutex> lock(m_lock);
+
+		while (!*completed) {
+			pending_t done[MAX_DONE];  // not a vector: no allocations while streaming
+			int done_count = 0;
+
+			deliver_in_data();
+			complete_out_data();
+			for (auto it = m_pending.begin(); it != m_pending.end() && done_count < MAX_DONE;) {
+				if (it->is_done == true) {
+					done[done_count++] = *it;
+					it = m_pending.erase(it);
+				}
+				else {
+					++it;
+				}
+			}
+			if (done_count > 0) {
+				// callbacks run without the lock, like libusb
+				lock.unlock();
+				for (int index = 0; index < done_count; index++) {
+					done[index].transfer->status = done[index].status;
+					done[index].transfer->callback(done[index].transfer);
+				}
+				lock.lock();
+				m_cond.notify_all();
+				continue;
+			}
+			m_cond.wait_until(lock, next_wakeup());
+		}
+		return 0;
+	}
+
+	// next host event in the session (to be applied, then host_event_done()), false at the end
+	bool wait_host_event(host_event_t* code, std::vector<uint8_t>* data) {
+		std::unique_lock<std::mutex> lock(m_lock);
+
+		while (1) {
+			check_divergence();
+			if (m_is_finished == true) {
+				return false;
+			}
+			record_t& record = m_records[m_next];
+			if (record.type == UsbSession::RECORD_HOST && is_ready(record) == true) {
+				*code = (host_event_t)record.endpoint;
+				*data = record.data;
+				return true;
+			}
+			m_cond.wait_until(lock, next_wakeup());
+		}
+	}
+
+	void host_event_done(void) {
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			advance();
+		}
+		m_cond.notify_all();
+	}
+
+	bool is_diverged(void) {
+		return m_is_diverged;
+	}
+
+	// inputs given / all inputs in the session
+	size_t get_replayed_count(void) {
+		return m_replayed_count;
+	}
+
+	size_t get_input_count(void) {
+		size_t count = 0;
+		for (auto& record : m_records) {
+			count += (is_input(record) == true);
+		}
+		return count;
+	}
+
+	double get_captured_seconds(void) {
+		return m_duration_usec / 1000000.0;
+	}
+
+	double get_replay_seconds(void) {
+		return std::chrono::duration<double>(m_end_time - m_start_time).count();
+	}
+
+	// OUT data on an endpoint: captured / replayed bytes, and replayed tape data differing from the capture
+	uint64_t get_captured_out_bytes(uint8_t endpoint) {
+		return m_captured_out[endpoint & 0x0f].size();
+	}
+
+	uint64_t get_replayed_out_bytes(uint8_t endpoint) {
+		return m_out_bytes[endpoint & 0x0f];
+	}
+
+	uint64_t get_out_mismatch(uint8_t endpoint) {
+		return m_out_mismatch[endpoint & 0x0f];
+	}
+
+	// X1 command to its PC_REQUEST response (msec)
+	double get_captured_latency_avg_ms(void) {
+		return m_captured_latency.get_avg_ms();
+	}
+
+	double get_captured_latency_max_ms(void) {
+		return m_captured_latency.get_max_ms();
+	}
+
+	double get_replayed_latency_avg_ms(void) {
+		return m_replayed_latency.get_avg_ms();
+	}
+
+	double get_replayed_latency_max_ms(void) {
+		return m_replayed_latency.get_max_ms();
+	}
+
+private:
+	typedef std::chrono::steady_clock replay_clock_t;
+
+	static constexpr int NUM_OUT_EP = 3;    // RESPONSE_EP, OUT_TAPE_EP
+	static constexpr int DIVERGE_TIMEOUT_MS = 5000;
+	static constexpr int MAX_DONE = 16;        // completions handled at once
+
+	struct record_t {
+		uint64_t time_usec;
+		uint8_t type;
+		uint8_t endpoint;
+		uint8_t status;
+		bool is_consumed;
+		uint64_t out_bytes[NUM_OUT_EP];  // captured OUT data before this record
+		std::vector<uint8_t> data;
+	};
+
+	struct pending_t {
+		struct libusb_transfer* transfer;
+		enum libusb_transfer_status status;
+		bool is_done;
+		uint64_t out_offset;    // OUT data sent before this transfer
+	};
+
+	// X1 command to PC_REQUEST response, in usec
+	class latency_meter_t {
+	public:
+		void command(uint8_t command, uint64_t time_usec) {
+			if ((command & UsbSession::NOTIFY_MASK) != UsbSession::NOTIFY_MASK) {
+				m_commands.push_back(std::make_pair(command, time_usec));
+			}
+		}
+
+		void response(const uint8_t* data, int length, uint64_t time_usec) {
+			if (length < 2 || data[0] != UsbSession::PC_REQUEST) {
+				return;
+			}
+			for (auto it = m_commands.begin(); it != m_commands.end(); ++it) {
+				if (it->first == data[1]) {
+					uint64_t latency = time_usec - it->second;
+					m_sum += latency;
+					m_count++;
+					if (latency > m_max) {
+						m_max = latency;
+					}
+					m_commands.erase(it);
+					return;
+				}
+			}
+		}
+
+		double get_avg_ms(void) {
+			return (m_count > 0) ? m_sum / 1000.0 / m_count : 0;
+		}
+
+		double get_max_ms(void) {
+			return m_max / 1000.0;
+		}
+
+	private:
+		std::deque<std::pair<uint8_t, uint64_t>> m_commands;
+		uint64_t m_sum = 0;
+		uint64_t m_count = 0;
+		uint64_t m_max = 0;
+	};
+
+	// IN data and host events drive the replay, the rest is for comparison
+	// (canceled IN transfers are given when DataRecorder cancels)
+	bool is_input(record_t& record) {
+		return (record.type == UsbSession::RECORD_HOST
+			|| (record.type == UsbSession::RECORD_IN_DONE && record.status != LIBUSB_TRANSFER_CANCELLED));
+	}
+
+	void skip_to_input(void) {
+		while (m_next < m_records.size() && (is_input(m_records[m_next]) == false || m_records[m_next].is_consumed == true)) {
+			m_next++;
+		}
+		if (m_next >= m_records.size() && m_is_finished == false) {
+			m_is_finished = true;
+			m_end_time = replay_clock_t::now();
+		}
+	}
+
+	void advance(void) {
+		m_records[m_next].is_consumed = true;
+		m_replayed_count++;
+		m_progress_time = replay_clock_t::now();
+		m_next++;
+		skip_to_input();
+	}
+
+	// DataRecorder has caught up with the session, and the pace allows
+	bool is_ready(record_t& record) {
+		for (int index = 0; index < NUM_OUT_EP; index++) {
+			if (m_out_bytes[index] < record.out_bytes[index]) {
+				return false;
+			}
+		}
+		return (m_speed <= 0 || replay_clock_t::now() >= get_due(record));
+	}
+
+	replay_clock_t::time_point get_due(record_t& record) {
+		return m_start_time + std::chrono::microseconds((int64_t)(record.time_usec / m_speed));
+	}
+
+	replay_clock_t::time_point next_wakeup(void) {
+		replay_clock_t::time_point next = replay_clock_t::now() + std::chrono::milliseconds(100);
+		if (m_is_finished == false && m_speed > 0) {
+			replay_clock_t::time_point due = get_due(m_records[m_next]);
+			if (due < next) {
+				next = due;
+			}
+		}
+		return next;
+	}
+
+	// DataRecorder does not do what it did in the session
+	void check_divergence(void) {
+		if (m_is_finished == false && m_speed > 0 && replay_clock_t::now() < get_due(m_records[m_next])) {
+			// waiting for the pace, not for DataRecorder
+			m_progress_time = replay_clock_t::now();
+			return;
+		}
+		if (m_is_finished == false && replay_clock_t::now() - m_progress_time > std::chrono::milliseconds(DIVERGE_TIMEOUT_MS)) {
+			m_is_diverged = true;
+			m_is_finished = true;
+			m_end_time = replay_clock_t::now();
+		}
+	}
+
+	void deliver_in_data(void) {
+		while (1) {
+			check_divergence();
+			if (m_is_finished == true) {
+				return;
+			}
+			record_t& record = m_records[m_next];
+			if (record.type != UsbSession::RECORD_IN_DONE || is_ready(record) == false) {
+				return;
+			}
+			pending_t* target = nullptr;
+			for (auto& pending : m_pending) {
+				if (pending.is_done == false && pending.transfer->endpoint == record.endpoint) {
+					target = &pending;
+					break;
+				}
+			}
+			if (target == nullptr) {
+				return;
+			}
+			target->transfer->actual_length = copy_in_data(target->transfer, record);
+			target->status = (enum libusb_transfer_status)record.status;
+			target->is_done = true;
+			if (record.endpoint == UsbSession::COMMAND_EP && record.data.empty() == false) {
+				m_replayed_latency.command(record.data[0], get_replay_usec());
+			}
+			advance();
+		}
+	}
+
+	// tape data the board had taken before the next input
+	void complete_out_data(void) {
+		for (auto& pending : m_pending) {
+			uint8_t endpoint = pending.transfer->endpoint;
+			if (pending.is_done == true || (endpoint & 0x80)) {
+				continue;
+			}
+			if (m_is_finished == true || (endpoint & 0x0f) >= NUM_OUT_EP
+				|| pending.out_offset < m_records[m_next].out_bytes[endpoint & 0x0f]) {
+				pending.is_done = true;
+			}
+		}
+	}
+
+	int copy_in_data(struct libusb_transfer* transfer, record_t& record) {
+		int length = (int)record.data.size();
+		if (length > transfer->length) {
+			length = transfer->length;
+		}
+		memcpy(transfer->buffer, record.data.data(), length);
+		return length;
+	}
+
+	void compare_out(uint8_t endpoint, const uint8_t* data, int length) {
+		int index = endpoint & 0x0f;
+		if (index >= NUM_OUT_EP) {
+			return;
+		}
+		std::vector<uint8_t>& captured = m_captured_out[index];
+		// messages are sent by their own threads, in no fixed order
+		for (int offset = 0; offset < length && endpoint != UsbSession::RESPONSE_EP; offset++) {
+			uint64_t position = m_out_bytes[index] + offset;
+			if (position < captured.size() && captured[position] != data[offset]) {
+				m_out_mismatch[index]++;
+			}
+		}
+		m_out_bytes[index] += length;
+		if (endpoint == UsbSession::RESPONSE_EP) {
+			m_replayed_latency.response(data, length, get_replay_usec());
+		}
+	}
+
+	uint64_t get_replay_usec(void) {
+		return std::chrono::duration_cast<std::chrono::microseconds>(replay_clock_t::now() - m_start_time).count();
+	}
+
+	double m_speed;
+	std::vector<record_t> m_records;
+	size_t m_next;                      // next input
+	size_t m_replayed_count = 0;
+	uint64_t m_duration_usec = 0;
+	bool m_is_finished;
+	bool m_is_diverged;
+	replay_clock_t::time_point m_start_time;
+	replay_clock_t::time_point m_end_time;
+	replay_clock_t::time_point m_progress_time;
+
+	std::vector<uint8_t> m_captured_out[NUM_OUT_EP];
+	uint64_t m_out_bytes[NUM_OUT_EP];
+	uint64_t m_out_mismatch[NUM_OUT_EP];
+	latency_meter_t m_captured_latency;
+	latency_meter_t m_replayed_latency;
+
+	std::mutex m_lock;
+	std::condition_variable m_cond;
+	std::deque<pending_t> m_pending;
+};
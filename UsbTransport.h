@@ -0,0 +1,340 @@
+#pragma once
+
+//
+//  USB access of one recorder board
+//  - LibusbTransport: EZ-USB board (all boards share the default libusb context,
+//                     so one event loop serves every recorder)
+//  - SimulatedTransport: no hardware, for testing multiple recorders
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <libusb.h>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+class UsbTransport {
+public:
+	virtual ~UsbTransport(void) {}
+
+	virtual const char* get_name(void) = 0;
+	virtual libusb_device_handle* get_handle(void) = 0;
+
+	// same as libusb_submit_transfer() / libusb_cancel_transfer() / libusb_handle_events_completed()
+	virtual int submit_transfer(struct libusb_transfer* transfer) = 0;
+	virtual int cancel_transfer(struct libusb_transfer* transfer) = 0;
+	virtual int handle_events_completed(int* completed) = 0;
+
+	virtual bool is_simulated(void) {
+		return false;
+	}
+
+	// the board has come back on the same bus / port (handle: opened, interface claimed and
+	// firmware loaded), no transfer may be in flight on the old handle
+	virtual void reopen(libusb_device_handle* handle) {
+	}
+
+	// host side changes that affect the USB traffic (kept by CaptureTransport for replay)
+	enum host_event_t {
+		HOST_TAPE_SET = 1,          // + file name (wchar_t)
+		HOST_TAPE_EJECT = 2,
+		HOST_REC_STRATEGY = 3,      // + 1 byte: bit conversion
+		HOST_PULSE_PLAY = 4,        // + 1 byte: pulse playback
+		HOST_REC_CAPTURE = 5,       // + 1 byte: edge capture
+		HOST_MECHANICAL_DELAY = 6,  // + 16bit msec (LSB first)
+		HOST_REC_PLL = 7,           // + 1 byte: PLL bit decoder
+		HOST_FAST_LOAD = 8,         // + 1 byte: leader / blank compression on PLAY
+		HOST_TAPE_POSITION = 9,     // + 64bit tape bit position (LSB first)
+	};
+
+	virtual void note_host_event(host_event_t code, const void* data, int length) {
+	}
+};
+
+
+//
+//
+//
+
+class LibusbTransport : public UsbTransport {
+public:
+	// handle: opened, interface claimed and firmware loaded
+	LibusbTransport(libusb_device_handle* handle, uint8_t bus, uint8_t port) {
+		m_handle = handle;
+		m_bus = bus;
+		m_port = port;
+		snprintf(m_name, sizeof(m_name), "Bus %d Port %d", bus, port);
+	}
+
+	~LibusbTransport(void) {
+		libusb_release_interface(m_handle, 0);
+		libusb_close(m_handle);
+	}
+
+	const char* get_name(void) {
+		return m_name;
+	}
+
+	libusb_device_handle* get_handle(void) {
+		return m_handle;
+	}
+
+	uint8_t get_bus(void) {
+		return m_bus;
+	}
+
+	uint8_t get_port(void) {
+		return m_port;
+	}
+
+	void reopen(libusb_device_handle* handle) {
+		libusb_release_interface(m_handle, 0);
+		libusb_close(m_handle);
+		m_handle = handle;
+	}
+
+	int submit_transfer(struct libusb_transfer* transfer) {
+		return libusb_submit_transfer(transfer);
+	}
+
+	int cancel_transfer(struct libusb_transfer* transfer) {
+		return libusb_cancel_transfer(transfer);
+	}
+
+	int handle_events_completed(int* completed) {
+		return libusb_handle_events_completed(NULL, completed);
+	}
+
+private:
+	libusb_device_handle* m_handle;
+	uint8_t m_bus;
+	uint8_t m_port;
+	char m_name[32];
+};
+
+
+//
+//
+//
+
+// Behaves like an EZ-USB board running em8rl1 firmware, without the X1 side:
+//  tape OUT/IN transfers complete at the USB sample rate, PC_TAPE_STOP is
+//  answered by the stop notifications, and X1 commands are injected by the UI.
+class SimulatedTransport : public UsbTransport {
+public:
+	SimulatedTransport(int index) {
+		snprintf(m_name, sizeof(m_name), "Simulated %d", index);
+		m_usb_rate = DEFAULT_USB_RATE;
+		m_tape_time = sim_clock_t::now();
+		m_is_connected = true;
+	}
+
+	const char* get_name(void) {
+		return m_name;
+	}
+
+	libusb_device_handle* get_handle(void) {
+		return nullptr;
+	}
+
+	bool is_simulated(void) {
+		return true;
+	}
+
+	// X1 command, as if sent by the machine
+	void inject_command(uint8_t command) {
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_command_queue.push_back(command);
+		}
+		m_cond.notify_all();
+	}
+
+	// cable glitch: pending transfers end with LIBUSB_TRANSFER_NO_DEVICE until connect()
+	void disconnect(void) {
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_is_connected = false;
+			for (auto& pending : m_pending) {
+				pending.status = LIBUSB_TRANSFER_NO_DEVICE;
+				pending.due = sim_clock_t::now();
+				pending.is_command = false;
+			}
+			m_command_queue.clear();
+		}
+		m_cond.notify_all();
+	}
+
+	// back with the firmware defaults
+	void connect(void) {
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_is_connected = true;
+		m_usb_rate = DEFAULT_USB_RATE;
+	}
+
+	bool is_connected(void) {
+		return m_is_connected;
+	}
+
+	int submit_transfer(struct libusb_transfer* transfer) {
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			pending_t pending;
+
+			if (m_is_connected == false) {
+				return LIBUSB_ERROR_NO_DEVICE;
+			}
+
+			pending.transfer = transfer;
+			pending.status = LIBUSB_TRANSFER_COMPLETED;
+			pending.due = sim_clock_t::now();
+			pending.is_command = false;
+
+			if (transfer->endpoint == RESPONSE_EP) {
+				handle_pc_message(transfer->buffer, transfer->length);
+			}
+			else if (transfer->endpoint == COMMAND_EP) {
+				// completes when a command or notification is queued
+				pending.is_command = true;
+			}
+			else {
+				// tape data moves at the sample rate (1 bit per sample), one transfer after another
+				if (m_tape_time < pending.due) {
+					m_tape_time = pending.due;
+				}
+				m_tape_time += std::chrono::microseconds((int64_t)transfer->length * 8 * 1000000 / m_usb_rate);
+				pending.due = m_tape_time;
+			}
+			m_pending.push_back(pending);
+		}
+		m_cond.notify_all();
+		return 0;
+	}
+
+	int cancel_transfer(struct libusb_transfer* transfer) {
+		std::lock_guard<std::mutex> lock(m_lock);
+		for (auto& pending : m_pending) {
+			if (pending.transfer == transfer) {
+				pending.status = LIBUSB_TRANSFER_CANCELLED;
+				pending.due = sim_clock_t::now();
+				pending.is_command = false;
+				m_cond.notify_all();
+				return 0;
+			}
+		}
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	int handle_events_completed(int* completed) {
+		std::unique_lock<std::mutex> lock(m_lock);
+
+		while (!*completed) {
+			pending_t done[MAX_DONE];  // not a vector: no allocations while streaming
+			int done_count = 0;
+			sim_clock_t::time_point now = sim_clock_t::now();
+			sim_clock_t::time_point next = now + std::chrono::milliseconds(100);
+
+			for (auto it = m_pending.begin(); it != m_pending.end() && done_count < MAX_DONE;) {
+				if (it->is_command && m_command_queue.empty() == false) {
+					it->transfer->buffer[0] = m_command_queue.front();
+					it->transfer->actual_length = 1;
+					m_command_queue.pop_front();
+					it->is_command = false;
+					done[done_count++] = *it;
+					it = m_pending.erase(it);
+				}
+				else if (it->is_command == false && it->due <= now) {
+					if (it->status != LIBUSB_TRANSFER_COMPLETED) {
+						it->transfer->actual_length = 0;
+					}
+					else {
+						if (!(it->transfer->endpoint & 0x80)) {
+							it->transfer->actual_length = it->transfer->length;
+						}
+						else {
+							// REC: square wave (4 samples high, 4 samples low)
+							memset(it->transfer->buffer, 0xf0, it->transfer->length);
+							it->transfer->actual_length = it->transfer->length;
+						}
+					}
+					done[done_count++] = *it;
+					it = m_pending.erase(it);
+				}
+				else {
+					if (it->is_command == false && it->due < next) {
+						next = it->due;
+					}
+					++it;
+				}
+			}
+			if (done_count > 0) {
+				// callbacks run without the lock, like libusb
+				lock.unlock();
+				for (int index = 0; index < done_count; index++) {
+					done[index].transfer->status = done[index].status;
+					done[index].transfer->callback(done[index].transfer);
+				}
+				lock.lock();
+				m_cond.notify_all();
+				continue;
+			}
+			m_cond.wait_until(lock, next);
+		}
+		return 0;
+	}
+
+private:
+	typedef std::chrono::steady_clock sim_clock_t;
+
+	struct pending_t {
+		struct libusb_transfer* transfer;
+		enum libusb_transfer_status status;
+		sim_clock_t::time_point due;
+		bool is_command;
+	};
+
+	// PC -> EZ-USB message types and notifications, as em8rl1 firmware
+	void handle_pc_message(uint8_t* data, int length) {
+		if (length < 1) {
+			return;
+		}
+		switch (data[0]) {
+		case PC_USB_RATE_CHANGE:
+			if (length >= 3) {
+				int rate = data[1] | (data[2] << 8);
+				if (rate > 0) {
+					m_usb_rate = rate;
+				}
+			}
+			break;
+		case PC_TAPE_STOP:
+			m_command_queue.push_back(NOTIFY_TIMER_STOPPED);
+			m_command_queue.push_back(NOTIFY_EP6_FLUSHED);
+			break;
+		default:
+			break;
+		}
+	}
+
+	static constexpr uint8_t RESPONSE_EP = 0x01;
+	static constexpr uint8_t COMMAND_EP = 0x81;
+	static constexpr uint8_t PC_USB_RATE_CHANGE = 3;
+	static constexpr uint8_t PC_TAPE_STOP = 4;
+	static constexpr uint8_t NOTIFY_TIMER_STOPPED = 0xf0;
+	static constexpr uint8_t NOTIFY_EP6_FLUSHED = 0xf1;
+	static constexpr int DEFAULT_USB_RATE = 48000;
+	static constexpr int MAX_DONE = 16;        // completions handled at once
+
+	char m_name[32];
+	int m_usb_rate;
+	sim_clock_t::time_point m_tape_time;
+	bool m_is_connected;
+
+	std::mutex m_lock;
+	std::condition_variable m_cond;
+	std::deque<pending_t> m_pending;
+	std::deque<uint8_t> m_command_queue;
+};
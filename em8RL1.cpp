@@ -8,8 +8,11 @@
 #include "imgui_impl_sdlrenderer.h"
 
 #include "Recorder.h"
+#include "UsbSession.h"
 
 #include "fx2load.h"
+#include "FontAtlasCache.h"
+#include "SessionFile.h"
 
 #include <SDL.h>
 #include <SDL_syswm.h>
@@ -25,14 +28,44 @@
 #include <libusb.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <locale.h>
-#include <map>
+#include <vector>
+#include <algorithm>
+#include <thread>
 #include <filesystem>
 
 using namespace std;
 using namespace std::filesystem;
 
 void finalize(void);
+static bool finish_startup(void);
+static void restore_session(void);
+static void save_session(void);
+static void log_startup_time(const char* name);
+
+#ifdef _DEBUG
+// count heap allocations (AllocationCounter.h), new[] and the nothrow versions come here too
+void* operator new(size_t size)
+{
+	AllocationCounter::add();
+	void* p = malloc((size > 0) ? size : 1);
+	if (p == nullptr) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t size) noexcept
+{
+	free(p);
+}
+#endif
 
 #define _MAKE_TITLE(A)  A##"CZ-8RL1 Emulator"
 #define APP_TITLE      _MAKE_TITLE(L)
@@ -40,32 +73,157 @@ void finalize(void);
 
 #define VID 0x04b4
 #define PID 0x8613
+#define USB_POLL_INTERVAL_MS 500
+#define STARTUP_POLL_MS 50
+#define FONT_SIZE 18
+#define NEW_TAPE_HZ 48000
 
 HWND h_main_window = NULL;
 
 static uint32_t tape_event;
 
-static bool is_alt_44k = false;
 static bool is_rec_bit_convert = false;
-static bool is_tape_set = false;
-static path tape_filepath("NO TAPE");
+static bool is_mechanical_delay = true;
+static bool is_rec_capture = false;
+static bool is_rec_pll = false;
+static bool is_pulse_play = false;
+static bool is_fast_load = false;
+static ThreadPriority::config_t thread_config = { false, -1 };
+
+// one per EZ-USB board (or simulated board)
+struct recorder_view_t {
+	DataRecorder* recorder;
+	UsbTransport* transport;
+	LibusbTransport* board;        // nullptr for simulated board
+	SimulatedTransport* simulator; // nullptr for EZ-USB board
+	path tape_filepath;
+};
 
 static volatile int ui_run_flag = 1;
-DataRecorder recorder;
-static libusb_device_handle* usb_handle = NULL;
+static std::vector<recorder_view_t> recorders;
+static int current_recorder = 0;
+
+static std::thread usb_monitor_thread;
+static volatile bool usb_monitor_run_flag = false;
+static volatile bool is_usb_arrived = false;
+static bool is_usb_hotplug = false;
+static libusb_hotplug_callback_handle usb_hotplug_handle;
 
+// EZ-USB boards are opened (firmware download) in background while the window is up
+static std::thread startup_thread;
+static std::atomic<bool> is_startup_done{ false };
+static bool is_startup_applied = false;
+static std::vector<LibusbTransport*> startup_transports;  // written by startup_thread until is_startup_done
+static std::atomic<int> startup_board_index{ 0 };         // board being opened (from 1), 0 while looking for boards
+static std::atomic<int> startup_board_count{ 0 };
+static std::atomic<float> startup_firmware_progress{ 0 };
+static const char* usb_capture_path = nullptr;
+static std::chrono::steady_clock::time_point app_start_time;
+static bool is_first_frame_presented = false;
 
-void handle_sample_rate_change(void)
+static FontAtlasCache font_cache;
+static SessionFile session;   // settings and tapes of the last run
+
+
+// per-user files (%LOCALAPPDATA%\em8RL1), the directory is created if needed
+static path get_app_data_path(void)
 {
-	recorder.set_alt_44k(is_alt_44k);
+	wchar_t* local_app_data = nullptr;
+	size_t length;
+	path data_path = std::filesystem::temp_directory_path();
+	std::error_code error;
+
+	if (_wdupenv_s(&local_app_data, &length, L"LOCALAPPDATA") == 0 && local_app_data != nullptr) {
+		data_path = path(local_app_data);
+		free(local_app_data);
+	}
+	data_path /= "em8RL1";
+	std::filesystem::create_directories(data_path, error);
+	return data_path;
 }
 
 void handle_rec_strategy_change(bool use_bit_conversion)
 {
-	recorder.set_rec_strategy(use_bit_conversion);
+	for (auto& view : recorders) {
+		view.recorder->set_rec_strategy(use_bit_conversion);
+	}
+}
+
+void handle_pulse_play_change(bool use_pulse_play)
+{
+	for (auto& view : recorders) {
+		view.recorder->set_pulse_play(use_pulse_play);
+	}
 }
 
-void handle_set_tape(void)
+void handle_rec_capture_change(bool use_capture)
+{
+	for (auto& view : recorders) {
+		view.recorder->set_rec_capture(use_capture);
+	}
+}
+
+void handle_rec_pll_change(bool use_pll)
+{
+	for (auto& view : recorders) {
+		view.recorder->set_rec_pll(use_pll);
+	}
+}
+
+void handle_fast_load_change(bool use_fast_load)
+{
+	for (auto& view : recorders) {
+		view.recorder->set_fast_load(use_fast_load);
+	}
+}
+
+void handle_thread_priority_change(const ThreadPriority::config_t& config)
+{
+	for (auto& view : recorders) {
+		view.recorder->set_thread_priority(config);
+	}
+}
+
+void handle_mechanical_delay_change(bool use_delay)
+{
+	for (auto& view : recorders) {
+		view.recorder->set_mechanical_delay(use_delay ? DataRecorder::DEFAULT_MECHANICAL_DELAY_MS : 0);
+	}
+}
+
+recorder_view_t* find_recorder_view(DataRecorder* recorder)
+{
+	for (auto& view : recorders) {
+		if (view.recorder == recorder) {
+			return &view;
+		}
+	}
+	return nullptr;
+}
+
+bool is_any_tape_running(void)
+{
+	for (auto& view : recorders) {
+		if (view.recorder->is_running()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// set / ejected by the recorder's command sender, EVENT_TAPE_ERROR if it cannot be opened
+bool is_tape_set(recorder_view_t& view)
+{
+	return ((view.recorder->get_sensor() & DataRecorder::TAPE_SET) != 0);
+}
+
+void set_tape_file(recorder_view_t& view, wchar_t* file_name)
+{
+	view.tape_filepath = path(file_name);
+	view.recorder->set_tape(file_name);
+}
+
+void handle_set_tape(recorder_view_t& view)
 {
 	OPENFILENAME ofn;
 	wchar_t file_name[MAX_PATH];
@@ -84,37 +242,270 @@ void handle_set_tape(void)
 	ofn.Flags = OFN_PATHMUSTEXIST | OFN_FILEMUSTEXIST;
 
 	if (::GetOpenFileName(&ofn) == TRUE) {
-		errno_t ret;
-		size_t convertedLen;
-		char u8_file_name[MAX_PATH];
-		ret = wcstombs_s(&convertedLen, u8_file_name, sizeof(u8_file_name), file_name, sizeof(u8_file_name) - 1);
-		tape_filepath = u8_file_name;
-		if (recorder.set_tape(file_name) == false) {
+		set_tape_file(view, file_name);
+	}
+}
+
+// blank tape of the length, set to the recorder
+void handle_new_tape(recorder_view_t& view, int minutes)
+{
+	OPENFILENAME ofn;
+	wchar_t file_name[MAX_PATH];
+
+	ZeroMemory(&ofn, sizeof(ofn));
+	ofn.lStructSize = sizeof(ofn);
+	ofn.hwndOwner = h_main_window;
+	ofn.lpstrFile = file_name;
+	ofn.lpstrFile[0] = '\0';
+	ofn.nMaxFile = MAX_PATH;
+	ofn.lpstrFilter = L"TAP File\0*.tap\0";
+	ofn.nFilterIndex = 1;
+	ofn.lpstrDefExt = L"tap";
+	ofn.Flags = OFN_PATHMUSTEXIST | OFN_OVERWRITEPROMPT;
+
+	if (::GetSaveFileName(&ofn) == TRUE) {
+		// replace the chosen file (confirmed by the dialog)
+		_wremove(file_name);
+		if (TapFile::create(file_name, NEW_TAPE_HZ, (uint64_t)NEW_TAPE_HZ * 60 * minutes) == false) {
+			::MessageBox(h_main_window, L"The tape could not be created.", APP_TITLE, MB_OK);
 			return;
-		};
-		is_tape_set = true;
+		}
+		set_tape_file(view, file_name);
 	}
 }
 
-void handle_eject_tape(bool is_event = false)
+// Chrome trace JSON of the recent events (all recorders)
+void handle_save_trace(void)
+{
+	OPENFILENAME ofn;
+	wchar_t file_name[MAX_PATH];
+
+	ZeroMemory(&ofn, sizeof(ofn));
+	ofn.lStructSize = sizeof(ofn);
+	ofn.hwndOwner = h_main_window;
+	ofn.lpstrFile = file_name;
+	wcscpy_s(file_name, MAX_PATH, L"em8RL1_trace.json");
+	ofn.nMaxFile = MAX_PATH;
+	ofn.lpstrFilter = L"Trace File\0*.json\0";
+	ofn.nFilterIndex = 1;
+	ofn.lpstrDefExt = L"json";
+	ofn.Flags = OFN_PATHMUSTEXIST | OFN_OVERWRITEPROMPT;
+
+	if (::GetSaveFileName(&ofn) == TRUE) {
+		if (Trace::write_chrome_json(file_name) == false) {
+			::MessageBox(h_main_window, L"The trace could not be saved.", APP_TITLE, MB_OK);
+		}
+	}
+}
+
+void handle_eject_tape(recorder_view_t& view, bool is_event = false)
 {
 	if (is_event == false) {
-		recorder.eject_tape();
+		view.recorder->eject_tape();
 	}
-	tape_filepath = u"NO TAPE";
-	is_tape_set = false;
+	view.tape_filepath = u"NO TAPE";
 }
 
-void handle_recorder_event(uint8_t code) 
+void handle_recorder_event(DataRecorder* recorder, uint8_t code)
 {
 	SDL_Event event;
 
 	SDL_memset(&event, 0, sizeof(event));
 	event.type = tape_event;
 	event.user.code = code;
+	event.user.data1 = recorder;
 	SDL_PushEvent(&event);
 }
 
+void show_recorder_message(recorder_view_t* view, const wchar_t* message)
+{
+	wchar_t tmp[256];
+
+	swprintf(tmp, sizeof(tmp) / sizeof(tmp[0]), L"%hs: %ls", view->recorder->get_name(), message);
+	::MessageBox(h_main_window, tmp, APP_TITLE, MB_OK);
+}
+
+// what X1 sent in the last / current save
+void draw_pulse_stats(const PulseAnalyzer::stats_t& stats)
+{
+	float high[PulseAnalyzer::HISTOGRAM_BINS];
+	float low[PulseAnalyzer::HISTOGRAM_BINS];
+	char label[64];
+
+	for (int bin = 0; bin < PulseAnalyzer::HISTOGRAM_BINS; bin++) {
+		high[bin] = (float)stats.high_histogram[bin];
+		low[bin] = (float)stats.low_histogram[bin];
+	}
+	snprintf(label, sizeof(label), "High (0-%dus)", PulseAnalyzer::HISTOGRAM_BINS * PulseAnalyzer::HISTOGRAM_BIN_USEC);
+	ImGui::PlotHistogram("##high", high, PulseAnalyzer::HISTOGRAM_BINS, 0, label, 0, 3.4e38f, ImVec2(0, 60));
+	snprintf(label, sizeof(label), "Low (0-%dus)", PulseAnalyzer::HISTOGRAM_BINS * PulseAnalyzer::HISTOGRAM_BIN_USEC);
+	ImGui::PlotHistogram("##low", low, PulseAnalyzer::HISTOGRAM_BINS, 0, label, 0, 3.4e38f, ImVec2(0, 60));
+
+	ImGui::Text("Pulses: %llu  blank: %llu", (unsigned long long)stats.pulse_count, (unsigned long long)stats.blank_count);
+	ImGui::Text("Bit 0: high %.1f us (jitter %.1f)  low %.1f us (jitter %.1f)  [125 us]",
+		stats.short_high.get_mean(), stats.short_high.get_jitter(), stats.short_low.get_mean(), stats.short_low.get_jitter());
+	ImGui::Text("Bit 1: high %.1f us (jitter %.1f)  low %.1f us (jitter %.1f)  [250 us]",
+		stats.long_high.get_mean(), stats.long_high.get_jitter(), stats.long_low.get_mean(), stats.long_low.get_jitter());
+	ImGui::Text("Duty: %.1f %%  recent %.1f %%  [50 %%]", stats.get_duty() * 100, stats.duty_recent * 100);
+	ImGui::Text("Decision at %.1f us  marginal: %llu", stats.judge_usec, (unsigned long long)stats.marginal_count);
+	if (stats.short_high.count > 0) {
+		ImGui::SameLine();
+		ImGui::Text(" margin of bit 0: %.1f us", stats.short_margin_usec);
+	}
+	if (stats.long_high.count > 0) {
+		ImGui::SameLine();
+		ImGui::Text(" bit 1: %.1f us", stats.long_margin_usec);
+	}
+}
+
+void draw_jitter_stats(const char* name, const JitterHistogram::stats_t& stats)
+{
+	float histogram[JitterHistogram::HISTOGRAM_BINS];
+	char label[64];
+
+	for (int bin = 0; bin < JitterHistogram::HISTOGRAM_BINS; bin++) {
+		histogram[bin] = (float)stats.histogram[bin];
+	}
+	snprintf(label, sizeof(label), "%s (1us-65ms, log2)", name);
+	ImGui::PushID(name);
+	ImGui::PlotHistogram("##jitter", histogram, JitterHistogram::HISTOGRAM_BINS, 0, label, 0, 3.4e38f, ImVec2(0, 60));
+	ImGui::PopID();
+	ImGui::Text("%s: %llu wake-ups  mean %.0f us  max %.0f us", name, (unsigned long long)stats.count,
+		stats.mean_usec, stats.max_usec);
+}
+
+static const char* get_tape_mode_name(DataRecorder::tape_mode_t mode)
+{
+	switch (mode) {
+	case DataRecorder::TAPE_MODE_PLAY:
+		return "LOAD";
+	case DataRecorder::TAPE_MODE_STOP:
+		return "STOP";
+	case DataRecorder::TAPE_MODE_REC:
+		return "SAVE";
+	case DataRecorder::TAPE_MODE_REW:
+		return "REW";
+	case DataRecorder::TAPE_MODE_FF:
+		return "FF";
+	case DataRecorder::TAPE_MODE_AREW:
+		return "AREW";
+	case DataRecorder::TAPE_MODE_AFF:
+		return "AFF";
+	case DataRecorder::TAPE_MODE_EJECT:
+		return "EJECT";
+	default:
+		return "??";
+	}
+}
+
+void draw_recorder(recorder_view_t& view)
+{
+	DataRecorder& recorder = *view.recorder;
+	bool is_tape_running = recorder.is_running();
+
+	if (recorder.is_disconnected() == true) {
+		ImGui::Text("USB disconnected, waiting for the board..");
+	}
+	std::string tape_name = view.tape_filepath.filename().u8string();
+	font_cache.add_text(tape_name.c_str());
+	ImGui::Text(tape_name.c_str());
+	if (is_tape_set(view) == true) {
+		ImGui::Text(get_tape_mode_name(recorder.get_current_mode()));
+		uint64_t total_count = recorder.get_total_counter();
+		if (total_count != 0) {
+			ImGui::ProgressBar((float)((double)recorder.get_counter() / total_count));
+		}
+		if (is_tape_running == true && ImGui::Button("Stop")) {
+			recorder.command(DataRecorder::COM_STOP);
+		}
+		if (is_tape_running == false && ImGui::Button("REW")) {
+			recorder.command(DataRecorder::COM_REW);
+		}
+		if (is_tape_running == false && (ImGui::SameLine() , ImGui::Button("FF"))) {
+			recorder.command(DataRecorder::COM_FF);
+		}
+		if (is_tape_running == false && (ImGui::SameLine(), ImGui::Button("AREW"))) {
+			recorder.command(DataRecorder::COM_AREW);
+		}
+		if (is_tape_running == false && (ImGui::SameLine(), ImGui::Button("AFF"))) {
+			recorder.command(DataRecorder::COM_AFF);
+		}
+		if (view.simulator != nullptr && is_tape_running == false) {
+			// simulated board: X1 commands from buttons
+			if (ImGui::Button("PLAY (X1)")) {
+				view.simulator->inject_command(DataRecorder::COM_PLAY);
+			}
+			if (ImGui::SameLine(), ImGui::Button("REC (X1)")) {
+				view.simulator->inject_command(DataRecorder::COM_REC);
+			}
+		}
+		if (view.simulator != nullptr) {
+			// simulated cable glitch
+			if (view.simulator->is_connected() == true && ImGui::Button("Unplug")) {
+				view.simulator->disconnect();
+			}
+			if (view.simulator->is_connected() == false && ImGui::Button("Replug")) {
+				view.simulator->connect();
+				recorder.reconnect();
+			}
+		}
+		ImGui::Text("Counter: %llu", (unsigned long long)(recorder.get_counter() / 8));
+		if (recorder.get_current_mode() == DataRecorder::TAPE_MODE_PLAY) {
+			ImGui::Text("USB rate: %.1f Hz", recorder.get_usb_rate());
+		}
+		if (recorder.get_current_mode() == DataRecorder::TAPE_MODE_PLAY
+			|| recorder.get_current_mode() == DataRecorder::TAPE_MODE_REC) {
+			ImGui::Text("USB transfers: %d  underrun: %u  overrun: %u", recorder.get_transfer_depth(),
+				recorder.get_underrun_count(), recorder.get_overrun_count());
+			ImGui::Text("Throughput: %.0f bytes/s  latency: %.1f ms (max %.1f ms)", recorder.get_throughput(),
+				recorder.get_latency_avg_ms(), recorder.get_latency_max_ms());
+		}
+		if (recorder.get_current_mode() == DataRecorder::TAPE_MODE_REC && recorder.get_dropped_count() > 0) {
+			ImGui::Text("Dropped: %u", recorder.get_dropped_count());
+		}
+		if (is_fast_load == true && recorder.get_fast_load_skippable_sec() > 0) {
+			ImGui::Text("Fast load: saved %.1f s (of %.1f s)", recorder.get_fast_load_saved_sec(), recorder.get_fast_load_skippable_sec());
+		}
+		if (AllocationCounter::is_enabled() == true && recorder.get_stream_allocation_count() > 0) {
+			ImGui::Text("Heap allocations during LOAD / SAVE: %llu", (unsigned long long)recorder.get_stream_allocation_count());
+		}
+		if (recorder.get_stop_latency_max_ms() > 0) {
+			ImGui::Text("Stop latency: %.1f ms (max %.1f ms)", recorder.get_stop_latency_avg_ms(), recorder.get_stop_latency_max_ms());
+		}
+		PulseAnalyzer::stats_t pulse_stats = recorder.get_pulse_stats();
+		if (pulse_stats.pulse_count > 0 && ImGui::CollapsingHeader("REC signal")) {
+			draw_pulse_stats(pulse_stats);
+		}
+		JitterHistogram::stats_t tape_jitter = recorder.get_tape_jitter();
+		JitterHistogram::stats_t write_jitter = recorder.get_write_jitter();
+		if ((tape_jitter.count > 0 || write_jitter.count > 0) && ImGui::CollapsingHeader("Thread jitter")) {
+			ImGui::Text("Tape threads: %s", (recorder.is_realtime() == true) ? "real-time" : "normal priority");
+			draw_jitter_stats("USB transfers", tape_jitter);
+			if (write_jitter.count > 0) {
+				draw_jitter_stats("REC writer", write_jitter);
+			}
+		}
+	}
+}
+
+// Status window while the boards are opened
+void draw_startup(void)
+{
+	const ImGuiViewport* main_viewport = ImGui::GetMainViewport();
+	ImGui::SetNextWindowPos(ImVec2(main_viewport->WorkPos.x + 10, main_viewport->WorkPos.y + 30), ImGuiCond_FirstUseEver);
+	ImGui::SetNextWindowSize(ImVec2((float)(main_viewport->WorkSize.x / 2.0), (float)(main_viewport->WorkSize.y / 2.0)), ImGuiCond_FirstUseEver);
+
+	ImGui::Begin("Status");
+	if (startup_board_index == 0) {
+		ImGui::Text("Looking for EZ-USB boards..");
+	}
+	else {
+		ImGui::Text("Loading the firmware to EZ-USB (board %d of %d)..", (int)startup_board_index, (int)startup_board_count);
+		ImGui::ProgressBar(startup_firmware_progress);
+	}
+	ImGui::End();
+}
+
 DWORD WINAPI draw_run(void* arg) {
 	// The window we'll be rendering to
 	SDL_Window* window = NULL;
@@ -146,7 +537,6 @@ DWORD WINAPI draw_run(void* arg) {
 	h_main_window = info.info.win.window;
 
 	tape_event = SDL_RegisterEvents(1);
-	recorder.set_event_callback(handle_recorder_event);
 
 	Renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC | SDL_RENDERER_ACCELERATED);
 	if (Renderer == NULL) {
@@ -156,19 +546,6 @@ DWORD WINAPI draw_run(void* arg) {
 	SDL_SetRenderDrawColor(Renderer, 0x00, 0x00, 0x00, 0xff);
 	SDL_RenderClear(Renderer);
 
-	std::map<DataRecorder::tape_mode_t, const char*> tape_mode_map = {
-		{DataRecorder::TAPE_MODE_PLAY, "LOAD"},
-		{DataRecorder::TAPE_MODE_STOP, "STOP"},
-		{DataRecorder::TAPE_MODE_REC, "SAVE"},
-		{DataRecorder::TAPE_MODE_REW, "REW"},
-		{DataRecorder::TAPE_MODE_FF, "FF"},
-		{DataRecorder::TAPE_MODE_AREW, "AREW"},
-		{DataRecorder::TAPE_MODE_AFF, "AFF"},
-		{DataRecorder::TAPE_MODE_NONE, "??"},
-		{DataRecorder::TAPE_MODE_EJECT, "EJECT"},
-
-	};
-
 	IMGUI_CHECKVERSION();
 	ImGui::CreateContext();
 
@@ -181,38 +558,102 @@ DWORD WINAPI draw_run(void* arg) {
 
 	SDL_Event e;
 	bool is_tape_running = false;
+	bool is_any_running = false;
 
 	char font_path[256];
 	::GetWindowsDirectoryA(font_path, sizeof(font_path));
 	string str_font_path(font_path);
 	str_font_path.append("\\fonts\\meiryo.ttc");
 
+	// the atlas is built before the first frame, and again for new characters in tape names
 	if(std::filesystem::exists(str_font_path)){
-		ImGuiIO& io = ImGui::GetIO();
-		io.Fonts->AddFontFromFileTTF(str_font_path.c_str(), 18, NULL, io.Fonts->GetGlyphRangesJapanese());
+		font_cache.open(str_font_path.c_str(), (get_app_data_path() / "font_cache.bin").wstring().c_str(), FONT_SIZE);
 	}
 
+	auto present = [&]() {
+		ImGui::Render();
+		SDL_RenderClear(Renderer);
+		ImGui_ImplSDLRenderer_RenderDrawData(ImGui::GetDrawData());
+		SDL_RenderPresent(Renderer);
+		if (is_first_frame_presented == false) {
+			is_first_frame_presented = true;
+			log_startup_time("first frame");
+		}
+	};
+
 	while (ui_run_flag) {
+		bool has_event;
 
-		SDL_WaitEvent(&e);
-		//		SDL_PollEvent(&e);
+		if (is_first_frame_presented == false || font_cache.is_dirty() == true) {
+			has_event = (SDL_PollEvent(&e) != 0);
+		}
+		else if (is_startup_applied == false) {
+			// redraw the progress while the boards are opened
+			has_event = (SDL_WaitEventTimeout(&e, STARTUP_POLL_MS) != 0);
+		}
+		else {
+			has_event = (SDL_WaitEvent(&e) != 0);
+		}
+		if (has_event == false) {
+			e.type = SDL_FIRSTEVENT;
+		}
 		ImGui_ImplSDL2_ProcessEvent(&e);
 
-		is_tape_running = recorder.is_running();
+		if (font_cache.is_dirty() == true) {
+			Trace::begin("font atlas");
+			font_cache.rebuild();
+			// made again from the new atlas in ImGui_ImplSDLRenderer_NewFrame()
+			ImGui_ImplSDLRenderer_DestroyFontsTexture();
+			Trace::end("font atlas");
+		}
+
+		if (is_startup_applied == false) {
+			if (e.type == SDL_QUIT) {
+				ui_run_flag = 0;
+				break;
+			}
+			if (is_startup_done == true) {
+				is_startup_applied = true;
+				if (finish_startup() == false) {
+					ui_run_flag = 0;
+					break;
+				}
+			}
+			else {
+				ImGui_ImplSDLRenderer_NewFrame();
+				ImGui_ImplSDL2_NewFrame();
+				ImGui::NewFrame();
+				draw_startup();
+				present();
+				continue;
+			}
+		}
+
+		recorder_view_t& current = recorders[current_recorder];
+		is_tape_running = current.recorder->is_running();
+		is_any_running = is_any_tape_running();
 		if (e.type == SDL_QUIT) {
 			ui_run_flag = 0;
 		}
 		else if (e.type == tape_event) {
+			recorder_view_t* view = find_recorder_view((DataRecorder*)e.user.data1);
+			Trace::instant("recorder event", e.user.code);
 			switch (e.user.code) {
 			case DataRecorder::EVENT_TAPE_EJECT:
 				::OutputDebugStringA("Eject event");
-				handle_eject_tape(true);
+				handle_eject_tape(*view, true);
 				break;
 			case DataRecorder::EVENT_USB_DISCONNECTED:
-				::MessageBox(h_main_window, L"USB disconnected", APP_TITLE, MB_OK);
+				// usb_monitor_thread reconnects the board when it is back
+				break;
+			case DataRecorder::EVENT_USB_RECONNECTED:
 				break;
 			case DataRecorder::EVENT_USB_ERROR:
-				::MessageBox(h_main_window, L"USB error", APP_TITLE, MB_OK);
+				show_recorder_message(view, L"USB error");
+				break;
+			case DataRecorder::EVENT_TAPE_ERROR:
+				handle_eject_tape(*view, true);
+				show_recorder_message(view, L"The tape could not be opened.");
 				break;
 
 			default:
@@ -233,58 +674,97 @@ DWORD WINAPI draw_run(void* arg) {
 		if (ImGui::BeginMainMenuBar()) {
 			if (ImGui::BeginMenu("File", !is_tape_running)) {
 				if (ImGui::MenuItem("Set tape..")) {
-					handle_eject_tape();
-					handle_set_tape();
+					handle_eject_tape(current);
+					handle_set_tape(current);
 				}
-				if (ImGui::MenuItem("Eject", NULL, false, is_tape_set)){
-					handle_eject_tape();
+				if (ImGui::BeginMenu("New tape")) {
+					for (int minutes : { 30, 60, 120, 240 }) {
+						char label[32];
+						snprintf(label, sizeof(label), "%d min..", minutes);
+						if (ImGui::MenuItem(label)) {
+							handle_eject_tape(current);
+							handle_new_tape(current, minutes);
+						}
+					}
+					ImGui::EndMenu();
+				}
+				if (ImGui::MenuItem("Eject", NULL, false, is_tape_set(current))){
+					handle_eject_tape(current);
 				}
 				ImGui::EndMenu();
 			}
-			if (ImGui::BeginMenu("Settings", !is_tape_running)) {
-				if (ImGui::MenuItem("Alt. 44kHz frequency", NULL, is_alt_44k)) {
-					is_alt_44k = !is_alt_44k;
-					handle_sample_rate_change();
+			// settings are shared by all recorders
+			if (ImGui::BeginMenu("Settings", !is_any_running)) {
+				if (ImGui::MenuItem("Pulse playback on Load", NULL, is_pulse_play)) {
+					is_pulse_play = !is_pulse_play;
+					handle_pulse_play_change(is_pulse_play);
+				}
+				if (ImGui::MenuItem("Fast load (short leaders / blanks)", NULL, is_fast_load)) {
+					is_fast_load = !is_fast_load;
+					handle_fast_load_change(is_fast_load);
 				}
 				if (ImGui::MenuItem("Bit conversion on Save", NULL, is_rec_bit_convert)) {
 					is_rec_bit_convert = !is_rec_bit_convert;
 					handle_rec_strategy_change(is_rec_bit_convert);
 				}
+				if (ImGui::MenuItem("Edge capture on Save", NULL, is_rec_capture)) {
+					is_rec_capture = !is_rec_capture;
+					handle_rec_capture_change(is_rec_capture);
+				}
+				if (ImGui::MenuItem("PLL decoder on Save", NULL, is_rec_pll, is_rec_bit_convert)) {
+					is_rec_pll = !is_rec_pll;
+					handle_rec_pll_change(is_rec_pll);
+				}
+				if (ImGui::MenuItem("Mechanical delay on Stop", NULL, is_mechanical_delay)) {
+					is_mechanical_delay = !is_mechanical_delay;
+					handle_mechanical_delay_change(is_mechanical_delay);
+				}
+				ImGui::Separator();
+				if (ImGui::MenuItem("Real-time tape threads", NULL, thread_config.is_realtime)) {
+					thread_config.is_realtime = !thread_config.is_realtime;
+					handle_thread_priority_change(thread_config);
+				}
+				if (ImGui::BeginMenu("Pin tape threads to")) {
+					if (ImGui::MenuItem("Any CPU", NULL, thread_config.cpu < 0)) {
+						thread_config.cpu = -1;
+						handle_thread_priority_change(thread_config);
+					}
+					int cpu_count = (int)std::thread::hardware_concurrency();
+					for (int cpu = 0; cpu < cpu_count && cpu < 64; cpu++) {
+						char label[32];
+						snprintf(label, sizeof(label), "CPU %d", cpu);
+						if (ImGui::MenuItem(label, NULL, thread_config.cpu == cpu)) {
+							thread_config.cpu = cpu;
+							handle_thread_priority_change(thread_config);
+						}
+					}
+					ImGui::EndMenu();
+				}
+				ImGui::EndMenu();
+			}
+			if (ImGui::BeginMenu("Debug")) {
+				if (ImGui::MenuItem("Save trace..")) {
+					handle_save_trace();
+				}
 				ImGui::EndMenu();
 			}
 			ImGui::EndMainMenuBar();
 		}
 
-		ImGui::Text(tape_filepath.filename().u8string().c_str());
-		if (is_tape_set == true) {
-			ImGui::Text(tape_mode_map[recorder.get_current_mode()]);
-			uint32_t total_count = recorder.get_total_counter();
-			if (total_count != 0) {
-				ImGui::ProgressBar((float)recorder.get_counter() / recorder.get_total_counter());
-			}
-			if (is_tape_running == true && ImGui::Button("Stop")) {
-				recorder.command(DataRecorder::COM_STOP);
-			}
-			if (is_tape_running == false && ImGui::Button("REW")) {
-				recorder.command(DataRecorder::COM_REW);
-			}
-			if (is_tape_running == false && (ImGui::SameLine() , ImGui::Button("FF"))) {
-				recorder.command(DataRecorder::COM_FF);
-			}
-			if (is_tape_running == false && (ImGui::SameLine(), ImGui::Button("AREW"))) {
-				recorder.command(DataRecorder::COM_AREW);
-			}
-			if (is_tape_running == false && (ImGui::SameLine(), ImGui::Button("AFF"))) {
-				recorder.command(DataRecorder::COM_AFF);
+		if (ImGui::BeginTabBar("Recorders")) {
+			for (int index = 0; index < (int)recorders.size(); index++) {
+				font_cache.add_text(recorders[index].recorder->get_name());
+				if (ImGui::BeginTabItem(recorders[index].recorder->get_name())) {
+					current_recorder = index;
+					draw_recorder(recorders[index]);
+					ImGui::EndTabItem();
+				}
 			}
-			ImGui::Text("Counter: %d", recorder.get_counter() / 8);
+			ImGui::EndTabBar();
 		}
 		ImGui::End();
 
-		ImGui::Render();
-		SDL_RenderClear(Renderer);
-		ImGui_ImplSDLRenderer_RenderDrawData(ImGui::GetDrawData());
-		SDL_RenderPresent(Renderer);
+		present();
 	}
 
 	SDL_DestroyWindow(window);
@@ -297,39 +777,591 @@ DWORD WINAPI draw_run(void* arg) {
 //======================================================================
 // Main
 //======================================================================
-int main(int argc, char* argv[]) {
-	int ret;
-
-	setlocale(LC_CTYPE, ".UTF8");
 
-	// Initialize USB
-	ret = libusb_init(NULL);
-	ret = libusb_set_option(NULL, LIBUSB_OPTION_USE_USBDK);
-	usb_handle = libusb_open_device_with_vid_pid(NULL, VID, PID);
+// Open an EZ-USB board and load the firmware, nullptr (and error) if failed
+static libusb_device_handle* open_usb_board(libusb_device* device, const wchar_t** error, void (*progress)(int done, int total) = NULL)
+{
+	libusb_device_handle* handle;
+	int ret;
 
-	if (usb_handle == NULL) {
-		::MessageBox(NULL, L"EZ-USB is not connected.", APP_TITLE, MB_OK);
-		return -1;
+	if (libusb_open(device, &handle) < 0) {
+		*error = L"EZ-USB could not be opened.";
+		return nullptr;
 	}
-	ret = libusb_claim_interface(usb_handle, 0);
-	ret = libusb_set_interface_alt_setting(usb_handle, 0, 1);
+	ret = libusb_claim_interface(handle, 0);
+	ret = libusb_set_interface_alt_setting(handle, 0, 1);
 	if (ret < 0) {
-		::MessageBox(NULL, L"USB interface not found", APP_TITLE, MB_OK);
-		return -1;
+		*error = L"USB interface not found";
+		libusb_close(handle);
+		return nullptr;
 	}
 
 	// Load firmware
-	ret = usb_load_firmware(usb_handle);
-	if(ret < 0) {
-		::MessageBox(NULL, L"Firmware downloading failed.", APP_TITLE, MB_OK);
+	ret = usb_load_firmware(handle, progress);
+	if (ret < 0) {
+		*error = L"Firmware downloading failed.";
+		libusb_release_interface(handle, 0);
+		libusb_close(handle);
+		return nullptr;
+	}
+	return handle;
+}
+
+static bool is_recorder_board(libusb_device* device)
+{
+	struct libusb_device_descriptor desc;
+
+	return (libusb_get_device_descriptor(device, &desc) == 0 && desc.idVendor == VID && desc.idProduct == PID);
+}
+
+static void handle_startup_firmware_progress(int done, int total)
+{
+	startup_firmware_progress = (float)done / total;
+}
+
+// Open all EZ-USB boards, in bus / port order
+static void open_usb_recorders(std::vector<LibusbTransport*>& transports)
+{
+	libusb_device** device_list;
+	ssize_t count = libusb_get_device_list(NULL, &device_list);
+
+	for (ssize_t index = 0; index < count; index++) {
+		if (is_recorder_board(device_list[index]) == true) {
+			startup_board_count++;
+		}
+	}
+	for (ssize_t index = 0; index < count; index++) {
+		libusb_device* device = device_list[index];
+		const wchar_t* error;
+
+		if (is_recorder_board(device) == false) {
+			continue;
+		}
+		startup_firmware_progress = 0;
+		startup_board_index++;
+		libusb_device_handle* handle = open_usb_board(device, &error, handle_startup_firmware_progress);
+		if (handle == nullptr) {
+			::MessageBox(NULL, error, APP_TITLE, MB_OK);
+			continue;
+		}
+		transports.push_back(new LibusbTransport(handle, libusb_get_bus_number(device), libusb_get_port_number(device)));
+	}
+	if (count >= 0) {
+		libusb_free_device_list(device_list, 1);
+	}
+
+	std::sort(transports.begin(), transports.end(), [](LibusbTransport* a, LibusbTransport* b) {
+		return (a->get_bus() != b->get_bus()) ? (a->get_bus() < b->get_bus()) : (a->get_port() < b->get_port());
+	});
+}
+
+// Boards back on the bus / port of a disconnected recorder get the firmware
+// and are handed to the recorder, whose command sender takes them over
+// (tape, position, sample rate and sensor are kept)
+static void reconnect_usb_recorders(void)
+{
+	bool is_waiting = false;
+
+	for (auto& view : recorders) {
+		if (view.board != nullptr && view.recorder->is_disconnected() == true) {
+			is_waiting = true;
+		}
+	}
+	if (is_waiting == false) {
+		return;
+	}
+
+	libusb_device** device_list;
+	ssize_t count = libusb_get_device_list(NULL, &device_list);
+
+	for (ssize_t index = 0; index < count; index++) {
+		libusb_device* device = device_list[index];
+
+		if (is_recorder_board(device) == false) {
+			continue;
+		}
+		for (auto& view : recorders) {
+			if (view.board == nullptr || view.recorder->is_disconnected() == false
+				|| view.board->get_bus() != libusb_get_bus_number(device)
+				|| view.board->get_port() != libusb_get_port_number(device)) {
+				continue;
+			}
+			const wchar_t* error;
+			libusb_device_handle* handle = open_usb_board(device, &error);
+			if (handle == nullptr) {
+				// retry on the next arrival / poll
+				break;
+			}
+			if (view.recorder->reconnect(handle) == false) {
+				libusb_release_interface(handle, 0);
+				libusb_close(handle);
+			}
+			break;
+		}
+	}
+	if (count >= 0) {
+		libusb_free_device_list(device_list, 1);
+	}
+}
+
+static int LIBUSB_CALL handle_usb_hotplug(libusb_context* ctx, libusb_device* device, libusb_hotplug_event event, void* user_data)
+{
+	// no blocking libusb call here (firmware download), usb_monitor_thread does it
+	is_usb_arrived = true;
+	return 0;
+}
+
+// Watches for boards coming back: libusb hotplug where supported, polling otherwise
+//  (polling also backs up hotplug, for an arrival before the disconnection is seen)
+static void run_usb_monitor(void)
+{
+	ULONGLONG prev_time = GetTickCount64();
+
+	while (usb_monitor_run_flag) {
+		if (is_usb_hotplug == true) {
+			// hotplug callbacks are called from libusb event handling
+			struct timeval tv = { 0, 100000 };
+			libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+		}
+		else {
+			::Sleep(100);
+		}
+		if (is_usb_arrived == true || (GetTickCount64() - prev_time) >= USB_POLL_INTERVAL_MS) {
+			is_usb_arrived = false;
+			prev_time = GetTickCount64();
+			reconnect_usb_recorders();
+		}
+	}
+}
+
+static void start_usb_monitor(void)
+{
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		int ret = libusb_hotplug_register_callback(NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+			VID, PID, LIBUSB_HOTPLUG_MATCH_ANY, handle_usb_hotplug, NULL, &usb_hotplug_handle);
+		is_usb_hotplug = (ret == LIBUSB_SUCCESS);
+	}
+	usb_monitor_run_flag = true;
+	std::thread monitor_thread(run_usb_monitor);
+	monitor_thread.swap(usb_monitor_thread);
+}
+
+static void stop_usb_monitor(void)
+{
+	usb_monitor_run_flag = false;
+	usb_monitor_thread.join();
+	if (is_usb_hotplug == true) {
+		libusb_hotplug_deregister_callback(NULL, usb_hotplug_handle);
+	}
+}
+
+static void run_board_startup(void)
+{
+	Trace::set_thread_name("startup");
+	Trace::begin("board startup");
+	libusb_init(NULL);
+	libusb_set_option(NULL, LIBUSB_OPTION_USE_USBDK);
+	open_usb_recorders(startup_transports);
+	Trace::end("board startup");
+	is_startup_done = true;
+}
+
+static void start_board_startup(void)
+{
+	std::thread thread(run_board_startup);
+	thread.swap(startup_thread);
+}
+
+static void log_startup_time(const char* name)
+{
+	char tmp[100];
+	double msec = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - app_start_time).count();
+
+	snprintf(tmp, sizeof(tmp), "%s: %.0f ms after start\n", name, msec);
+	::OutputDebugStringA(tmp);
+	Trace::instant(name, (int32_t)msec);
+}
+
+static void start_usb_capture(const char* file_path);
+
+// UI thread, when the boards are open (at once for simulated boards): recorders for them, and power on.
+// false if there is no board.
+static bool finish_startup(void)
+{
+	if (startup_thread.joinable() == true) {
+		startup_thread.join();
+		if (startup_transports.empty() == true) {
+			::MessageBox(h_main_window, L"EZ-USB is not connected.", APP_TITLE, MB_OK);
+			return false;
+		}
+		for (auto transport : startup_transports) {
+			recorder_view_t view = { new DataRecorder(), transport, transport, nullptr, path("NO TAPE") };
+			recorders.push_back(view);
+		}
+		startup_transports.clear();
+	}
+
+	if (usb_capture_path != nullptr) {
+		start_usb_capture(usb_capture_path);
+	}
+
+	// Init data recorders
+	for (auto& view : recorders) {
+		view.recorder->set_transport(view.transport);
+		view.recorder->set_event_callback(handle_recorder_event);
+	}
+	handle_rec_strategy_change(is_rec_bit_convert);
+	handle_mechanical_delay_change(is_mechanical_delay);
+	handle_rec_capture_change(is_rec_capture);
+	handle_rec_pll_change(is_rec_pll);
+	handle_pulse_play_change(is_pulse_play);
+	handle_fast_load_change(is_fast_load);
+	handle_thread_priority_change(thread_config);
+
+	for (auto& view : recorders) {
+		view.recorder->power_on();
+	}
+	restore_session();
+	if (recorders.front().board != nullptr) {
+		start_usb_monitor();
+	}
+	log_startup_time("ready");
+	return true;
+}
+
+// Settings (before startup) and tapes of the last run.
+// The tape is opened at its position and the PLAY data rendered ahead, the fast load scan
+// is read from the index saved by the last scan.
+static void load_settings(void)
+{
+	session.load((get_app_data_path() / "session.ini").wstring().c_str());
+	is_rec_bit_convert = session.get_bool("settings", "rec_bit_convert", is_rec_bit_convert);
+	is_mechanical_delay = session.get_bool("settings", "mechanical_delay", is_mechanical_delay);
+	is_rec_capture = session.get_bool("settings", "rec_capture", is_rec_capture);
+	is_rec_pll = session.get_bool("settings", "rec_pll", is_rec_pll);
+	is_pulse_play = session.get_bool("settings", "pulse_play", is_pulse_play);
+	is_fast_load = session.get_bool("settings", "fast_load", is_fast_load);
+	thread_config.is_realtime = session.get_bool("settings", "realtime_threads", thread_config.is_realtime);
+	thread_config.cpu = (int)session.get_int("settings", "pin_cpu", thread_config.cpu);
+}
+
+static void restore_session(void)
+{
+	path index_path = get_app_data_path() / "index";
+	std::error_code error;
+
+	std::filesystem::create_directories(index_path, error);
+	for (auto& view : recorders) {
+		view.recorder->set_index_dir(index_path.wstring().c_str());
+
+		std::string section = std::string("recorder ") + view.recorder->get_name();
+		std::string tape = session.get(section.c_str(), "tape");
+		if (tape.empty() == true || std::filesystem::exists(u8path(tape), error) == false) {
+			continue;
+		}
+		std::wstring file_name = u8path(tape).wstring();
+		// queued in order, both are ignored if the tape is not set
+		set_tape_file(view, &file_name[0]);
+		view.recorder->set_tape_position((uint64_t)session.get_int(section.c_str(), "position"));
+		view.recorder->warm_play_cache();
+	}
+}
+
+// at exit (not if the boards were never opened)
+static void save_session(void)
+{
+	session.set_bool("settings", "rec_bit_convert", is_rec_bit_convert);
+	session.set_bool("settings", "mechanical_delay", is_mechanical_delay);
+	session.set_bool("settings", "rec_capture", is_rec_capture);
+	session.set_bool("settings", "rec_pll", is_rec_pll);
+	session.set_bool("settings", "pulse_play", is_pulse_play);
+	session.set_bool("settings", "fast_load", is_fast_load);
+	session.set_bool("settings", "realtime_threads", thread_config.is_realtime);
+	session.set_int("settings", "pin_cpu", thread_config.cpu);
+	for (auto& view : recorders) {
+		std::string section = std::string("recorder ") + view.recorder->get_name();
+		if (is_tape_set(view) == true) {
+			session.set(section.c_str(), "tape", view.tape_filepath.u8string().c_str());
+			session.set_int(section.c_str(), "position", (int64_t)view.recorder->get_counter());
+		}
+		else {
+			session.set(section.c_str(), "tape", "");
+			session.set_int(section.c_str(), "position", 0);
+		}
+	}
+	session.save((get_app_data_path() / "session.ini").wstring().c_str());
+}
+
+// Wrap each board's transport to write its USB session (file_N.ext for board N if several)
+static void start_usb_capture(const char* file_path)
+{
+	for (int index = 0; index < (int)recorders.size(); index++) {
+		recorder_view_t& view = recorders[index];
+		path capture_path = u8path(file_path);
+
+		if (recorders.size() > 1) {
+			capture_path.replace_filename(capture_path.stem().u8string() + "_" + std::to_string(index + 1) + capture_path.extension().u8string());
+		}
+		CaptureTransport* capture = new CaptureTransport(view.transport);
+		if (capture->open(capture_path.wstring().c_str()) == false) {
+			// transfers just pass through
+			::MessageBox(NULL, L"The USB session file could not be created.", APP_TITLE, MB_OK);
+		}
+		view.transport = capture;
+	}
+}
+
+static void handle_replay_event(DataRecorder* recorder, uint8_t code)
+{
+	if (code == DataRecorder::EVENT_TAPE_ERROR) {
+		printf("tape could not be opened\n");
+	}
+}
+
+// Headless: replay a captured USB session, and print how it went
+//  tape_path: used instead of the tapes set in the session (REC writes to it)
+static int run_replay(const char* session_path, const char* tape_path, double speed)
+{
+	ReplayTransport* replay = new ReplayTransport();
+	FILE* fp;
+
+	if (::AttachConsole(ATTACH_PARENT_PROCESS) == TRUE) {
+		freopen_s(&fp, "CONOUT$", "w", stdout);
+	}
+	if (replay->load(u8path(session_path).wstring().c_str(), speed) == false) {
+		printf("%s: not a USB session file\n", session_path);
+		delete replay;
 		return -1;
 	}
 
-	// Init data recorder usb
-	recorder.set_usb_handle(usb_handle);
-	recorder.set_rec_strategy(is_rec_bit_convert);
+	DataRecorder* recorder = new DataRecorder();
+	recorder->set_transport(replay);
+	recorder->set_event_callback(handle_replay_event);
+	recorder->power_on();
+
+	UsbTransport::host_event_t code;
+	std::vector<uint8_t> data;
+	while (replay->wait_host_event(&code, &data) == true) {
+		switch (code) {
+		case UsbTransport::HOST_TAPE_SET:
+		{
+			std::wstring file_name;
+			if (tape_path != nullptr) {
+				file_name = u8path(tape_path).wstring();
+			}
+			else {
+				file_name.assign((const wchar_t*)data.data(), data.size() / sizeof(wchar_t));
+			}
+			if (recorder->set_tape(&file_name[0]) == false) {
+				printf("%ls: tape could not be set\n", file_name.c_str());
+			}
+			break;
+		}
+		case UsbTransport::HOST_TAPE_EJECT:
+			recorder->eject_tape();
+			break;
+		case UsbTransport::HOST_REC_STRATEGY:
+			recorder->set_rec_strategy(data.size() >= 1 && data[0] != 0);
+			break;
+		case UsbTransport::HOST_PULSE_PLAY:
+			recorder->set_pulse_play(data.size() >= 1 && data[0] != 0);
+			break;
+		case UsbTransport::HOST_REC_CAPTURE:
+			recorder->set_rec_capture(data.size() >= 1 && data[0] != 0);
+			break;
+		case UsbTransport::HOST_MECHANICAL_DELAY:
+			recorder->set_mechanical_delay((data.size() >= 2) ? (data[0] | (data[1] << 8)) : 0);
+			break;
+		case UsbTransport::HOST_REC_PLL:
+			recorder->set_rec_pll(data.size() >= 1 && data[0] != 0);
+			break;
+		case UsbTransport::HOST_FAST_LOAD:
+			recorder->set_fast_load(data.size() >= 1 && data[0] != 0);
+			break;
+		case UsbTransport::HOST_TAPE_POSITION:
+			if (data.size() >= 8) {
+				uint64_t bit_pos = 0;
+				for (int index = 7; index >= 0; index--) {
+					bit_pos = (bit_pos << 8) | data[index];
+				}
+				recorder->set_tape_position(bit_pos);
+			}
+			break;
+		default:
+			break;
+		}
+		replay->host_event_done();
+	}
+	// the last command may still be running (e.g. PLAY to the tape end)
+	for (int wait_ms = 0; recorder->is_running() == true && wait_ms < 10000; wait_ms += 10) {
+		::Sleep(10);
+	}
+	recorder->power_off();
+
+	printf("%s: %s\n", session_path, (replay->is_diverged() == true) ? "DIVERGED" : "replayed");
+	printf("  inputs          %zu / %zu\n", replay->get_replayed_count(), replay->get_input_count());
+	printf("  time            %.3f s (captured %.3f s)\n", replay->get_replay_seconds(), replay->get_captured_seconds());
+	printf("  command latency avg %.3f ms max %.3f ms (captured avg %.3f ms max %.3f ms)\n",
+		replay->get_replayed_latency_avg_ms(), replay->get_replayed_latency_max_ms(),
+		replay->get_captured_latency_avg_ms(), replay->get_captured_latency_max_ms());
+	printf("  messages        %llu / %llu bytes\n",
+		replay->get_replayed_out_bytes(UsbSession::RESPONSE_EP), replay->get_captured_out_bytes(UsbSession::RESPONSE_EP));
+	printf("  PLAY data       %llu / %llu bytes, %llu differ\n",
+		replay->get_replayed_out_bytes(UsbSession::OUT_TAPE_EP), replay->get_captured_out_bytes(UsbSession::OUT_TAPE_EP),
+		replay->get_out_mismatch(UsbSession::OUT_TAPE_EP));
+	printf("  tape counter    %llu / %llu\n", (unsigned long long)recorder->get_counter(), (unsigned long long)recorder->get_total_counter());
+
+	int result = (replay->is_diverged() == true) ? 1 : 0;
+	if (AllocationCounter::is_enabled() == true) {
+		// PLAY / REC must run on the buffers allocated before they start
+		uint64_t allocations = recorder->get_stream_allocation_count();
+		printf("  allocations     %llu while streaming%s\n", (unsigned long long)allocations, (allocations > 0) ? " (NG)" : "");
+		if (allocations > 0) {
+			result = 1;
+		}
+	}
+	delete recorder;
+	delete replay;
+	return result;
+}
+
+// Headless: decode tape images saved without bit conversion again with the PLL decoder
+//  FILE.tap -> FILE_pll.tap
+static int run_redecode(const std::vector<const char*>& files)
+{
+	FILE* fp;
+	int result = 0;
+
+	if (::AttachConsole(ATTACH_PARENT_PROCESS) == TRUE) {
+		freopen_s(&fp, "CONOUT$", "w", stdout);
+	}
+	for (auto file : files) {
+		path source = u8path(file);
+		path destination = source;
+		destination.replace_filename(source.stem().u8string() + "_pll.tap");
+
+		TapFile::redecode_result_t redecode;
+		auto start_time = std::chrono::steady_clock::now();
+		_wremove(destination.wstring().c_str());
+		if (TapFile::redecode(source.wstring().c_str(), destination.wstring().c_str(), &redecode) == false) {
+			printf("%s: could not be decoded\n", file);
+			result = 1;
+			continue;
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+		printf("%s -> %s\n", file, destination.u8string().c_str());
+		printf("  %llu bits, unit %.1f us, ambiguous %llu, unlocked %llu\n", (unsigned long long)redecode.bit_count,
+			redecode.unit_usec, (unsigned long long)redecode.ambiguous_count, (unsigned long long)redecode.unlock_count);
+		printf("  %.1f s of tape in %.3f s (%.0fx)\n", redecode.tape_seconds, seconds,
+			(seconds > 0) ? redecode.tape_seconds / seconds : 0);
+	}
+	return result;
+}
+
+// Headless: PLAY / REC throughput of the tape loops, for each standard rate
+static int run_benchmark(double seconds)
+{
+	static const int rates[][2] = {
+		{ 48000, 48000 }, { 44100, 44100 }, { 32000, 32000 }, { 22050, 44100 }, { 16000, 32000 }, { 8000, 32000 },
+	};
+	FILE* fp;
+	path work = std::filesystem::temp_directory_path() / "em8RL1_bench.tap";
+
+	if (::AttachConsole(ATTACH_PARENT_PROCESS) == TRUE) {
+		freopen_s(&fp, "CONOUT$", "w", stdout);
+	}
+	printf("%.0f s of tape, x realtime\n", seconds);
+	printf("tape / USB Hz   %11s   %11s   %11s\n", "PLAY", "REC conv.", "REC sampled");
+	for (auto& rate : rates) {
+		TapFile::benchmark_result_t result;
+		if (TapFile::benchmark(work.wstring().c_str(), rate[0], rate[1], seconds, &result) == false) {
+			printf("%s: could not be created\n", work.u8string().c_str());
+			return 1;
+		}
+		double loop_seconds[3] = { result.play_seconds, result.rec_converted_seconds, result.rec_sampled_seconds };
+		printf("%5d / %5d", rate[0], rate[1]);
+		for (double loop : loop_seconds) {
+			if (loop > 0) {
+				printf("   %11.0f", result.tape_seconds / loop);
+			}
+			else {
+				printf("   %11s", "-");
+			}
+		}
+		printf("\n");
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	int simulate_count = 0;
+	const char* replay_path = nullptr;
+	const char* replay_tape_path = nullptr;
+	double replay_speed = 0;
+	std::vector<const char*> redecode_files;
+	double benchmark_seconds = 0;
+
+	app_start_time = std::chrono::steady_clock::now();
+	setlocale(LC_CTYPE, ".UTF8");
+	Trace::set_thread_name("ui");
+
+	// --simulate N : N simulated boards instead of EZ-USB
+	// --capture FILE : write the USB session of each board
+	// --replay FILE [--tape FILE] [--speed N] : replay a USB session without GUI (speed 0: as fast as possible)
+	// --redecode FILE... : decode tape images with the PLL decoder without GUI
+	// --bench [SECONDS] : PLAY / REC throughput of the tape pipelines without GUI (60 s of tape by default)
+	for (int index = 1; index < argc; index++) {
+		if (strcmp(argv[index], "--simulate") == 0 && index + 1 < argc) {
+			simulate_count = atoi(argv[++index]);
+		}
+		else if (strcmp(argv[index], "--capture") == 0 && index + 1 < argc) {
+			usb_capture_path = argv[++index];
+		}
+		else if (strcmp(argv[index], "--replay") == 0 && index + 1 < argc) {
+			replay_path = argv[++index];
+		}
+		else if (strcmp(argv[index], "--tape") == 0 && index + 1 < argc) {
+			replay_tape_path = argv[++index];
+		}
+		else if (strcmp(argv[index], "--speed") == 0 && index + 1 < argc) {
+			replay_speed = atof(argv[++index]);
+		}
+		else if (strcmp(argv[index], "--redecode") == 0) {
+			while (index + 1 < argc && strncmp(argv[index + 1], "--", 2) != 0) {
+				redecode_files.push_back(argv[++index]);
+			}
+		}
+		else if (strcmp(argv[index], "--bench") == 0) {
+			benchmark_seconds = 60;
+			if (index + 1 < argc && strncmp(argv[index + 1], "--", 2) != 0) {
+				benchmark_seconds = atof(argv[++index]);
+			}
+		}
+	}
+
+	if (replay_path != nullptr) {
+		return run_replay(replay_path, replay_tape_path, replay_speed);
+	}
+	if (redecode_files.empty() == false) {
+		return run_redecode(redecode_files);
+	}
+	if (benchmark_seconds > 0) {
+		return run_benchmark(benchmark_seconds);
+	}
+	load_settings();
 
-	recorder.power_on();
+	if (simulate_count > 0) {
+		for (int index = 0; index < simulate_count; index++) {
+			recorder_view_t view = { new DataRecorder(), nullptr, nullptr, new SimulatedTransport(index + 1), path("NO TAPE") };
+			view.transport = view.simulator;
+			recorders.push_back(view);
+		}
+		is_startup_done = true;
+	}
+	else {
+		// the window is shown while the firmware is loaded
+		start_board_startup();
+	}
 
 	// Start GUI
 	draw_run(NULL);
@@ -341,6 +1373,24 @@ int main(int argc, char* argv[]) {
 }
 
 void finalize() {
-	recorder.power_off();
-	libusb_close(usb_handle);
+	if (startup_thread.joinable() == true) {
+		// closed while the boards were opened
+		startup_thread.join();
+		for (auto transport : startup_transports) {
+			delete transport;
+		}
+		startup_transports.clear();
+	}
+	if (usb_monitor_thread.joinable() == true) {
+		stop_usb_monitor();
+	}
+	if (is_startup_applied == true && recorders.empty() == false) {
+		save_session();
+	}
+	for (auto& view : recorders) {
+		view.recorder->power_off();
+		delete view.recorder;
+		delete view.transport;
+	}
+	recorders.clear();
 }
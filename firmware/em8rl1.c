@@ -20,8 +20,30 @@ typedef enum
     PC_STATUS_CHANGE,
     PC_REQUEST,
     PC_USB_RATE_CHANGE,
+    PC_TAPE_STOP,
+    PC_REC_MODE_CHANGE,
+    PC_PLAY_MODE_CHANGE,
 } pc_response_t;
 
+typedef enum
+{
+    PLAY_MODE_SAMPLED = 0, // 1 bit per sample at usb_sample_rate
+    PLAY_MODE_PULSE = 1,   // (level, duration) per run, see PULSE_RETRY_COUNT
+} play_mode_t;
+
+typedef enum
+{
+    REC_MODE_SAMPLED = 0, // 1 bit per sample at usb_sample_rate
+    REC_MODE_CAPTURE = 1, // (level, duration) per pulse, see CAPTURE_TICK_RELOAD
+} rec_mode_t;
+
+typedef enum
+{
+    NOTIFY_TIMER_STOPPED = 0xf0,
+    NOTIFY_EP6_FLUSHED = 0xf1,
+    NOTIFY_BUFFER_STATS = 0xf2, // + underrun_count, overrun_count, dropped_count (LSB first)
+} pc_notify_t;
+
 typedef enum
 {
     COM_STATE_WAIT_LEADER,
@@ -29,6 +51,17 @@ typedef enum
     COM_STATE_IN_BITS,
 } command_state_t;
 
+typedef enum
+{
+    RESPONSE_STATE_IDLE,
+    RESPONSE_STATE_WAIT_STROBE,
+    RESPONSE_STATE_BUSY,
+    RESPONSE_STATE_PRE_LEADER,
+    RESPONSE_STATE_LEADER,
+    RESPONSE_STATE_BIT_HIGH,
+    RESPONSE_STATE_BIT_LOW,
+} response_state_t;
+
 typedef enum
 {
     COM_EJECT = 0x00,
@@ -43,14 +76,6 @@ typedef enum
     COM_SENSOR = 0x81,
 } cas_command_t;
 
-typedef enum
-{
-    TAPE_SAMPLE_48K = 0,
-    TAPE_SAMPLE_44K = 1,
-    TAPE_SAMPLE_44K_ALT1 = 2,
-    TAPE_SAMPLE_32K = 3,
-} tape_sample_rate_t;
-
 #define SENSOR_TAPE_RUN 0x1
 #define SENSOR_TAPE_SET 0x2
 #define SENSOR_WRITE_PROT 0x4
@@ -63,7 +88,7 @@ typedef enum
 volatile uint8_t tape_mode = TAPE_MODE_STOP;
 volatile uint8_t bit_index = 0;
 volatile uint8_t tape_value = 0;
-volatile uint8_t tape_counter;
+volatile uint16_t tape_counter;
 volatile uint8_t is_tape_sample_timer_enabled = 0;
 volatile command_state_t command_state;
 
@@ -73,12 +98,74 @@ uint8_t command_task;
 
 uint8_t cached_status;
 uint8_t cached_sensor;
-uint8_t usb_sample_rate;
+uint16_t usb_sample_rate;
+
+// Sample clock: Timer0 reload alternates between period and period+1
+// by a phase accumulator, so the average rate is exactly usb_sample_rate
+//   clock / usb_sample_rate = period + (usb_sample_rate - sample_phase_wrap) / usb_sample_rate
+#define SAMPLE_RATE_MIN 15625 // 4MHz / 256
+#define SAMPLE_RATE_MAX 48000
+#define SAMPLE_RATE_12M 46875 // 12MHz / 256
+
+uint8_t sample_ckcon;
+uint8_t sample_reload;
+uint16_t sample_frac;
+uint16_t sample_phase_wrap;
+volatile uint16_t sample_phase;
+uint8_t rec_mode;
+
+// Edge capture: PA0 is checked every 10usec (4MHz / 40 = 100kHz) and each
+// level run is sent as one byte  bit7: level, bit6:0: duration in ticks.
+// Runs longer than CAPTURE_TICKS_MAX continue with the same level.
+// Polled, not timestamped by an edge interrupt: PA0 as INT0# interrupts on the falling edge only
+// and the board has no timer capture input, but the runs of both levels are needed.
+// The Timer0 ISR is short (about a quarter of the CPU at 100kHz), EP1 / Timer2 still get their turn.
+// USB data: 8kB/s in leaders (125usec runs, 48kHz sampling is 6kB/s), about 5kB/s in X1 data,
+// 0.8kB/s in blanks (a record per 1.27msec).
+#define CAPTURE_TICK_RELOAD 40
+#define CAPTURE_TICKS_MAX 0x7f
+
+volatile uint8_t capture_level;
+volatile uint8_t capture_ticks;
+
+uint8_t play_mode;
+
+// Pulse playback: each run is 2 bytes (MSB first)  bit15: level,
+// bit14:0: duration in Timer0 counts (CLKOUT/12 = 4MHz, 0.25usec).
+// Timer0 runs in 16bit mode and is reloaded for every run.
+#define PULSE_RETRY_COUNT 64 // wait 16usec when EP2 is empty
+#define PULSE_RELOAD_ADJUST 8 // counts lost while Timer0 is stopped for reload
+#define PULSE_MIN_COUNT 32 // shortest reload (8usec), a shorter run would wrap Timer0 (16msec)
 
 #define US_TO_50US_COUNT(us) ((us) / 50)
 
 volatile uint8_t S0us_count;
 
+// Buffer events since power on (wrap around, PC takes the difference)
+//  underrun: PLAY sample time came with no EP2 data
+//  overrun: REC data dropped because EP6 was full
+//  dropped: REC samples (sampled) or runs (capture) lost in overruns
+volatile uint16_t underrun_count;
+volatile uint16_t overrun_count;
+volatile uint16_t dropped_count;
+volatile uint8_t is_underrun;
+volatile uint8_t is_overrun;
+uint16_t reported_underrun_count;
+uint16_t reported_overrun_count;
+uint16_t reported_dropped_count;
+
+#define REC_PACKET_SIZE 512 // EP6 wMaxPacketSize (high speed)
+
+#define RESPONSE_QUEUE_SIZE 4 // power of 2
+
+volatile uint8_t response_queue[RESPONSE_QUEUE_SIZE];
+volatile uint8_t response_queue_head;
+volatile uint8_t response_queue_tail;
+volatile response_state_t response_state = RESPONSE_STATE_IDLE;
+volatile uint16_t response_wait;
+uint8_t response_byte;
+uint8_t response_bit_count;
+
 void GpifInit(void);
 
 void initialize()
@@ -130,13 +217,14 @@ void initialize()
     SYNCDELAY;
     EP1INCFG = 0xa0; // Valid, Bulk-IN
     SYNCDELAY;
-    EP2CFG &= 0x7f; // disable
+    // EP4/EP8 can not be quad buffered, their FIFO RAM goes to EP2/EP6
+    EP2CFG = 0xa0; // 0b1010_0000; Bulk-OUT, 512bytes Quad buffer
     SYNCDELAY;
-    EP4CFG &= 0xa2; // Bulk-OUT, 512 byte, Double buffer
+    EP4CFG &= 0x7f; // disable
     SYNCDELAY;
-    EP6CFG = 0xe2; // 0b1110_0010; Bulk-IN, 512bytes Double buffer
+    EP6CFG = 0xe0; // 0b1110_0000; Bulk-IN, 512bytes Quad buffer
     SYNCDELAY;
-    EP8CFG &= 0x7f; // Bluk-OUT, 512bytes, Double buffer
+    EP8CFG &= 0x7f; // disable
     SYNCDELAY;
 
     // ----------------------------------------------------------------------
@@ -150,9 +238,15 @@ void initialize()
     EP1OUTBC = 0x1; // Any value enables EP1 transfer
     SYNCDELAY;
     // ----------------------------------------------------------------------
-    // Start EP4
+    // Start EP2 (arm all 4 buffers)
     // ----------------------------------------------------------------------
-    EP4BCL = 0x1; // Any value enables EP4 transfer
+    OUTPKTEND = 0x82; // skip
+    SYNCDELAY;
+    OUTPKTEND = 0x82;
+    SYNCDELAY;
+    OUTPKTEND = 0x82;
+    SYNCDELAY;
+    OUTPKTEND = 0x82;
     SYNCDELAY;
 
     // ----------------------------------------------------------------------
@@ -189,6 +283,10 @@ void initialize()
     // ----------------------------------------------------------------------
     TMOD = 0x22;  // GATE1=0, CT1 =0, T1: Mode2,  GATE0=0 , C/T0=0 (CLKOUT Source), Mode2: 8bit with autoload
     CKCON = 0x08; //  TM1: CLKOUT/12(4MHz)  TM0: CLKOUT/4 (12MHz)
+
+    T2CON = 0x00;                  // Timer2: 16bit auto-reload, CLKOUT/12 (4MHz)
+    RCAP2L = LSB(65536 - 200);      // 200count / 4MHz = 50usec
+    RCAP2H = MSB(65536 - 200);
 }
 
 void start_tape_sample_timer(void)
@@ -198,6 +296,8 @@ void start_tape_sample_timer(void)
         is_tape_sample_timer_enabled = 1;
         tape_counter = 0;
         bit_index = 0;
+        is_underrun = 1; // EP2 is empty until PC sends the first packet
+        is_overrun = 0;
 
         if (tape_mode == TAPE_MODE_REC)
         {
@@ -206,90 +306,234 @@ void start_tape_sample_timer(void)
         }
         else if (tape_mode == TAPE_MODE_PLAY)
         {
-            AUTOPTRH2 = MSB(&EP4FIFOBUF);
-            AUTOPTRL2 = LSB(&EP4FIFOBUF);
+            AUTOPTRH2 = MSB(&EP2FIFOBUF);
+            AUTOPTRL2 = LSB(&EP2FIFOBUF);
         }
 
-        if (usb_sample_rate == TAPE_SAMPLE_48K)
-        {
-            CKCON = 0x08;                     //  TM1: CLKOUT/12(4MHz)  TM0: CLKOUT/4 (12MHz)
-            TL0 = (unsigned char)(256 - 250); // 12M / 250 = 48kHz
-            TH0 = (unsigned char)(256 - 250);
-        }
-        else if (usb_sample_rate == TAPE_SAMPLE_44K)
+        TMOD = (TMOD & 0xf0) | 0x02; // T0: Mode2, 8bit with autoload
+
+        if (tape_mode == TAPE_MODE_PLAY && play_mode == PLAY_MODE_PULSE)
         {
-            CKCON = 0x00;                    //  TM1: CLKOUT/12(4MHz)  TM0: CLKOUT/12 (4MHz)
-            TL0 = (unsigned char)(256 - 90); // 4M / 90 = 44.444kHz
-            TH0 = (unsigned char)(256 - 90);
+            CKCON = 0x00;               //  TM1: CLKOUT/12(4MHz)  TM0: CLKOUT/12 (4MHz)
+            TMOD = (TMOD & 0xf0) | 0x01; // T0: Mode1, 16bit
+            TL0 = LSB(65536 - PULSE_RETRY_COUNT);
+            TH0 = MSB(65536 - PULSE_RETRY_COUNT);
         }
-        else if(usb_sample_rate == TAPE_SAMPLE_44K_ALT1)
+        else if (tape_mode == TAPE_MODE_REC && rec_mode == REC_MODE_CAPTURE)
         {
-            // another 44kHz
-            CKCON = 0x00;                    //  TM1: CLKOUT/12(4MHz)  TM0: CLKOUT/12 (4MHz)
-            TL0 = (unsigned char)(256 - 91); // 4M / 91 = 43.956kHz
-            TH0 = (unsigned char)(256 - 91);
+            capture_level = IOA & 0x01;
+            capture_ticks = 0;
+            CKCON = 0x00;                                     //  TM1: CLKOUT/12(4MHz)  TM0: CLKOUT/12 (4MHz)
+            TL0 = (unsigned char)(256 - CAPTURE_TICK_RELOAD); // 4M / 40 = 100kHz
+            TH0 = (unsigned char)(256 - CAPTURE_TICK_RELOAD);
         }
-        else if(usb_sample_rate == TAPE_SAMPLE_32K)
+        else
         {
-            CKCON = 0x00;                    //  TM1: CLKOUT/12(4MHz)  TM0: CLKOUT/12 (4MHz)
-            TL0 = (unsigned char)(256 - 125); // 4M / 125 = 32kHz
-            TH0 = (unsigned char)(256 - 125);
+            CKCON = sample_ckcon;
+            TL0 = sample_reload;
+            TH0 = sample_reload;
+            sample_phase = 0;
         }
         TCON |= 0x10; // TR0=1 : start Timer0
     }
 }
 
+void set_usb_sample_rate(uint16_t rate)
+{
+    uint32_t clock;
+    uint16_t period;
+
+    if (rate < SAMPLE_RATE_MIN)
+    {
+        rate = SAMPLE_RATE_MIN;
+    }
+    if (rate > SAMPLE_RATE_MAX)
+    {
+        rate = SAMPLE_RATE_MAX;
+    }
+
+    if (rate >= SAMPLE_RATE_12M)
+    {
+        sample_ckcon = 0x08; //  TM1: CLKOUT/12(4MHz)  TM0: CLKOUT/4 (12MHz)
+        clock = 12000000;
+    }
+    else
+    {
+        sample_ckcon = 0x00; //  TM1: CLKOUT/12(4MHz)  TM0: CLKOUT/12 (4MHz)
+        clock = 4000000;
+    }
+    period = clock / rate; // e.g. 4M / 44100 = 90 (+ 30/44100)
+    sample_frac = clock % rate;
+    sample_phase_wrap = rate - sample_frac;
+    sample_reload = (unsigned char)(256 - period);
+    usb_sample_rate = rate;
+}
+
+inline void next_sample_period(void)
+{
+    // Timer0 (Mode2) loads TH0 on the next overflow
+    if (sample_phase >= sample_phase_wrap)
+    {
+        sample_phase -= sample_phase_wrap;
+        TH0 = sample_reload - 1; // period + 1
+    }
+    else
+    {
+        sample_phase += sample_frac;
+        TH0 = sample_reload;
+    }
+}
+
 void stop_tape_sample_timer(void)
 {
-    TCON &= ~(0x10); // TR0=0 : stop Timer0
+    TCON &= ~(0x30); // TR0=0 : stop Timer0, TF0=0 : drop pending overflow
     is_tape_sample_timer_enabled = 0;
 }
 
+// REC data is committed in full packets. EP6 is CPU-fed (no slave FIFO),
+// so AUTOIN is not available and the packet is committed by EP6BCH:L.
+// EP6 buffer is checked at the start of a packet only; once started, it is ours.
+inline void put_rec_byte(uint8_t value)
+{
+    if (tape_counter == 0)
+    {
+        if (EP2468STAT & bmEP6FULL)
+        {
+            if (!is_overrun)
+            {
+                is_overrun = 1;
+                overrun_count++;
+            }
+            dropped_count += (rec_mode == REC_MODE_CAPTURE) ? 1 : 8;
+            return;
+        }
+        is_overrun = 0;
+    }
+
+    EXTAUTODAT2 = value;
+    tape_counter++;
+    if (tape_counter == REC_PACKET_SIZE)
+    {
+        EP6BCH = MSB(REC_PACKET_SIZE);
+        SYNCDELAY;
+        EP6BCL = LSB(REC_PACKET_SIZE);
+        SYNCDELAY;
+        AUTOPTRH2 = MSB(&EP6FIFOBUF);
+        AUTOPTRL2 = LSB(&EP6FIFOBUF);
+        tape_counter = 0;
+    }
+}
+
+// Count a PLAY underrun once per empty period
+inline void set_underrun(void)
+{
+    if (!is_underrun)
+    {
+        is_underrun = 1;
+        underrun_count++;
+    }
+}
+
+// End of the EP2 packet being played: the 16bit byte count, the host packets are not limited to 255 bytes
+inline uint8_t is_play_packet_end(void)
+{
+    return tape_counter == (((uint16_t)EP2BCH << 8) | EP2BCL);
+}
+
 void tape_sample_timer_overflow_int(void) __interrupt(1)
 {
     if (tape_mode == TAPE_MODE_REC)
     {
+        if (rec_mode == REC_MODE_CAPTURE)
+        {
+            uint8_t level = IOA & 0x01;
+
+            capture_ticks++;
+            if (level != capture_level)
+            {
+                put_rec_byte((capture_level << 7) | capture_ticks);
+                capture_level = level;
+                capture_ticks = 0;
+            }
+            else if (capture_ticks == CAPTURE_TICKS_MAX)
+            {
+                put_rec_byte((capture_level << 7) | capture_ticks);
+                capture_ticks = 0;
+            }
+            return;
+        }
+
+        if (sample_frac != 0)
+        {
+            next_sample_period();
+        }
         tape_value <<= 1;
         tape_value |= IOA & 0x01;
         bit_index++;
         if (bit_index == 8)
         {
-            if (!(EP2468STAT & bmEP6FULL))
-            {
-                //*current_tape_out = value;
-                EXTAUTODAT2 = tape_value;
-                // current_tape_out++;
-                tape_counter++;
-                if (tape_counter >= 128)
-                {
-                    EP6BCH = 0;
-                    SYNCDELAY;
-                    SYNCDELAY;
-                    EP6BCL = tape_counter;
-                    SYNCDELAY;
-                    // current_tape_out = EP6FIFOBUF;
-                    AUTOPTRH2 = MSB(&EP6FIFOBUF);
-                    AUTOPTRL2 = LSB(&EP6FIFOBUF);
-                    tape_counter = 0;
-                }
-            }
+            put_rec_byte(tape_value);
             bit_index = 0;
             tape_value = 0;
         }
     }
+    else if (tape_mode == TAPE_MODE_PLAY && play_mode == PLAY_MODE_PULSE)
+    { // LOAD (pulse)
+        uint16_t count;
+        uint16_t duration;
+        uint8_t level_duration;
+
+        TCON &= ~(0x10); // TR0=0 : stop Timer0 for reload
+        count = (((uint16_t)TH0 << 8) | TL0) + PULSE_RELOAD_ADJUST; // counts since overflow
+        if (EP2468STAT & bmEP2EMPTY)
+        {
+            // hold the current level and retry
+            duration = PULSE_RETRY_COUNT;
+            set_underrun();
+        }
+        else
+        {
+            is_underrun = 0;
+            level_duration = EXTAUTODAT2;
+            duration = (((uint16_t)level_duration & 0x7f) << 8) | EXTAUTODAT2;
+            IOD = level_duration >> 7;
+            tape_counter += 2;
+            if (is_play_packet_end())
+            {
+                AUTOPTRH2 = MSB(&EP2FIFOBUF);
+                AUTOPTRL2 = LSB(&EP2FIFOBUF);
+                EP2BCL = 0; // arm EP2
+                tape_counter = 0;
+            }
+        }
+        if (duration < count + PULSE_MIN_COUNT)
+        {
+            // already late: the run as short as possible
+            duration = count + PULSE_MIN_COUNT;
+        }
+        count = count - duration;
+        TL0 = LSB(count);
+        TH0 = MSB(count);
+        TCON |= 0x10; // TR0=1 : start Timer0
+    }
     else if (tape_mode == TAPE_MODE_PLAY)
     { // LOAD
-        if (!(EP2468STAT & bmEP4EMPTY))
+        if (sample_frac != 0)
         {
+            next_sample_period();
+        }
+        if (!(EP2468STAT & bmEP2EMPTY))
+        {
+            is_underrun = 0;
             if (bit_index == 0)
             {
                 tape_value = EXTAUTODAT2;
                 tape_counter++;
-                if (tape_counter == EP4BCL)
+                if (is_play_packet_end())
                 {
-                    AUTOPTRH2 = MSB(&EP4FIFOBUF);
-                    AUTOPTRL2 = LSB(&EP4FIFOBUF);
-                    EP4BCL = 0; // arm EP4
+                    AUTOPTRH2 = MSB(&EP2FIFOBUF);
+                    AUTOPTRL2 = LSB(&EP2FIFOBUF);
+                    EP2BCL = 0; // arm EP2
                     tape_counter = 0;
                 }
             }
@@ -301,14 +545,9 @@ void tape_sample_timer_overflow_int(void) __interrupt(1)
                 bit_index = 0;
             }
         }
-    }
-    else
-    {
-        if (!(EP2468STAT & bmEP4EMPTY))
+        else
         {
-            // just discard OUT packets from PC
-            EP4BCL = 0x00; // clear state
-            SYNCDELAY;
+            set_underrun();
         }
     }
 }
@@ -331,87 +570,147 @@ inline void stop_50us_timer(void)
     TCON &= ~(0x40); // TR1=0 : stop Timer0
 }
 
-void send_response_bit(uint8_t bit)
+// ----------------------------------------------------------------------
+// Response transmitter (to X1)
+//  Timer2 ticks every 50usec and drives the STATUS line, so the main loop
+//  keeps servicing USB and X1 commands while a response is sent.
+// ----------------------------------------------------------------------
+inline void start_response_timer(void)
 {
-    uint8_t wait_time;
+    TL2 = RCAP2L;
+    TH2 = RCAP2H;
+    T2CON |= 0x04; // TR2=1 : start Timer2
+}
+
+inline void stop_response_timer(void)
+{
+    T2CON &= ~(0x84); // TR2=0 : stop Timer2, TF2=0
+}
 
+// called with Timer2 interrupt disabled or from Timer2 interrupt
+void start_next_response(void)
+{
+    if (response_queue_tail == response_queue_head)
+    {
+        response_state = RESPONSE_STATE_IDLE;
+        stop_response_timer();
+        return;
+    }
+    response_byte = response_queue[response_queue_tail];
+    response_queue_tail = (response_queue_tail + 1) & (RESPONSE_QUEUE_SIZE - 1);
+    response_bit_count = 0;
+
+    IOA |= IO_BUSY;
+    response_wait = US_TO_50US_COUNT(1000000); // wait for STROBE 1sec
+    response_state = RESPONSE_STATE_WAIT_STROBE;
+}
+
+inline void start_response_bit(void)
+{
     IOA |= IO_STATUS;
-    if (bit)
+    if (response_byte & 0x80)
     {
-        wait_time = US_TO_50US_COUNT(750);
+        response_wait = US_TO_50US_COUNT(750);
     }
     else
     {
-        wait_time = US_TO_50US_COUNT(250);
+        response_wait = US_TO_50US_COUNT(250);
     }
-    start_50us_timer();
-    while (S0us_count < wait_time)
-        ;
-    IOA &= ~(IO_STATUS);
-    stop_50us_timer();
-    start_50us_timer();
-    while (S0us_count < US_TO_50US_COUNT(250))
-        ;
-    stop_50us_timer();
+    response_state = RESPONSE_STATE_BIT_HIGH;
 }
 
-inline int wait_strobe(void)
+void response_timer_int(void) __interrupt(5)
 {
-    uint16_t index;
+    T2CON &= ~(0x80); // TF2=0
 
-    // wait for 1sec
-    for (index = 0; index < 1000; index++)
+    if (response_state == RESPONSE_STATE_WAIT_STROBE)
     {
-        start_50us_timer();
-        while (S0us_count < US_TO_50US_COUNT(1000))
+        if (IOA & IO_STROBE)
         {
-            if (IOA & IO_STROBE)
-            {
-                stop_50us_timer();
-                return 0;
-            }
+            response_wait = US_TO_50US_COUNT(1000); // wait 1msec
+            response_state = RESPONSE_STATE_BUSY;
         }
-        stop_50us_timer();
+        else if (--response_wait == 0)
+        {
+            // X1 did not ask for the response
+            IOA &= ~(IO_BUSY);
+            start_next_response();
+        }
+        return;
     }
 
-    return -1;
-}
-
-void send_response(uint8_t response)
-{
-    uint8_t index;
-
-    IOA |= IO_BUSY;
+    if (--response_wait != 0)
+    {
+        return;
+    }
 
-    if (wait_strobe() < 0)
+    switch (response_state)
     {
+    case RESPONSE_STATE_BUSY:
         IOA &= ~(IO_BUSY);
-        return;
+        response_wait = US_TO_50US_COUNT(400); // wait 400usec
+        response_state = RESPONSE_STATE_PRE_LEADER;
+        break;
+
+    case RESPONSE_STATE_PRE_LEADER:
+        // send leader part
+        IOA &= ~(IO_STATUS);
+        response_wait = US_TO_50US_COUNT(1000); // wait 1msec
+        response_state = RESPONSE_STATE_LEADER;
+        break;
+
+    case RESPONSE_STATE_LEADER:
+        start_response_bit();
+        break;
+
+    case RESPONSE_STATE_BIT_HIGH:
+        IOA &= ~(IO_STATUS);
+        response_wait = US_TO_50US_COUNT(250);
+        response_state = RESPONSE_STATE_BIT_LOW;
+        break;
+
+    case RESPONSE_STATE_BIT_LOW:
+        response_byte <<= 1;
+        response_bit_count++;
+        if (response_bit_count < 8)
+        {
+            start_response_bit();
+        }
+        else
+        {
+            IOA |= IO_STATUS;
+            start_next_response();
+        }
+        break;
+
+    default:
+        start_next_response();
+        break;
     }
-    start_50us_timer();
-    while (S0us_count < US_TO_50US_COUNT(1000))
-        ; // wait 1msec
-    stop_50us_timer();
-    IOA &= ~(IO_BUSY);
-    start_50us_timer();
-    while (S0us_count < US_TO_50US_COUNT(400))
-        ; // wait 400usec
-    stop_50us_timer();
+}
 
-    // send leader part
-    IOA &= ~(IO_STATUS);
-    start_50us_timer();
-    while (S0us_count < US_TO_50US_COUNT(1000))
-        ; //  wait 1msec
-    stop_50us_timer();
+inline uint8_t is_response_queue_full(void)
+{
+    return ((response_queue_head + 1) & (RESPONSE_QUEUE_SIZE - 1)) == response_queue_tail;
+}
+
+// waits while the queue is full (Timer2 frees an entry, at most 1sec for X1 to STROBE)
+void send_response(uint8_t response)
+{
+    uint8_t next_head = (response_queue_head + 1) & (RESPONSE_QUEUE_SIZE - 1);
 
-    // send status byte
-    for (index = 0; index < 8; index++)
+    while (next_head == response_queue_tail)
+        ;
+    response_queue[response_queue_head] = response;
+
+    IE &= ~(0x20); // ET2=0
+    response_queue_head = next_head;
+    if (response_state == RESPONSE_STATE_IDLE)
     {
-        send_response_bit(response & 0x80);
-        response <<= 1;
+        start_next_response();
+        start_response_timer();
     }
-    IOA |= IO_STATUS;
+    IE |= 0x20; // ET2=1
 }
 
 inline int wait_EP1_ready(void)
@@ -442,6 +741,116 @@ inline void send_pc_command(uint8_t command)
     EP1INBC = 1; // Start IN transfer
 }
 
+inline int wait_EP6_empty(void)
+{
+    uint16_t index;
+
+    // wait for 1sec
+    for (index = 0; index < 1000; index++)
+    {
+        start_50us_timer();
+        while (S0us_count < US_TO_50US_COUNT(1000))
+        {
+            if (EP2468STAT & bmEP6EMPTY)
+            {
+                stop_50us_timer();
+                return 0;
+            }
+        }
+        stop_50us_timer();
+    }
+    return -1;
+}
+
+// Send underrun/overrun counts when they have changed
+//  called only when EP1 IN is free
+//  16bit counters are updated in ISR: read each until two reads agree,
+//  so interrupts are never masked on this idle path
+void send_buffer_stats(void)
+{
+    uint16_t underruns;
+    uint16_t overruns;
+    uint16_t dropped;
+
+    do
+    {
+        underruns = underrun_count;
+    } while (underruns != underrun_count);
+    do
+    {
+        overruns = overrun_count;
+    } while (overruns != overrun_count);
+    do
+    {
+        dropped = dropped_count;
+    } while (dropped != dropped_count);
+
+    if (underruns == reported_underrun_count && overruns == reported_overrun_count && dropped == reported_dropped_count)
+    {
+        return;
+    }
+    reported_underrun_count = underruns;
+    reported_overrun_count = overruns;
+    reported_dropped_count = dropped;
+
+    EP1INBUF[0] = NOTIFY_BUFFER_STATS;
+    EP1INBUF[1] = LSB(underruns);
+    EP1INBUF[2] = MSB(underruns);
+    EP1INBUF[3] = LSB(overruns);
+    EP1INBUF[4] = MSB(overruns);
+    EP1INBUF[5] = LSB(dropped);
+    EP1INBUF[6] = MSB(dropped);
+    EP1INBC = 7; // Start IN transfer
+}
+
+// Stop sampling and tell PC when it is safe to go on
+//  NOTIFY_TIMER_STOPPED: no more samples are taken / shifted out
+//  NOTIFY_EP6_FLUSHED: all REC data has been read by PC
+void stop_tape(void)
+{
+    uint8_t prev_mode = tape_mode;
+
+    stop_tape_sample_timer();
+    tape_mode = TAPE_MODE_STOP;
+
+    if (prev_mode == TAPE_MODE_PLAY)
+    {
+        if (!(EP2468STAT & bmEP2EMPTY))
+        {
+            // discard the rest of the current OUT packet
+            EP2BCL = 0x00;
+            SYNCDELAY;
+        }
+    }
+    send_pc_command(NOTIFY_TIMER_STOPPED);
+
+    if (prev_mode == TAPE_MODE_REC)
+    {
+        if (rec_mode == REC_MODE_CAPTURE)
+        {
+            if (capture_ticks != 0)
+            {
+                put_rec_byte((capture_level << 7) | capture_ticks);
+            }
+        }
+        else if (bit_index != 0)
+        {
+            put_rec_byte(tape_value);
+        }
+        // Short packet ends the pending IN transfer on PC,
+        // zero length one if the last packet was full
+        if (tape_counter != 0 || !(EP2468STAT & bmEP6FULL))
+        {
+            EP6BCH = MSB(tape_counter);
+            SYNCDELAY;
+            EP6BCL = LSB(tape_counter);
+            SYNCDELAY;
+        }
+    }
+    wait_EP6_empty();
+    send_pc_command(NOTIFY_EP6_FLUSHED);
+}
+
 void command_received(uint8_t command)
 {
     uint8_t response = command;
@@ -494,25 +903,11 @@ void command_received(uint8_t command)
                     ; //  wait 1msec
                 stop_50us_timer();
             }
-            stop_tape_sample_timer();
-            if (bit_index != 0)
-            {
-                EXTAUTODAT2 = tape_value;
-                tape_counter++;
-            }
-            if (tape_counter != 0)
-            {
-                EP6BCH = 0;
-                SYNCDELAY;
-                EP6BCL = tape_counter;
-                SYNCDELAY;
-            }
         }
-        else
+        if (tape_mode != TAPE_MODE_STOP)
         {
-            //
+            stop_tape();
         }
-        tape_mode = TAPE_MODE_STOP;
     }
 
     return;
@@ -586,6 +981,12 @@ void process_usb_command(void)
     uint8_t *src = EP1OUTBUF;
     uint8_t len = EP1OUTBC;
 
+    if (*src == PC_REQUEST && is_response_queue_full())
+    {
+        // keep the packet until X1 has taken a response: EP1 OUT is not armed,
+        // so the PC's next OUT transfer NAKs
+        return;
+    }
     switch (*(src++))
     {
     case PC_SENSOR_CHANGE:
@@ -601,8 +1002,27 @@ void process_usb_command(void)
         break;
 
     case PC_USB_RATE_CHANGE:
+        // sample rate in Hz (LSB first)
         stop_tape_sample_timer();
-        usb_sample_rate = *src;
+        set_usb_sample_rate(src[0] | ((uint16_t)src[1] << 8));
+        break;
+
+    case PC_TAPE_STOP:
+        stop_tape();
+        break;
+
+    case PC_REC_MODE_CHANGE:
+        if (tape_mode != TAPE_MODE_REC)
+        {
+            rec_mode = *src;
+        }
+        break;
+
+    case PC_PLAY_MODE_CHANGE:
+        if (tape_mode != TAPE_MODE_PLAY)
+        {
+            play_mode = *src;
+        }
         break;
     }
     EP1OUTBC = 0x01;
@@ -615,10 +1035,12 @@ void main()
     init_command_task();
     cached_sensor = 0x80;
     cached_status = 0x80;
-    usb_sample_rate = TAPE_SAMPLE_48K;
+    set_usb_sample_rate(48000);
+    rec_mode = REC_MODE_SAMPLED;
+    play_mode = PLAY_MODE_SAMPLED;
 
     IOA |= IO_STATUS; // BUSY=L, STATUS=H
-    IE = 0x8F;        // Enable global interrupt, Enable Timer1, Timer0, INT0, INT1
+    IE = 0xAF;        // Enable global interrupt, Enable Timer2, Timer1, Timer0, INT0, INT1
 
     // start GPIF (COMMAND line polling)
     XGPIFSGLDATLX = 0x01;
@@ -634,5 +1056,15 @@ void main()
         {
             process_usb_command();
         }
+        if (tape_mode == TAPE_MODE_STOP && !(EP2468STAT & bmEP2EMPTY))
+        {
+            // just discard OUT packets from PC
+            EP2BCL = 0x00; // clear state
+            SYNCDELAY;
+        }
+        if (!(EP1INCS & bmEPBUSY))
+        {
+            send_buffer_stats();
+        }
     }
 }
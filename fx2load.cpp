@@ -30,8 +30,13 @@ int usb_write_ram(int addr, uint8_t* dat, int size, libusb_device_handle* usb_ha
 //----------------------------------------------------------------------
 // USB load firmware
 //----------------------------------------------------------------------
-int usb_load_firmware(libusb_device_handle* usb_handle) {
+int usb_load_firmware(libusb_device_handle* usb_handle, void (*progress)(int done, int total)) {
 	int ret;
+	int lines = 0;
+
+	while (firmware[lines] != NULL) {
+		lines++;
+	}
 
 	// Take the CPU into RESET
 	uint8_t dat = 1;
@@ -85,6 +90,9 @@ int usb_load_firmware(libusb_device_handle* usb_handle) {
 				return -1;
 			}
 		}
+		if (progress != NULL) {
+			progress(i + 1, lines);
+		}
 	}
 
 	// Take the CPU out of RESET (run)
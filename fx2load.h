@@ -2,4 +2,5 @@
 
 #include "libusb.h"
 
-int usb_load_firmware(libusb_device_handle* usb_handle);
+// progress: called after each firmware record (done, total), may be NULL
+int usb_load_firmware(libusb_device_handle* usb_handle, void (*progress)(int done, int total) = NULL);